@@ -0,0 +1,153 @@
+# bench/bench.rb
+#
+# Measures what the binding costs around the Ruby callbacks. The FUSE
+# operations are called in process with RbFuse.bench_op, the way libfuse
+# would call them, so no mount or /dev/fuse is needed.
+#
+#   rake bench
+#   ruby -Iext -Ilib bench/bench.rb [-t seconds] [-o results.json]
+#
+# For every case it prints ops/s, ns/op and Ruby objects allocated per op.
+
+require 'optparse'
+require 'json'
+require 'rbfuse'
+
+# A path filesystem kept in Ruby Hashes, with the least work per callback,
+# so that what is measured is the binding.
+class HashFS
+  def initialize
+    @files = {}
+    @dirs = { "/" => [] }
+  end
+
+  def add_dir(path, entries)
+    @dirs[File.dirname(path)] << File.basename(path)
+    @dirs[path] = []
+    entries.times { |i| add_file("#{path}/f#{i}", "") }
+  end
+
+  def add_file(path, data)
+    @dirs[File.dirname(path)] << File.basename(path)
+    @files[path] = data.dup.force_encoding(Encoding::BINARY)
+  end
+
+  def getattr(path)
+    if (data = @files[path])
+      st = RbFuse::Stat.file
+      st.size = data.bytesize
+      st
+    elsif @dirs[path]
+      RbFuse::Stat.dir
+    end
+  end
+
+  def readdir(path)
+    @dirs[path]
+  end
+
+  def open(path, mode, handle)
+    @files.key?(path)
+  end
+
+  def read(path, offset, size, handle)
+    @files[path].byteslice(offset, size)
+  end
+
+  def write(path, offset, str, handle)
+    @files[path][offset, str.bytesize] = str.force_encoding(Encoding::BINARY)
+    str.bytesize
+  end
+
+  def close(path, handle)
+    true
+  end
+end
+
+FILE_SIZE = 16 * 1024 * 1024
+DIR_SIZES = [10, 1000]
+CHUNKS = [4096, 65536, 1024 * 1024]
+
+def build(root)
+  data = "x" * FILE_SIZE
+  root.add_file("/file", data)
+  DIR_SIZES.each do |n|
+    if root.is_a?(HashFS)
+      root.add_dir("/dir#{n}", n)
+    else
+      root.add_dir("/dir#{n}")
+      n.times { |i| root.add_file("/dir#{n}/f#{i}", "") }
+    end
+  end
+  root
+end
+
+def cases(writable)
+  list = [
+    ["getattr", :getattr, "/file", {}],
+    ["open+release", :open, "/file", {}],
+  ]
+  DIR_SIZES.each do |n|
+    list << ["readdir #{n}", :readdir, "/dir#{n}", {}]
+  end
+  ops = writable ? [:read, :write] : [:read]
+  ops.each do |op|
+    CHUNKS.each do |size|
+      list << ["#{op} seq #{size / 1024}k", op, "/file",
+               { :size => size, :file_size => FILE_SIZE }]
+    end
+    CHUNKS.first(2).each do |size|
+      list << ["#{op} random #{size / 1024}k", op, "/file",
+               { :size => size, :file_size => FILE_SIZE, :random => true }]
+    end
+  end
+  list
+end
+
+def allocated
+  GC.stat(:total_allocated_objects)
+end
+
+# Runs a case for about seconds: a short warmup that also sizes the run,
+# then one timed run.
+def measure(op, path, opts, seconds)
+  n = 16
+  loop do
+    t = RbFuse.bench_op(op, path, n, opts)
+    break if t > seconds / 20 || n >= 1 << 24
+    n *= 4
+  end
+  t = RbFuse.bench_op(op, path, n, opts)
+  n = [(n * seconds / t).ceil, 1].max
+  before = allocated
+  t = RbFuse.bench_op(op, path, n, opts)
+  { :ops => n, :seconds => t, :allocations => allocated - before }
+end
+
+seconds = 0.5
+output = nil
+OptionParser.new do |o|
+  o.on("-t SECONDS", Float, "time per case (#{seconds})") { |v| seconds = v }
+  o.on("-o FILE", "also write the results as JSON") { |v| output = v }
+end.parse!
+
+roots = {
+  "ruby" => [build(HashFS.new), true],
+  "memdir" => [build(RbFuse::MemDir.new), false],
+}
+
+results = []
+puts "%-8s %-18s %12s %10s %10s" % %w[root case ops/s ns/op allocs/op]
+roots.each do |name, (root, writable)|
+  RbFuse.set_root(root)
+  cases(writable).each do |label, op, path, opts|
+    r = measure(op, path, opts, seconds)
+    ns = r[:seconds] * 1e9 / r[:ops]
+    allocs = r[:allocations].to_f / r[:ops]
+    puts "%-8s %-18s %12.0f %10.0f %10.2f" % [name, label, 1e9 / ns, ns, allocs]
+    results << { :root => name, :case => label, :ops_per_sec => 1e9 / ns,
+                 :ns_per_op => ns, :allocations_per_op => allocs }
+  end
+end
+
+File.write(output, JSON.pretty_generate(results)) if output
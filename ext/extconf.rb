@@ -1,5 +1,13 @@
 require 'mkmf'
 dir_config('rbfuse_lib.so')
+have_header('ruby/thread.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_library('pthread')
+have_header('sys/epoll.h')
+have_func('rb_funcallv')
+have_func('rb_gc_stat')
+have_header('ruby/fiber/scheduler.h')
+have_func('rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h')
 if have_library('fuse_ino64') || have_library('fuse') 
   create_makefile('rbfuse_lib')
 else
@@ -0,0 +1,277 @@
+/* rbfuse_attrcache.c */
+
+/* Path keyed attribute cache used in front of the Ruby getattr callback.
+ *
+ * Entries live in a chained hash table and on an LRU list. Both positive
+ * (a struct stat) and negative (the path does not exist) results are kept,
+ * each with its own time to live. When the table is full the least
+ * recently used entry is dropped. */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rbfuse_attrcache.h"
+
+struct rf_acache_entry {
+  struct rf_acache_entry *hnext; /* hash chain */
+  struct rf_acache_entry *prev;  /* LRU list */
+  struct rf_acache_entry *next;
+  uint64_t expires;
+  uint32_t hash;
+  int negative;
+  struct stat st;
+  size_t pathlen;
+  char path[1];
+};
+
+static uint64_t
+now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* FNV-1a */
+static uint32_t
+path_hash(const char *path, size_t len) {
+  uint32_t h = 2166136261U;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)path[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static void
+lru_unlink(struct rf_attrcache *c, struct rf_acache_entry *e) {
+  if (e->prev) e->prev->next = e->next;
+  else c->lru_head = e->next;
+  if (e->next) e->next->prev = e->prev;
+  else c->lru_tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void
+lru_push_front(struct rf_attrcache *c, struct rf_acache_entry *e) {
+  e->prev = NULL;
+  e->next = c->lru_head;
+  if (c->lru_head) c->lru_head->prev = e;
+  c->lru_head = e;
+  if (c->lru_tail == NULL) c->lru_tail = e;
+}
+
+static struct rf_acache_entry **
+find_slot(struct rf_attrcache *c, const char *path, size_t len, uint32_t h) {
+  struct rf_acache_entry **slot = &c->buckets[h & (c->nbuckets - 1)];
+  while (*slot) {
+    struct rf_acache_entry *e = *slot;
+    if (e->hash == h && e->pathlen == len && memcmp(e->path, path, len) == 0)
+      return slot;
+    slot = &e->hnext;
+  }
+  return slot;
+}
+
+static void
+remove_entry(struct rf_attrcache *c, struct rf_acache_entry **slot) {
+  struct rf_acache_entry *e = *slot;
+  *slot = e->hnext;
+  lru_unlink(c, e);
+  c->count--;
+  free(e);
+}
+
+static void
+remove_by_path(struct rf_attrcache *c, const char *path, size_t len) {
+  struct rf_acache_entry **slot;
+  uint32_t h;
+  if (c->buckets == NULL) return;
+  h = path_hash(path, len);
+  slot = find_slot(c, path, len, h);
+  if (*slot) remove_entry(c, slot);
+}
+
+void
+rf_attrcache_init(struct rf_attrcache *c) {
+  memset(c, 0, sizeof(*c));
+}
+
+void
+rf_attrcache_clear(struct rf_attrcache *c) {
+  struct rf_acache_entry *e = c->lru_head;
+  while (e) {
+    struct rf_acache_entry *next = e->next;
+    free(e);
+    e = next;
+  }
+  if (c->buckets)
+    memset(c->buckets, 0, sizeof(*c->buckets) * c->nbuckets);
+  c->lru_head = c->lru_tail = NULL;
+  c->count = 0;
+}
+
+/* rf_attrcache_configure
+ *
+ * Sets the lifetimes (in seconds) and the size bound. Existing entries are
+ * dropped. A max_entries of 0 or a ttl of 0 turns the cache off.
+ */
+void
+rf_attrcache_configure(struct rf_attrcache *c, double ttl,
+                       double negative_ttl, size_t max_entries) {
+  size_t nbuckets = 16;
+
+  rf_attrcache_clear(c);
+  free(c->buckets);
+  c->buckets = NULL;
+  c->nbuckets = 0;
+
+  if (ttl <= 0 || max_entries == 0) {
+    c->max_entries = 0;
+    return;
+  }
+
+  while (nbuckets < max_entries) nbuckets <<= 1;
+  c->buckets = calloc(nbuckets, sizeof(*c->buckets));
+  if (c->buckets == NULL) {
+    c->max_entries = 0;
+    return;
+  }
+  c->nbuckets = nbuckets;
+  c->max_entries = max_entries;
+  c->ttl_ns = (uint64_t)(ttl * 1e9);
+  c->negative_ttl_ns = negative_ttl > 0 ? (uint64_t)(negative_ttl * 1e9) : 0;
+}
+
+/* rf_attrcache_lookup
+ *
+ * Returns RF_ACACHE_HIT and fills st, RF_ACACHE_NEGATIVE if the path is
+ * known not to exist, or RF_ACACHE_MISS.
+ */
+int
+rf_attrcache_lookup(struct rf_attrcache *c, const char *path,
+                    struct stat *st) {
+  struct rf_acache_entry **slot;
+  struct rf_acache_entry *e;
+  size_t len;
+  uint32_t h;
+
+  if (c->max_entries == 0) return RF_ACACHE_MISS;
+
+  len = strlen(path);
+  h = path_hash(path, len);
+  slot = find_slot(c, path, len, h);
+  e = *slot;
+  if (e == NULL) {
+    c->misses++;
+    return RF_ACACHE_MISS;
+  }
+  if (e->expires <= now_ns()) {
+    remove_entry(c, slot);
+    c->misses++;
+    return RF_ACACHE_MISS;
+  }
+
+  lru_unlink(c, e);
+  lru_push_front(c, e);
+  c->hits++;
+  if (e->negative) return RF_ACACHE_NEGATIVE;
+  memcpy(st, &e->st, sizeof(struct stat));
+  return RF_ACACHE_HIT;
+}
+
+/* rf_attrcache_store
+ *
+ * Remembers the attributes of path. A NULL st records a negative entry.
+ */
+void
+rf_attrcache_store(struct rf_attrcache *c, const char *path,
+                   const struct stat *st) {
+  struct rf_acache_entry **slot;
+  struct rf_acache_entry *e;
+  uint64_t ttl;
+  size_t len;
+  uint32_t h;
+
+  if (c->max_entries == 0) return;
+  ttl = st ? c->ttl_ns : c->negative_ttl_ns;
+  if (ttl == 0) return;
+
+  len = strlen(path);
+  h = path_hash(path, len);
+  slot = find_slot(c, path, len, h);
+  e = *slot;
+  if (e) {
+    lru_unlink(c, e);
+  } else {
+    if (c->count >= c->max_entries) {
+      struct rf_acache_entry *victim = c->lru_tail;
+      remove_by_path(c, victim->path, victim->pathlen);
+      c->evictions++;
+      slot = find_slot(c, path, len, h);
+    }
+    e = malloc(sizeof(*e) + len);
+    if (e == NULL) return;
+    e->hash = h;
+    e->pathlen = len;
+    memcpy(e->path, path, len + 1);
+    e->hnext = NULL;
+    *slot = e;
+    c->count++;
+  }
+
+  e->expires = now_ns() + ttl;
+  e->negative = (st == NULL);
+  if (st) memcpy(&e->st, st, sizeof(struct stat));
+  lru_push_front(c, e);
+}
+
+void
+rf_attrcache_invalidate(struct rf_attrcache *c, const char *path) {
+  if (c->max_entries == 0) return;
+  remove_by_path(c, path, strlen(path));
+}
+
+/* rf_attrcache_invalidate_tree
+ *
+ * Drops path and every entry below it. Used for directory renames and
+ * removals, where cached children would otherwise outlive their parent.
+ */
+void
+rf_attrcache_invalidate_tree(struct rf_attrcache *c, const char *path) {
+  struct rf_acache_entry *e;
+  size_t len;
+
+  if (c->max_entries == 0) return;
+  len = strlen(path);
+  e = c->lru_head;
+  while (e) {
+    struct rf_acache_entry *next = e->next;
+    if (e->pathlen >= len && memcmp(e->path, path, len) == 0 &&
+        (e->pathlen == len || e->path[len] == '/'))
+      remove_by_path(c, e->path, e->pathlen);
+    e = next;
+  }
+}
+
+/* rf_attrcache_invalidate_parent
+ *
+ * Creating or removing an entry changes its directory (nlink, times), so
+ * the cached attributes of the parent are dropped as well.
+ */
+void
+rf_attrcache_invalidate_parent(struct rf_attrcache *c, const char *path) {
+  const char *slash;
+
+  if (c->max_entries == 0) return;
+  slash = strrchr(path, '/');
+  if (slash == NULL) return;
+  if (slash == path) {
+    remove_by_path(c, "/", 1);
+  } else {
+    remove_by_path(c, path, slash - path);
+  }
+}
@@ -0,0 +1,47 @@
+/* rbfuse_attrcache.h */
+
+/* A small path-keyed cache of struct stat results, so that repeated
+ * getattr requests (and the existence checks done before mutations)
+ * do not have to call into Ruby every time. */
+
+#ifndef __RBFUSE_ATTRCACHE_H_
+#define __RBFUSE_ATTRCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define RF_ACACHE_MISS      0
+#define RF_ACACHE_HIT       1
+#define RF_ACACHE_NEGATIVE -1
+
+struct rf_acache_entry;
+
+struct rf_attrcache {
+  uint64_t ttl_ns;          /* lifetime of a positive entry */
+  uint64_t negative_ttl_ns; /* lifetime of a "no such entry" result */
+  size_t max_entries;       /* 0 disables the cache */
+  size_t count;
+  size_t nbuckets;
+  struct rf_acache_entry **buckets;
+  struct rf_acache_entry *lru_head; /* most recently used */
+  struct rf_acache_entry *lru_tail; /* eviction candidate */
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+};
+
+void rf_attrcache_init(struct rf_attrcache *c);
+void rf_attrcache_configure(struct rf_attrcache *c, double ttl,
+                            double negative_ttl, size_t max_entries);
+int  rf_attrcache_lookup(struct rf_attrcache *c, const char *path,
+                         struct stat *st);
+void rf_attrcache_store(struct rf_attrcache *c, const char *path,
+                        const struct stat *st);
+void rf_attrcache_invalidate(struct rf_attrcache *c, const char *path);
+void rf_attrcache_invalidate_tree(struct rf_attrcache *c, const char *path);
+void rf_attrcache_invalidate_parent(struct rf_attrcache *c, const char *path);
+void rf_attrcache_clear(struct rf_attrcache *c);
+
+#endif
@@ -19,111 +19,754 @@
 #include <sys/param.h>
 #include <sys/uio.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 
-struct fuse *fuse_instance = NULL;
-struct fuse_chan *fusech = NULL;
-static char *mounted_at = NULL;
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "rbfuse_fuse.h"
+#include "rbfuse_stats.h"
+#include "rbfuse_trace.h"
+
+/* Mounts
+ *
+ * A mount is counted once for its owner (until fusefs_unmount), once for
+ * the reactor (until it is closed) and once for every command being
+ * processed or reply held on it. Only when the count drops to zero is it
+ * unmounted from the kernel and its session destroyed, so no thread is
+ * ever left reading from a freed channel.
+ */
+struct fusefs_mount {
+  struct fusefs_mount *next;
+  unsigned long id;
+  int refs;
+  int closed;              /* taken out of the reactor */
+  int unmounted;           /* by reactor_unmount_all; only the channel is left */
+  struct fuse *fuse;       /* NULL on a lowlevel mount */
+  struct fuse_session *se;
+  struct fuse_chan *ch;
+  char *mountpoint;
+  void *ll_data;
+  void (*ll_destroy)(void *);
+  void *data;
+  void (*release)(void *);
+};
+
+/* The reactor
+ *
+ * Every open mount, and on Linux an epoll set of their channels, so that
+ * finding the mounts with a command waiting costs the same however many
+ * there are. Elsewhere they are poll()ed one by one. The read end of the
+ * signal pipe (see fusefs_ehandler) is in the epoll set too, under id 0.
+ */
+static struct {
+  pthread_mutex_t lock;
+  struct fusefs_mount *list;
+  unsigned long next_id;
+  int epfd;                /* -1 before the first mount, or without epoll */
+} reactor = { PTHREAD_MUTEX_INITIALIZER, NULL, 1, -1 };
+
+/* The mount whose command is being processed on this thread */
+static __thread struct fusefs_mount *current = NULL;
+
+/* The request being handled on this thread by the lowlevel engine, which
+ * has no fuse_get_context(). */
+static __thread fuse_req_t current_req = NULL;
+
+/* Set by fusefs_ehandler, which also writes a byte to sigpipe to wake a
+ * thread waiting in the reactor. */
+static volatile sig_atomic_t signalled = 0;
+static int sigpipe[2] = { -1, -1 };
 
 static int set_one_signal_handler(int signal, void (*handler)(int));
 
-int fusefs_fd() {
-  if(fusech == NULL)
-    return -1;
-  return fuse_chan_fd(fusech);
+static void
+mount_teardown(struct fusefs_mount *m) {
+  if (m->unmounted)
+    fuse_chan_destroy(m->ch);
+  else
+    fuse_unmount(m->mountpoint, m->ch);
+  if (m->fuse)
+    fuse_destroy(m->fuse);
+  else
+    fuse_session_destroy(m->se);
+  if (m->ll_destroy)
+    m->ll_destroy(m->ll_data);
+  if (m->release)
+    m->release(m->data);
+  free(m->mountpoint);
+  free(m);
 }
 
-int
-fusefs_unmount() {
-  char buf[128];
-
-  if (mounted_at && fusech) {
-    fuse_unmount(mounted_at, fusech);
-    sprintf(buf, "/sbin/umount %s", mounted_at);
-    system(buf);
-  }
-  if (fuse_instance)
-    fuse_destroy(fuse_instance);
-  fuse_instance = NULL;
-  free(mounted_at);
-  fusech = NULL;
-  return 0;
+void
+fusefs_hold(struct fusefs_mount *m) {
+  __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
 }
 
+void
+fusefs_put(struct fusefs_mount *m) {
+  if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    mount_teardown(m);
+}
+
+/* mount_get
+ *
+ * The open mount with this id, held, or NULL if it has been closed.
+ */
+static struct fusefs_mount *
+mount_get(unsigned long id) {
+  struct fusefs_mount *m;
+
+  pthread_mutex_lock(&reactor.lock);
+  for (m = reactor.list; m; m = m->next) {
+    if (m->id == id) {
+      fusefs_hold(m);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&reactor.lock);
+  return m;
+}
+
+/* mount_close
+ *
+ * Takes m out of the reactor: no further commands are read from it.
+ */
 static void
-fusefs_ehandler() {
-  if (fuse_instance != NULL) {
-    fusefs_unmount();
+mount_close(struct fusefs_mount *m) {
+  struct fusefs_mount **p;
+  int found = 0;
+
+  pthread_mutex_lock(&reactor.lock);
+  for (p = &reactor.list; *p; p = &(*p)->next) {
+    if (*p == m) {
+      *p = m->next;
+      found = 1;
+      break;
+    }
+  }
+  if (found) {
+#ifdef HAVE_SYS_EPOLL_H
+    if (reactor.epfd >= 0)
+      epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, fuse_chan_fd(m->ch), NULL);
+#endif
+    m->closed = 1;
   }
+  pthread_mutex_unlock(&reactor.lock);
+  if (found)
+    fusefs_put(m);
 }
 
-int
-fusefs_setup(char *mountpoint, const struct fuse_operations *op, struct fuse_args *opts) {
-  fusech = NULL;
-  if (fuse_instance != NULL) {
-    return 0;
+static int
+reactor_empty() {
+  return __atomic_load_n(&reactor.list, __ATOMIC_RELAXED) == NULL;
+}
+
+/* fusefs_unmount
+ *
+ * Unmounts m once the commands being processed on it are done. m must not
+ * be used after this.
+ */
+void
+fusefs_unmount(struct fusefs_mount *m) {
+  mount_close(m);
+  fusefs_put(m);
+}
+
+/* reactor_unmount_all
+ *
+ * Unmounts everything from the kernel. The threads reading commands then
+ * see their mounts go away and close them.
+ */
+static void
+reactor_unmount_all(void) {
+  struct fusefs_mount *m;
+
+  pthread_mutex_lock(&reactor.lock);
+  for (m = reactor.list; m; m = m->next) {
+    if (!m->unmounted) {
+      m->unmounted = 1;
+      fuse_unmount(m->mountpoint, NULL);
+    }
   }
-  if (mounted_at != NULL) {
-    return 0;
+  pthread_mutex_unlock(&reactor.lock);
+}
+
+/* fusefs_ehandler
+ *
+ * On SIGHUP, SIGINT or SIGTERM: only notes the signal and wakes the
+ * reactor, which does the unmounting (reactor_signal_check) outside the
+ * handler, where taking the reactor lock is safe.
+ */
+static void
+fusefs_ehandler(int sig) {
+  int saved = errno;
+
+  signalled = 1;
+  if (sigpipe[1] >= 0 && write(sigpipe[1], "", 1) < 0) {
+    /* the pipe is full: a wakeup is already pending */
   }
+  errno = saved;
+}
+
+static void
+fusefs_atexit(void) {
+  reactor_unmount_all();
+}
+
+/* reactor_signal_check
+ *
+ * Called by the threads running the reactor: acts on a signal caught by
+ * fusefs_ehandler.
+ */
+static void
+reactor_signal_check(void) {
+  char buf[64];
 
+  if (!signalled)
+    return;
+  signalled = 0;
+  while (read(sigpipe[0], buf, sizeof(buf)) > 0)
+    ;
+  reactor_unmount_all();
+}
+
+/* sigpipe_open
+ *
+ * Creates the non-blocking pipe fusefs_ehandler wakes the reactor with.
+ */
+static int
+sigpipe_open(void) {
+  int i;
+
+  if (pipe(sigpipe) == -1)
+    return -1;
+  for (i = 0; i < 2; i++) {
+    fcntl(sigpipe[i], F_SETFL, fcntl(sigpipe[i], F_GETFL) | O_NONBLOCK);
+    fcntl(sigpipe[i], F_SETFD, FD_CLOEXEC);
+  }
+  return 0;
+}
+
+/* mount_start
+ *
+ * Common tail of fusefs_setup and fusefs_setup_ll, once the session
+ * exists: adds the mount to the reactor.
+ */
+static struct fusefs_mount *
+mount_start(struct fusefs_mount *m) {
+  static int handlers = 0;
+  int ok = 1;
+
+  if (!handlers) {
+    /* Set signal handlers */
+    if ((sigpipe[0] < 0 && sigpipe_open() == -1) ||
+        set_one_signal_handler(SIGHUP, fusefs_ehandler) == -1 ||
+        set_one_signal_handler(SIGINT, fusefs_ehandler) == -1 ||
+        set_one_signal_handler(SIGTERM, fusefs_ehandler) == -1 ||
+        set_one_signal_handler(SIGPIPE, SIG_IGN) == -1) {
+      m->release = NULL;
+      m->refs = 1;
+      fusefs_put(m);
+      return NULL;
+    }
+    atexit(fusefs_atexit);
+    handlers = 1;
+  }
+
+  /* Several threads may wait on the channel at once; whichever loses the
+   * race to read a request must get EAGAIN rather than block. */
+  fcntl(fuse_chan_fd(m->ch), F_SETFL,
+        fcntl(fuse_chan_fd(m->ch), F_GETFL) | O_NONBLOCK);
+
+  m->refs = 2;  /* the owner and the reactor */
+  pthread_mutex_lock(&reactor.lock);
+  m->id = reactor.next_id++;
+#ifdef HAVE_SYS_EPOLL_H
+  if (reactor.epfd < 0) {
+    reactor.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor.epfd >= 0) {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.u64 = 0;
+      epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, sigpipe[0], &ev);
+    }
+  }
+  if (reactor.epfd >= 0) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = m->id;
+    ok = epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, fuse_chan_fd(m->ch), &ev) == 0;
+  }
+#endif
+  if (ok) {
+    m->next = reactor.list;
+    reactor.list = m;
+  }
+  pthread_mutex_unlock(&reactor.lock);
+  if (!ok) {
+    m->release = NULL;
+    m->refs = 1;
+    fusefs_put(m);
+    return NULL;
+  }
+  return m;
+}
+
+static struct fusefs_mount *
+mount_new(char *mountpoint, struct fuse_args *opts, void *data,
+          void (*release)(void *)) {
+  struct fusefs_mount *m = calloc(1, sizeof(*m));
+
+  if (m == NULL)
+    return NULL;
+  m->data = data;
+  m->release = release;
+  m->mountpoint = strdup(mountpoint);
+  if (m->mountpoint == NULL) {
+    free(m);
+    return NULL;
+  }
   /* First, mount us */
-  fusech = fuse_mount(mountpoint, opts);
-  if (fusech == NULL) return 0;
+  m->ch = fuse_mount(mountpoint, opts);
+  if (m->ch == NULL) {
+    free(m->mountpoint);
+    free(m);
+    return NULL;
+  }
+  return m;
+}
+
+/* fusefs_setup
+ *
+ * Mounts a fuse_operations table through libfuse's path layer. Returns
+ * NULL if it could not be mounted. The owner's data is attached to the
+ * mount before its first command can be read (fusefs_data); release is
+ * called on it when the mount is torn down, on whichever thread drops the
+ * last reference, and never if NULL was returned.
+ */
+struct fusefs_mount *
+fusefs_setup(char *mountpoint, const struct fuse_operations *op,
+             struct fuse_args *opts, void *data, void (*release)(void *)) {
+  struct fusefs_mount *m = mount_new(mountpoint, opts, data, release);
 
-  fuse_instance = fuse_new(fusech, opts, op, sizeof(*op), NULL);
-  if (fuse_instance == NULL)
+  if (m == NULL)
+    return NULL;
+  m->fuse = fuse_new(m->ch, opts, op, sizeof(*op), NULL);
+  if (m->fuse == NULL)
     goto err_unmount;
+  m->se = fuse_get_session(m->fuse);
 
-  /* Set signal handlers */
-  if (set_one_signal_handler(SIGHUP, fusefs_ehandler) == -1 ||
-      set_one_signal_handler(SIGINT, fusefs_ehandler) == -1 ||
-      set_one_signal_handler(SIGTERM, fusefs_ehandler) == -1 ||
-      set_one_signal_handler(SIGPIPE, SIG_IGN) == -1)
-    return 0;
+  return mount_start(m);
+err_unmount:
+  fuse_unmount(mountpoint, m->ch);
+  free(m->mountpoint);
+  free(m);
+  return NULL;
+}
 
-  atexit(fusefs_ehandler);
+/* fusefs_setup_ll
+ *
+ * Like fusefs_setup, but mounts a fuse_lowlevel_ops table directly, with
+ * no libfuse path layer in between. destroy is called on userdata once
+ * the session is gone, or right away if it could not be mounted.
+ */
+struct fusefs_mount *
+fusefs_setup_ll(char *mountpoint, const struct fuse_lowlevel_ops *op,
+                size_t op_size, struct fuse_args *opts, void *userdata,
+                void (*destroy)(void *userdata), void *data,
+                void (*release)(void *)) {
+  struct fusefs_mount *m = mount_new(mountpoint, opts, data, release);
 
-  /* We've initialized it! */
-  mounted_at = strdup(mountpoint);
-  return 1;
-err_destroy:
-  fuse_destroy(fuse_instance);
-err_unmount:
-  fuse_unmount(mountpoint, fusech);
-  return 0;
+  if (m == NULL) {
+    destroy(userdata);
+    return NULL;
+  }
+  m->se = fuse_lowlevel_new(opts, op, op_size, userdata);
+  if (m->se == NULL) {
+    fuse_unmount(mountpoint, m->ch);
+    free(m->mountpoint);
+    free(m);
+    destroy(userdata);
+    return NULL;
+  }
+  fuse_session_add_chan(m->se, m->ch);
+  m->ll_data = userdata;
+  m->ll_destroy = destroy;
+
+  return mount_start(m);
+}
+
+void *
+fusefs_data(struct fusefs_mount *m) {
+  return m->data;
+}
+
+void *
+fusefs_ll_data(struct fusefs_mount *m) {
+  return m->ll_data;
+}
+
+int
+fusefs_mounted(struct fusefs_mount *m) {
+  return !m->closed;
+}
+
+int
+fusefs_mount_fd(struct fusefs_mount *m) {
+  return m->closed ? -1 : fuse_chan_fd(m->ch);
+}
+
+struct fusefs_mount *
+fusefs_current() {
+  return current;
+}
+
+/* fusefs_ll_chan
+ *
+ * The channel of a lowlevel mount, for notifications, or NULL.
+ */
+struct fuse_chan *
+fusefs_ll_chan(struct fusefs_mount *m) {
+  if (m->fuse != NULL || m->closed)
+    return NULL;
+  return m->ch;
+}
+
+/* fusefs_fd
+ *
+ * A descriptor that becomes readable when any mount has a command: the
+ * epoll set, or without one the channel of the only mount. Returns -1
+ * when nothing is mounted, and -2 when there are several mounts but no
+ * epoll set: no one descriptor covers them, only fusefs_wait does.
+ */
+int
+fusefs_fd() {
+  int fd = -1;
+
+  pthread_mutex_lock(&reactor.lock);
+  if (reactor.list != NULL) {
+    if (reactor.epfd >= 0)
+      fd = reactor.epfd;
+    else if (reactor.list->next == NULL)
+      fd = fuse_chan_fd(reactor.list->ch);
+    else
+      fd = -2;
+  }
+  pthread_mutex_unlock(&reactor.lock);
+  return fd;
+}
+
+void
+fusefs_set_request(fuse_req_t req) {
+  current_req = req;
 }
 
 int
 fusefs_uid() {
-  struct fuse_context *context = fuse_get_context();
+  struct fuse_context *context;
+  if (current_req) return fuse_req_ctx(current_req)->uid;
+  if (current == NULL || current->fuse == NULL) return -1;
+  context = fuse_get_context();
   if (context) return context->uid;
   return -1;
 }
 
 int
 fusefs_gid() {
-  struct fuse_context *context = fuse_get_context();
+  struct fuse_context *context;
+  if (current_req) return fuse_req_ctx(current_req)->gid;
+  if (current == NULL || current->fuse == NULL) return -1;
+  context = fuse_get_context();
   if (context) return context->gid;
   return -1;
 }
 
 int
-fusefs_process() {
-  /* This gets exactly 1 command out of fuse fd. */
-  /* Ideally, this is triggered after a select() returns */
-  if (fuse_instance != NULL) {
-    struct fuse_cmd *cmd;
+fusefs_pid() {
+  struct fuse_context *context;
+  if (current_req) return fuse_req_ctx(current_req)->pid;
+  if (current == NULL || current->fuse == NULL) return -1;
+  context = fuse_get_context();
+  if (context) return context->pid;
+  return -1;
+}
 
-    if (fuse_exited(fuse_instance))
-      return 0;
+/* Receive buffers, one per thread processing commands. */
+static pthread_key_t recv_buf_key;
+static pthread_once_t recv_buf_once = PTHREAD_ONCE_INIT;
+static __thread size_t recv_buf_size = 0;
 
-    cmd = fuse_read_cmd(fuse_instance);
-    if (cmd == NULL)
-      return 1;
+static void
+recv_buf_key_init(void) {
+  pthread_key_create(&recv_buf_key, free);
+}
 
-    fuse_process_cmd(fuse_instance, cmd);
+static char *
+recv_buf(size_t size) {
+  char *buf;
+
+  pthread_once(&recv_buf_once, recv_buf_key_init);
+  buf = pthread_getspecific(recv_buf_key);
+  if (buf == NULL || recv_buf_size < size) {
+    char *p = realloc(buf, size);
+    if (p == NULL)
+      return NULL;
+    buf = p;
+    recv_buf_size = size;
+    pthread_setspecific(recv_buf_key, buf);
   }
+  return buf;
+}
+
+/* mount_process
+ *
+ * Reads one command of m and processes it. On FUSE 2.9 and later this goes
+ * through fuse_session_receive_buf, so write data can arrive spliced into
+ * a pipe (-osplice_read) and reach write_buf without being copied.
+ * Returns 1 if a command was processed, 0 if none was ready, -1 once the
+ * filesystem has exited.
+ */
+static int
+mount_process(struct fusefs_mount *m) {
+  struct fusefs_mount *outer = current;
+  struct fuse_session *se = m->se;
+  struct fuse_chan *ch = m->ch;
+  size_t bufsize = fuse_chan_bufsize(m->ch);
+  char *buf;
+  int res;
+
+#if FUSE_VERSION >= 29
+  struct fuse_buf fbuf;
+
+  buf = recv_buf(bufsize);
+  if (buf == NULL)
+    return 0;
+
+  memset(&fbuf, 0, sizeof(fbuf));
+  fbuf.mem = buf;
+  fbuf.size = bufsize;
+  res = fuse_session_receive_buf(se, &fbuf, &ch);
+  if (res == 0 || fuse_session_exited(se))
+    return -1;
+  if (res < 0)
+    return 0;
+  current = m;
+  rf_stats_request_begin();
+  rf_trace_request_begin();
+  fuse_session_process_buf(se, &fbuf, ch);
+  rf_stats_request_end();
+  rf_trace_request_end();
+  current = outer;
   return 1;
+#else
+  struct fuse_cmd *cmd;
+
+  if (m->fuse != NULL) {
+    if (fuse_exited(m->fuse))
+      return -1;
+    cmd = fuse_read_cmd(m->fuse);
+    if (cmd == NULL)
+      return 0;
+    current = m;
+    rf_stats_request_begin();
+    rf_trace_request_begin();
+    fuse_process_cmd(m->fuse, cmd);
+    rf_stats_request_end();
+    rf_trace_request_end();
+    current = outer;
+    return 1;
+  }
+
+  buf = recv_buf(bufsize);
+  if (buf == NULL)
+    return 0;
+  res = fuse_chan_recv(&ch, buf, bufsize);
+  if (res == 0 || fuse_session_exited(se))
+    return -1;
+  if (res < 0)
+    return 0;
+  current = m;
+  rf_stats_request_begin();
+  rf_trace_request_begin();
+  fuse_session_process(se, buf, res, ch);
+  rf_stats_request_end();
+  rf_trace_request_end();
+  current = outer;
+  return 1;
+#endif
+}
+
+/* reactor_ready
+ *
+ * Fills ids with up to max mounts that have a command waiting, without
+ * blocking, and returns how many.
+ */
+static int
+reactor_ready(unsigned long *ids, int max) {
+  struct pollfd *fds;
+  unsigned long *all;
+  struct fusefs_mount *m;
+  int i, n = 0, count = 0;
+
+  reactor_signal_check();
+#ifdef HAVE_SYS_EPOLL_H
+  if (reactor.epfd >= 0) {
+    struct epoll_event evs[16];
+    if (max > 16)
+      max = 16;
+    do {
+      n = epoll_wait(reactor.epfd, evs, max, 0);
+    } while (n < 0 && errno == EINTR);
+    for (i = 0; i < n; i++)
+      if (evs[i].data.u64 != 0)  /* 0 is the signal pipe */
+        ids[count++] = evs[i].data.u64;
+    return count;
+  }
+#endif
+
+  pthread_mutex_lock(&reactor.lock);
+  for (m = reactor.list; m; m = m->next)
+    n++;
+  fds = malloc(n * sizeof(*fds) + 1);
+  all = malloc(n * sizeof(*all) + 1);
+  if (fds == NULL || all == NULL) {
+    pthread_mutex_unlock(&reactor.lock);
+    free(fds);
+    free(all);
+    return 0;
+  }
+  for (i = 0, m = reactor.list; m; m = m->next, i++) {
+    fds[i].fd = fuse_chan_fd(m->ch);
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+    all[i] = m->id;
+  }
+  pthread_mutex_unlock(&reactor.lock);
+
+  if (n > 0 && poll(fds, n, 0) > 0) {
+    for (i = 0; i < n && count < max; i++)
+      if (fds[i].revents)
+        ids[count++] = all[i];
+  }
+  free(fds);
+  free(all);
+  return count;
+}
+
+int
+fusefs_process() {
+  /* This gets exactly 1 command out of the first mount that has one. */
+  /* Ideally, this is triggered after a select() on fusefs_fd returns */
+  struct fusefs_mount *m;
+  unsigned long id;
+
+  if (reactor_ready(&id, 1) == 1 && (m = mount_get(id)) != NULL) {
+    if (mount_process(m) < 0)
+      mount_close(m);
+    fusefs_put(m);
+  }
+  return !reactor_empty();
+}
+
+/* fusefs_drain
+ *
+ * Processes every command that can be read without blocking, from every
+ * mount, stopping early once *stop becomes non-zero. A mount that has
+ * exited is closed. Returns the number of commands processed, or -1 once
+ * no mount is left.
+ */
+int
+fusefs_drain(const volatile int *stop) {
+  int n = 0;
+
+  while (!*stop) {
+    unsigned long ids[16];
+    int i, ready, done = 0;
+
+    ready = reactor_ready(ids, 16);
+    for (i = 0; i < ready && !*stop; i++) {
+      struct fusefs_mount *m = mount_get(ids[i]);
+      int res;
+      if (m == NULL)
+        continue;
+      res = mount_process(m);
+      if (res < 0)
+        mount_close(m);
+      else
+        done += res;
+      fusefs_put(m);
+    }
+    if (done == 0)
+      break;
+    n += done;
+  }
+  return reactor_empty() ? -1 : n;
+}
+
+/* fusefs_wait
+ *
+ * Blocks until a mount has a command to read or a signal was caught
+ * (returns 1), or wakefd becomes readable (returns 0). Returns -1 on
+ * error or when nothing is mounted.
+ */
+int
+fusefs_wait(int wakefd) {
+  struct pollfd *fds;
+  struct fusefs_mount *m;
+  int nfds = 0;
+  int i, res;
+
+  pthread_mutex_lock(&reactor.lock);
+  if (reactor.list == NULL) {
+    pthread_mutex_unlock(&reactor.lock);
+    return -1;
+  }
+  if (reactor.epfd >= 0) {
+    nfds = 1;
+  } else {
+    for (m = reactor.list; m; m = m->next)
+      nfds++;
+  }
+  fds = malloc((nfds + 2) * sizeof(*fds));
+  if (fds == NULL) {
+    pthread_mutex_unlock(&reactor.lock);
+    return -1;
+  }
+  if (reactor.epfd >= 0) {
+    fds[0].fd = reactor.epfd;
+  } else {
+    for (i = 0, m = reactor.list; m; m = m->next, i++)
+      fds[i].fd = fuse_chan_fd(m->ch);
+    fds[nfds++].fd = sigpipe[0];
+  }
+  pthread_mutex_unlock(&reactor.lock);
+  for (i = 0; i < nfds; i++) {
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+  }
+  if (wakefd >= 0) {
+    fds[nfds].fd = wakefd;
+    fds[nfds].events = POLLIN;
+    fds[nfds].revents = 0;
+  }
+
+  do {
+    res = poll(fds, nfds + (wakefd >= 0), -1);
+  } while (res < 0 && errno == EINTR);
+  if (res < 0) {
+    free(fds);
+    return -1;
+  }
+  res = wakefd >= 0 && fds[nfds].revents ? 0 : 1;
+  free(fds);
+  reactor_signal_check();
+  return res;
 }
 
 
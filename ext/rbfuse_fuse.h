@@ -7,13 +7,43 @@
 #define __FUSEFS_FUSE_H_
 
 struct fuse_args;
+struct fuse_operations;
+struct fuse_lowlevel_ops;
+struct fuse_req;
+struct fuse_chan;
+
+/* One mounted filesystem. Any number can be mounted at once; the commands
+ * of all of them are read through one reactor (fusefs_wait, fusefs_drain). */
+struct fusefs_mount;
+
+struct fusefs_mount *fusefs_setup(char *mountpoint,
+                                  const struct fuse_operations *op,
+                                  struct fuse_args *opts, void *data,
+                                  void (*release)(void *data));
+struct fusefs_mount *fusefs_setup_ll(char *mountpoint,
+                                     const struct fuse_lowlevel_ops *op,
+                                     size_t op_size, struct fuse_args *opts,
+                                     void *userdata,
+                                     void (*destroy)(void *userdata),
+                                     void *data,
+                                     void (*release)(void *data));
+void *fusefs_data(struct fusefs_mount *m);
+void *fusefs_ll_data(struct fusefs_mount *m);
+int   fusefs_mounted(struct fusefs_mount *m);
+int   fusefs_mount_fd(struct fusefs_mount *m);
+void  fusefs_hold(struct fusefs_mount *m);
+void  fusefs_put(struct fusefs_mount *m);
+void  fusefs_unmount(struct fusefs_mount *m);
+struct fusefs_mount *fusefs_current();
+struct fuse_chan *fusefs_ll_chan(struct fusefs_mount *m);
 
 int fusefs_fd();
-int fusefs_unmount();
-int fusefs_ehandler();
-int fusefs_setup(char *mountpoint, const struct fuse_operations *op, struct fuse_args *opts);
 int fusefs_process();
+int fusefs_wait(int wakefd);
+int fusefs_drain(const volatile int *stop);
+void fusefs_set_request(struct fuse_req *req);
 int fusefs_uid();
 int fusefs_gid();
+int fusefs_pid();
 
 #endif
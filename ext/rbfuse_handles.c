@@ -0,0 +1,236 @@
+/* rbfuse_handles.c */
+
+/* Handle table.
+ *
+ * One slot per open file, holding the handle object passed to the Ruby
+ * callbacks and whatever must stay alive while FUSE uses the file (the IO
+ * returned by read, see rf_read_buf). Free slots are kept on a list, so
+ * open and close are O(1). The id given to FUSE is the slot index plus
+ * one in the low 32 bits and the slot's generation in the high 32 bits;
+ * a stale id, from a slot since closed and reused, finds nothing. The
+ * whole table is marked through one hidden object. All calls are made
+ * with the GVL held.
+ *
+ * A handle may also own a write-back buffer (struct rf_wbuf); the table
+ * only allocates, finds and frees it, flushing is up to rbfuse_lib.c. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ruby.h>
+
+#include "rbfuse_handles.h"
+
+#ifndef RUBY_TYPED_FREE_IMMEDIATELY
+#define RUBY_TYPED_FREE_IMMEDIATELY 0
+#endif
+
+struct rf_handle {
+  VALUE obj;       /* Qundef while free */
+  VALUE pin;
+  struct rf_wbuf *wbuf;
+  uint32_t gen;
+  uint32_t next_free;
+};
+
+static struct {
+  struct rf_handle *slots;
+  uint32_t size;
+  uint32_t used;
+  uint32_t free_head; /* index + 1, 0 for none */
+  uint32_t buffered;  /* handles with a wbuf */
+} handles;
+
+static void
+handles_mark(void *ptr) {
+  uint32_t i;
+  for (i = 0; i < handles.size; i++) {
+    if (handles.slots[i].obj != Qundef) {
+      rb_gc_mark(handles.slots[i].obj);
+      rb_gc_mark(handles.slots[i].pin);
+      if (handles.slots[i].wbuf)
+        rb_gc_mark(handles.slots[i].wbuf->target);
+    }
+  }
+}
+
+static size_t
+handles_memsize(const void *ptr) {
+  return handles.size * sizeof(struct rf_handle);
+}
+
+static const rb_data_type_t handles_type = {
+  .wrap_struct_name = "RbFuse::HandleTable",
+  .function = {
+    .dmark = handles_mark,
+    .dsize = handles_memsize,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static struct rf_handle *
+slot_of(uint64_t fh) {
+  uint32_t idx = (uint32_t)fh;
+  struct rf_handle *h;
+
+  if (idx == 0 || idx > handles.size)
+    return NULL;
+  h = &handles.slots[idx - 1];
+  if (h->obj == Qundef || h->gen != (uint32_t)(fh >> 32))
+    return NULL;
+  return h;
+}
+
+/* rf_handle_open
+ *
+ * Stores obj in a free slot and returns its id.
+ */
+uint64_t
+rf_handle_open(VALUE obj) {
+  struct rf_handle *h;
+  uint32_t idx;
+
+  if (handles.free_head == 0) {
+    uint32_t size = handles.size ? handles.size * 2 : 64;
+    struct rf_handle *slots;
+    uint32_t i;
+
+    slots = realloc(handles.slots, size * sizeof(*slots));
+    if (slots == NULL)
+      rb_memerror();
+    for (i = handles.size; i < size; i++) {
+      slots[i].obj = Qundef;
+      slots[i].pin = Qnil;
+      slots[i].wbuf = NULL;
+      slots[i].gen = 0;
+      slots[i].next_free = i + 1 < size ? i + 2 : 0;
+    }
+    handles.free_head = handles.size + 1;
+    handles.slots = slots;
+    handles.size = size;
+  }
+
+  idx = handles.free_head;
+  h = &handles.slots[idx - 1];
+  handles.free_head = h->next_free;
+  h->obj = obj;
+  h->pin = Qnil;
+  handles.used++;
+  return ((uint64_t)h->gen << 32) | idx;
+}
+
+/* rf_handle_get
+ *
+ * The handle object of fh, or nil if fh is not open.
+ */
+VALUE
+rf_handle_get(uint64_t fh) {
+  struct rf_handle *h = slot_of(fh);
+  return h ? h->obj : Qnil;
+}
+
+void
+rf_handle_set(uint64_t fh, VALUE obj) {
+  struct rf_handle *h = slot_of(fh);
+  if (h)
+    h->obj = obj;
+}
+
+/* rf_handle_pin
+ *
+ * Keeps val referenced until the next pin or the close of fh.
+ */
+void
+rf_handle_pin(uint64_t fh, VALUE val) {
+  struct rf_handle *h = slot_of(fh);
+  if (h)
+    h->pin = val;
+}
+
+void
+rf_handle_close(uint64_t fh) {
+  struct rf_handle *h = slot_of(fh);
+  if (h == NULL)
+    return;
+  if (h->wbuf) {
+    free(h->wbuf->data);
+    free(h->wbuf);
+    h->wbuf = NULL;
+    handles.buffered--;
+  }
+  h->obj = Qundef;
+  h->pin = Qnil;
+  h->gen = (h->gen + 1) & 0x7fffffff; /* the top bit of fh is RF_MEMFS_FH */
+  h->next_free = handles.free_head;
+  handles.free_head = (uint32_t)(h - handles.slots) + 1;
+  handles.used--;
+}
+
+size_t
+rf_handle_count(void) {
+  return handles.used;
+}
+
+/* rf_handle_buffer
+ *
+ * Gives fh a write-back buffer of limit bytes, for a file of the mount
+ * owner. Returns -1 if it could not be allocated, in which case writes
+ * simply go through unbuffered.
+ */
+int
+rf_handle_buffer(uint64_t fh, size_t limit, const void *owner) {
+  struct rf_handle *h = slot_of(fh);
+  struct rf_wbuf *w;
+
+  if (h == NULL || h->wbuf)
+    return -1;
+  w = malloc(sizeof(*w));
+  if (w == NULL)
+    return -1;
+  w->data = malloc(limit);
+  if (w->data == NULL) {
+    free(w);
+    return -1;
+  }
+  w->target = Qnil;
+  w->owner = owner;
+  w->offset = 0;
+  w->len = 0;
+  w->limit = limit;
+  w->err = 0;
+  h->wbuf = w;
+  handles.buffered++;
+  return 0;
+}
+
+struct rf_wbuf *
+rf_handle_wbuf(uint64_t fh) {
+  struct rf_handle *h = slot_of(fh);
+  return h ? h->wbuf : NULL;
+}
+
+/* rf_handle_dirty
+ *
+ * An open handle holding buffered data for target on the mount owner, or
+ * 0 if there is none. Costs nothing while no handle is buffered.
+ */
+uint64_t
+rf_handle_dirty(VALUE target, const void *owner) {
+  uint32_t i;
+
+  if (handles.buffered == 0)
+    return 0;
+  for (i = 0; i < handles.size; i++) {
+    struct rf_handle *h = &handles.slots[i];
+    if (h->obj != Qundef && h->wbuf && h->wbuf->len > 0 &&
+        h->wbuf->owner == owner && rb_eql(h->wbuf->target, target))
+      return ((uint64_t)h->gen << 32) | (i + 1);
+  }
+  return 0;
+}
+
+void
+Init_rbfuse_handles(void) {
+  VALUE table = TypedData_Wrap_Struct(0, &handles_type, &handles);
+  rb_gc_register_mark_object(table);
+}
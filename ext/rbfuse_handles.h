@@ -0,0 +1,37 @@
+/* rbfuse_handles.h */
+
+/* Open file handles. fuse_file_info.fh carries a generation-checked id
+ * into this table instead of a Ruby object reference. */
+
+#ifndef __RBFUSE_HANDLES_H_
+#define __RBFUSE_HANDLES_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <ruby.h>
+
+/* Write-back buffer of a handle opened with RbFuse.write_buffer */
+struct rf_wbuf {
+  VALUE target;  /* path (or inode) the data is written to */
+  const void *owner;  /* the mount target belongs to */
+  off_t offset;  /* file offset of data[0] */
+  size_t len;
+  size_t limit;  /* size of data */
+  char *data;
+  int err;       /* -errno of a flush not yet reported, or 0 */
+};
+
+void     Init_rbfuse_handles(void);
+uint64_t rf_handle_open(VALUE obj);
+VALUE    rf_handle_get(uint64_t fh);
+void     rf_handle_set(uint64_t fh, VALUE obj);
+void     rf_handle_pin(uint64_t fh, VALUE val);
+void     rf_handle_close(uint64_t fh);
+size_t   rf_handle_count(void);
+
+int             rf_handle_buffer(uint64_t fh, size_t limit,
+                                 const void *owner);
+struct rf_wbuf *rf_handle_wbuf(uint64_t fh);
+uint64_t        rf_handle_dirty(VALUE target, const void *owner);
+
+#endif
@@ -12,13 +12,27 @@
 
 #include <fuse.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <ruby.h>
 #include <unistd.h>
+#include <poll.h>
+
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+#include <ruby/fiber/scheduler.h>
+#endif
+
+#ifndef HAVE_RB_FUNCALLV
+#define rb_funcallv rb_funcall2
+#endif
 
 
 #ifdef DEBUG
@@ -37,9 +51,86 @@
 #define RF_RENAME   "rename"
 #define RF_CREATE   "create"
 #define RF_GETATTR  "getattr"
+#define RF_WRITE_TO_FD "write_to_fd"
+#define RF_DIRECTORY_P "directory?"
+#define RF_READDIR_WITH_STAT "readdir_with_stat"
+#define RF_LOOKUP   "lookup"
+#define RF_FORGET   "forget"
+#define RF_RENAME_NATIVE   "rename_native"
+#define RF_TRUNCATE_NATIVE "truncate_native"
+
+/* Callbacks on FuseRoot. Their IDs are interned once in Init_rbfuse_lib,
+ * and rf_set_root records which of them the root responds to. */
+enum rf_method {
+  RF_M_GETATTR,
+  RF_M_READDIR,
+  RF_M_DIRECTORY_P,
+  RF_M_OPEN,
+  RF_M_READ,
+  RF_M_WRITE,
+  RF_M_WRITE_TO_FD,
+  RF_M_CLOSE,
+  RF_M_CREATE,
+  RF_M_UNLINK,
+  RF_M_MKDIR,
+  RF_M_RMDIR,
+  RF_M_TRUNCATE,
+  RF_M_RENAME,
+  RF_M_READDIR_WITH_STAT,
+  RF_M_LOOKUP,
+  RF_M_FORGET,
+  RF_M_RENAME_NATIVE,
+  RF_M_TRUNCATE_NATIVE,
+  RF_M_MAX
+};
+
+static const char *const rf_method_names[RF_M_MAX] = {
+  RF_GETATTR, RF_READDIR, RF_DIRECTORY_P, RF_OPEN, RF_READ, RF_WRITE,
+  RF_WRITE_TO_FD, RF_CLOSE, RF_CREATE, RF_UNLINK, RF_MKDIR, RF_RMDIR,
+  RF_TRUNCATE, RF_RENAME, RF_READDIR_WITH_STAT, RF_LOOKUP, RF_FORGET,
+  RF_RENAME_NATIVE, RF_TRUNCATE_NATIVE,
+};
+
+/* FUSE operations, for RbFuse.dispatch_stats */
+enum rf_op {
+  RF_OP_GETATTR,
+  RF_OP_READDIR,
+  RF_OP_MKNOD,
+  RF_OP_UNLINK,
+  RF_OP_MKDIR,
+  RF_OP_RMDIR,
+  RF_OP_TRUNCATE,
+  RF_OP_RENAME,
+  RF_OP_OPEN,
+  RF_OP_RELEASE,
+  RF_OP_READ,
+  RF_OP_WRITE,
+  RF_OP_LOOKUP,
+  RF_OP_FORGET,
+  RF_OP_FLUSH,
+  RF_OP_FSYNC,
+  RF_OP_MAX
+};
+
+static const char *const rf_op_names[RF_OP_MAX] = {
+  "getattr", "readdir", "mknod", "unlink", "mkdir", "rmdir", "truncate",
+  "rename", "open", "release", "read", "write", "lookup", "forget",
+  "flush", "fsync",
+};
 
 
 #include "rbfuse_fuse.h"
+#include "rbfuse_attrcache.h"
+#include "rbfuse_readcache.h"
+#include "rbfuse_stat.h"
+#include "rbfuse_paths.h"
+#include "rbfuse_handles.h"
+#include "rbfuse_memfs.h"
+#include "rbfuse_ll.h"
+#include "rbfuse_stats.h"
+#include "rbfuse_trace.h"
+
+typedef char rf_op_max_check[RF_OP_MAX <= RF_STATS_OPS ? 1 : -1];
 
 /* init_time
  *
@@ -51,9 +142,93 @@ time_t init_time;
 /* Ruby Constants constants */
 static VALUE cRbFuse      = Qnil; /* RbFuse class */
 static VALUE cFSException = Qnil; /* Our Exception. */
-static VALUE FuseRoot     = Qnil; /* The root object we call */
+static VALUE cHandle      = Qnil; /* RbFuse::Handle */
+static VALUE cPending     = Qnil; /* RbFuse::Pending, see rf_defer */
+static VALUE cMount       = Qnil; /* RbFuse::Mount */
 static int debugMode=0;
 
+static ID rf_method_ids[RF_M_MAX];
+
+static ID id_perm, id_filetype, id_size, id_nlink, id_uid, id_gid;
+static ID id_atime, id_mtime, id_ctime, id_to_i, id_fileno, id_errno;
+static ID id_fiber_call;
+static VALUE sym_direct_io, sym_keep_cache, sym_handle, sym_write_buffer;
+static VALUE sym_total_allocated_objects;
+
+/* Mode strings passed to open, indexed by fi->flags & 3, plus 4 for
+ * O_APPEND. Frozen and shared between calls. */
+static VALUE open_modes[8];
+
+/* RbFuse.dispatch_stats */
+static int dispatch_stats_enabled = 0;
+static unsigned long dispatch_calls[RF_OP_MAX];
+static unsigned long dispatch_allocs[RF_OP_MAX];
+
+/* rf_mount
+ *
+ * One mounted filesystem (RbFuse::Mount): the root its callbacks go to
+ * (FuseRoot below), the caches in front of it and the options it was
+ * mounted with. Callbacks find theirs with rf_cur. The module methods
+ * set_root and mount_to work on default_mount.
+ *
+ * A mount stays in live_mounts, and so is neither collected nor freed,
+ * until its fusefs_mount has been torn down (rf_mount_release), after the
+ * last command processed on it.
+ */
+struct rf_mount {
+  VALUE self;
+  VALUE rootval;            /* the root as given */
+  VALUE root;               /* FuseRoot: rootval, or the fallback of a MemDir */
+  struct rf_memfs *memfs;   /* when the root is a MemDir */
+  char responds[RF_M_MAX];  /* see rf_resolve_root */
+  VALUE mountpoint;
+
+  /* fuse_file_info flags given to each opened file unless the open
+   * callback decides otherwise. Set from the mount options. */
+  int direct_io;
+  int keep_cache;
+
+  /* Attribute cache consulted before calling getattr, and block cache
+   * consulted before calling read. Configured with RbFuse.attr_cache=
+   * and RbFuse.read_cache=, for every mount alike. */
+  struct rf_attrcache attr_cache;
+  struct rf_readcache read_cache;
+
+  struct fusefs_mount *fm;  /* NULL unless mounted; only used with the GVL */
+  int released;             /* fm torn down, set on any thread */
+  struct rf_mount *next;    /* all_mounts */
+};
+
+static struct rf_mount *default_mount = NULL;
+static struct rf_mount *all_mounts = NULL;  /* only changed with the GVL */
+static VALUE live_mounts = Qnil;
+
+/* The settings given to RbFuse.attr_cache= and read_cache=, applied to
+ * every mount. */
+static double attr_cache_ttl = 0, attr_cache_negative_ttl = 0;
+static size_t attr_cache_max_entries = 0;
+static size_t read_cache_block_size = 0, read_cache_max_bytes = 0;
+
+/* rf_cur
+ *
+ * The mount of the command being processed on this thread, or
+ * default_mount outside of one (RbFuse.bench_op).
+ */
+static inline struct rf_mount *
+rf_cur(void) {
+  struct fusefs_mount *fm = fusefs_current();
+  return fm ? fusefs_data(fm) : default_mount;
+}
+
+/* RbFuse.strict, see rf_strict_err */
+static int strict_mode = 0;
+static __thread int rf_raised_errno = 0;
+
+/* Size of the write-back buffer given to each file opened for writing,
+ * 0 for none. Set with RbFuse.write_buffer= */
+static size_t write_buffer_size = 0;
+static int write_buffer_used = 0; /* a buffer was ever created */
+
 
 
 
@@ -91,24 +266,21 @@ debug(const char *msg,...) {
 
 #endif
 
-static inline void dp(const char* message,const char* path){
-  if(debugMode){
-    printf("--- %s (%s)\n",message,path);
-  }
-}
 static VALUE
-rf_funcall(VALUE recv,const char *methname, VALUE arg) ;
+rf_root_call(enum rf_method m, int argc, const VALUE *argv);
+static VALUE
+rf_call0(VALUE recv, ID mid);
 
 
 static VALUE
 get_stat(const char* path){
-  VALUE args=rb_ary_new();
-  rb_ary_push(args,rb_str_new2(path));
-  return rf_funcall(FuseRoot,RF_GETATTR,args);
+  VALUE argv[1];
+  argv[0]=rf_path_str(path);
+  return rf_root_call(RF_M_GETATTR,1,argv);
 }
 static mode_t 
 get_stat_filetype(VALUE stat){
-  VALUE ft=rf_funcall(stat,"filetype",Qnil);
+  VALUE ft=rf_call0(stat,id_filetype);
   if(FIXNUM_P(ft)){
     return FIX2LONG(ft);
   }else{
@@ -116,29 +288,41 @@ get_stat_filetype(VALUE stat){
   }
 }
 
-static VALUE handle_table(){
-  return rb_iv_get(cRbFuse,"@handles");
-}
 
 static int
-stat_is_dir(VALUE stat){
-  mode_t ftype=get_stat_filetype(stat);
-  return ftype==S_IFDIR; 
-}
+rf_getattr2(const char*path,struct stat* stbuf);
 static int
-stat_is_reg(VALUE stat){
-  mode_t ftype=get_stat_filetype(stat);
-  return ftype==S_IFREG; 
+rf_wbuf_flush(uint64_t fh);
+static void
+rf_wbuf_flush_path(const char *path);
+
+/* path_filetype
+ *
+ * Returns the S_IFMT bits of path, or 0 if it does not exist. Goes through
+ * rf_getattr2, so the existence checks done before mutations are answered
+ * from the attribute cache when possible.
+ */
+static mode_t
+path_filetype(const char* path){
+  struct stat st;
+  if(rf_getattr2(path,&st)!=0)return 0;
+  return st.st_mode & S_IFMT;
 }
 
 
 
 
+struct rf_callinfo {
+  VALUE recv;
+  ID mid;
+  int argc;
+  const VALUE *argv;
+};
+
 static VALUE
-rf_protected_call(VALUE args) {
-  VALUE recv = rb_ary_shift(args);
-  ID to_call = SYM2ID(rb_ary_shift(args));
-  return rb_apply(recv,to_call,args);
+rf_protected_call(VALUE data) {
+  struct rf_callinfo *call = (struct rf_callinfo *)data;
+  return rb_funcallv(call->recv,call->mid,call->argc,call->argv);
 }
 
 static VALUE
@@ -152,42 +336,174 @@ rf_rescue(VALUE data,VALUE exception){
 }
 
 
+/* rf_exception_errno
+ *
+ * The errno a raised exception fails a request with: that of a
+ * SystemCallError if it has a positive one, else EIO. Reads the errno
+ * SystemCallError#errno returns without calling anything, so it cannot
+ * raise (SystemCallError.new("msg") has none).
+ */
+static int
+rf_exception_errno(VALUE exception) {
+  VALUE e;
+
+  if (!rb_obj_is_kind_of(exception, rb_eSystemCallError))
+    return EIO;
+  e = rb_attr_get(exception, id_errno);
+  if (FIXNUM_P(e) && FIX2LONG(e) > 0 && FIX2LONG(e) <= INT_MAX)
+    return (int)FIX2LONG(e);
+  return EIO;
+}
 
+/* rf_send
+ *
+ * Calls recv.mid(*argv). A StandardError raised by the callback is
+ * swallowed (printed in debug mode) and nil returned - in strict mode
+ * after noting its errno for rf_strict_err; anything else (Interrupt,
+ * SystemExit, throw) keeps propagating.
+ */
 static VALUE
-rf_funcall(VALUE recv,const char *methname, VALUE arg) {
+rf_send(VALUE recv, ID mid, int argc, const VALUE *argv) {
+  struct rf_callinfo call;
   VALUE result;
-  VALUE methargs;
+  int state = 0;
 
-  ID method=rb_intern(methname);
+  call.recv = recv;
+  call.mid = mid;
+  call.argc = argc;
+  call.argv = argv;
 
-  if (!rb_respond_to(recv,method)) {
-    debug("not respond %s",methname);
-    return Qnil;
+  /* Set up the call and make it. */
+  result = rb_protect(rf_protected_call, (VALUE)&call, &state);
+  if (state) {
+    VALUE exception = rb_errinfo();
+    if (TYPE(exception) != T_OBJECT ||
+        !rb_obj_is_kind_of(exception, rb_eStandardError))
+      rb_jump_tag(state);
+    rb_set_errinfo(Qnil);
+    if (strict_mode)
+      rf_raised_errno = rf_exception_errno(exception);
+    return rf_rescue(Qnil, exception);
   }
+  return result;
+}
 
-  if (arg == Qnil) {
-    debug("    root.%s\n", methname );
-  } else {
-    debug("    root.%s(...)\n", methname);
-  }
+static VALUE
+rf_defer(VALUE self);
+static void
+rf_pending_abort(VALUE token, int e);
 
-  if (TYPE(arg) == T_ARRAY) {
-    methargs = arg;
-  } else if (arg != Qnil) {
-    methargs = rb_ary_new();
-    rb_ary_push(methargs,arg);
-  } else {
-    methargs = rb_ary_new();
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+static VALUE
+rf_fiber_send(VALUE args) {
+  return rf_send(cRbFuse, id_fiber_call, 4, (const VALUE *)args);
+}
+
+/* rf_fiber_call
+ *
+ * Under a Fiber scheduler (RbFuse.run(:scheduler => s)), a read, write or
+ * getattr that can be deferred is handed to RbFuse.fiber_call, which runs
+ * the callback in a Fiber of its own and answers the request when it is
+ * done. If the Fiber cannot be started (the scheduler is closing, ...)
+ * the request is failed here, with the errno strict mode takes from the
+ * exception or EIO. Returns nil right away, or Qundef to call as usual.
+ */
+static VALUE
+rf_fiber_call(enum rf_method m, int argc, const VALUE *argv) {
+  struct rf_mount *mount = rf_cur();
+  VALUE args[4];
+  VALUE ret;
+  int state = 0;
+
+  if (m != RF_M_READ && m != RF_M_WRITE && m != RF_M_GETATTR)
+    return Qundef;
+  if (!rf_ll_deferrable() || NIL_P(rb_fiber_scheduler_current()))
+    return Qundef;
+  args[0] = rf_defer(cRbFuse);
+  args[1] = mount->root;
+  args[2] = ID2SYM(rf_method_ids[m]);
+  args[3] = rb_ary_new4(argc, argv);
+  ret = rb_protect(rf_fiber_send, (VALUE)args, &state);
+  if (state || ret != Qtrue)
+    rf_pending_abort(args[0], rf_raised_errno ? rf_raised_errno : EIO);
+  if (state)
+    rb_jump_tag(state);
+  RB_GC_GUARD(args[0]);
+  return Qnil;
+}
+#endif
+
+/* rf_root_call
+ *
+ * Calls one of the callbacks on FuseRoot, or returns nil if the root does
+ * not implement it. argv is usually on the caller's stack, so a call
+ * allocates nothing beyond what the callback does.
+ */
+static VALUE
+rf_root_call(enum rf_method m, int argc, const VALUE *argv) {
+  struct rf_mount *mount = rf_cur();
+  rf_raised_errno = 0;
+  if (!mount->responds[m]) {
+    debug("not respond %s",rf_method_names[m]);
+    return Qnil;
   }
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+  {
+    VALUE ret = rf_fiber_call(m, argc, argv);
+    if (ret != Qundef)
+      return ret;
+  }
+#endif
+  debug("    root.%s(...)\n", rf_method_names[m]);
+  return rf_send(mount->root, rf_method_ids[m], argc, argv);
+}
 
-  rb_ary_unshift(methargs,ID2SYM(method));
-  rb_ary_unshift(methargs,recv);
+/* rf_call0
+ *
+ * recv.mid, for reading attributes off an object that is not a
+ * RbFuse::Stat. Returns nil if recv does not have the method.
+ */
+static VALUE
+rf_call0(VALUE recv, ID mid) {
+  if (!rb_respond_to(recv,mid))
+    return Qnil;
+  return rf_send(recv, mid, 0, NULL);
+}
 
-  /* Set up the call and make it. */
-  result = rb_rescue(rf_protected_call, methargs, rf_rescue, Qnil);
- 
+/* rf_strict_err
+ *
+ * The strict protocol (RbFuse.strict = true): a callback fails by raising
+ * a SystemCallError (Errno::ENOENT, ...), or with any other StandardError
+ * EIO, or by returning an Integer errno (either sign) or false (EACCES).
+ * The getattr checks made before mknod, unlink, mkdir, rmdir and truncate
+ * are then skipped, the callback being left to fail with the right errno.
+ *
+ * Returns the -errno the last rf_root_call reported with ret, or 0; always
+ * 0 outside strict mode.
+ */
+static int
+rf_strict_err(VALUE ret) {
+  if (!strict_mode)
+    return 0;
+  if (rf_raised_errno)
+    return -rf_raised_errno;
+  if (FIXNUM_P(ret)) {
+    long e = FIX2LONG(ret);
+    return (int)(e < 0 ? e : -e);
+  }
+  if (ret == Qfalse)
+    return -EACCES;
+  return 0;
+}
 
-  return result;
+/* rf_strict_raised
+ *
+ * Like rf_strict_err, for callbacks whose Integer result is not an errno
+ * (write): only what was raised counts.
+ */
+static int
+rf_strict_raised(void) {
+  return strict_mode ? -rf_raised_errno : 0;
 }
 
 
@@ -203,10 +519,70 @@ rf_funcall(VALUE recv,const char *methname, VALUE arg) {
  *   will be 777 (dirs) and 666 (files) xor'd with FuseFS.umask
  */
 
+/* rf_stat_to_struct
+ *
+ * Fills stbuf from the value returned by getattr. A RbFuse::Stat is copied
+ * in one go; any other object is read through its perm, filetype, size,
+ * nlink, uid, gid and atime/mtime/ctime methods.
+ */
+static int
+rf_stat_to_struct(VALUE stat,struct stat* stbuf){
+  const struct stat* native=rf_stat_ptr(stat);
+  if(native){
+    if((native->st_mode & S_IFMT)==0)return -ENOENT;
+    memcpy(stbuf,native,sizeof(struct stat));
+    return 0;
+  }
+
+  VALUE perm=rf_call0(stat,id_perm);
+  if(!FIXNUM_P(perm))return -ENOENT;
+  mode_t perm_m=FIX2LONG(perm);
+ 
+  mode_t filetype_m=get_stat_filetype(stat);
+  if(filetype_m==0)return -ENOENT;
+
+  stbuf->st_mode=perm_m|filetype_m;
+
+  
+  VALUE size=rf_call0(stat,id_size);
+  if(!FIXNUM_P(size))return -ENOENT;
+  stbuf->st_size=FIX2LONG(size);
+
+  VALUE nlink=rf_call0(stat,id_nlink);
+  if(!FIXNUM_P(nlink))return -ENOENT;
+  stbuf->st_nlink=FIX2LONG(nlink);
+
+  VALUE uid=rf_call0(stat,id_uid);
+  if(!FIXNUM_P(uid))return -ENOENT;
+  stbuf->st_uid=FIX2INT(uid);
+
+  VALUE gid=rf_call0(stat,id_gid);
+  if(!FIXNUM_P(gid))return -ENOENT;
+  stbuf->st_gid=FIX2INT(gid);
+
+  VALUE atime=rf_call0(stat,id_atime);
+  VALUE atimei=rf_call0(atime,id_to_i);
+  if(!RTEST(atimei))return -ENOENT;
+  stbuf->st_atime=NUM2LONG(atimei);
+
+  VALUE mtime=rf_call0(stat,id_mtime);
+  VALUE mtimei=rf_call0(mtime,id_to_i);
+  if(!RTEST(mtimei))return -ENOENT;
+  stbuf->st_mtime=NUM2LONG(mtimei);
+
+  VALUE ctime=rf_call0(stat,id_ctime);
+  VALUE ctimei=rf_call0(ctime,id_to_i);
+  if(!RTEST(ctimei))return -ENOENT;
+  stbuf->st_ctime=NUM2LONG(ctimei);
+ 
+  return 0;
+}
+
 static int
 rf_getattr2(const char*path,struct stat* stbuf){
+  struct rf_mount *mount = rf_cur();
 
-  dp("rf_getattr2", path );
+  rf_trace_args(path,0,0);
   /* Zero out the stat buffer */
   memset(stbuf, 0, sizeof(struct stat));
 
@@ -222,60 +598,97 @@ rf_getattr2(const char*path,struct stat* stbuf){
     return 0;
   }
 
+  /* a write drops the cached entry, so a hit has nothing buffered */
+  switch(rf_attrcache_lookup(&mount->attr_cache,path,stbuf)){
+  case RF_ACACHE_HIT:
+    return 0;
+  case RF_ACACHE_NEGATIVE:
+    return -ENOENT;
+  }
+
+  rf_wbuf_flush_path(path);
 
   VALUE stat=get_stat(path);
+  if(rf_ll_deferred())
+    return RF_LL_DEFERRED;
+  int err=rf_strict_err(stat);
+  if(err==-ENOENT){
+    rf_attrcache_store(&mount->attr_cache,path,NULL);
+    return err;
+  }
+  if(err)return err;
   if(RTEST(stat)){
-     
-    VALUE perm=rf_funcall(stat,"perm",Qnil);
-    perm=rb_funcall(stat,rb_intern("perm"),0);
-    if(!FIXNUM_P(perm))return -ENOENT;
-    mode_t perm_m=FIX2LONG(perm);
-   
-    mode_t filetype_m=get_stat_filetype(stat);
-    if(filetype_m==0)return -ENOENT;
-
-    stbuf->st_mode=perm_m|filetype_m;
-
-    
-    VALUE size=rf_funcall(stat,"size",Qnil);
-    if(!FIXNUM_P(size))return -ENOENT;
-    stbuf->st_size=FIX2LONG(size);
- 
-    VALUE nlink=rf_funcall(stat,"nlink",Qnil);
-    if(!FIXNUM_P(nlink))return -ENOENT;
-    stbuf->st_nlink=FIX2LONG(nlink);
-
-    VALUE uid=rf_funcall(stat,"uid",Qnil);
-    if(!FIXNUM_P(uid))return -ENOENT;
-    stbuf->st_uid=FIX2INT(uid);
-
-    VALUE gid=rf_funcall(stat,"gid",Qnil);
-    if(!FIXNUM_P(gid))return -ENOENT;
-    stbuf->st_gid=FIX2INT(gid);
-
-    VALUE atime=rf_funcall(stat,"atime",Qnil);
-    VALUE atimei=rf_funcall(atime,"to_i",Qnil);
-    if(!RTEST(atimei))return -ENOENT;
-    stbuf->st_atime=NUM2LONG(atimei);
-
-    VALUE mtime=rf_funcall(stat,"mtime",Qnil);
-    VALUE mtimei=rf_funcall(mtime,"to_i",Qnil);
-    if(!RTEST(mtimei))return -ENOENT;
-    stbuf->st_mtime=NUM2LONG(mtimei);
-
-    VALUE ctime=rf_funcall(stat,"ctime",Qnil);
-    VALUE ctimei=rf_funcall(ctime,"to_i",Qnil);
-    if(!RTEST(ctimei))return -ENOENT;
-    stbuf->st_ctime=NUM2LONG(ctimei);
-   
-    return 0;
+    int ret=rf_stat_to_struct(stat,stbuf);
+    if(ret==0){
+      rf_attrcache_store(&mount->attr_cache,path,stbuf);
+    }
+    return ret;
   }else{
+    rf_attrcache_store(&mount->attr_cache,path,NULL);
     return -ENOENT;
   }
 }
 
 
 
+/* rf_readdir_stat
+ *
+ * Fills the listing of path from readdir_with_stat, which returns
+ * [[name, stat], ...]. Each stat is handed to filler and stored in the
+ * attribute cache, so the getattr calls that follow a listing (ls -l) are
+ * answered without calling back into Ruby. With a NULL path (the inode
+ * API) nothing is cached.
+ */
+static int
+rf_readdir_stat(const char *path, VALUE list, void *buf,
+                fuse_fill_dir_t filler) {
+  struct rf_mount *mount = rf_cur();
+  char child[PATH_MAX];
+  size_t plen = path ? strlen(path) : 0;
+  long i;
+
+  if (plen == 1) plen = 0; /* "/" */
+  if (plen < sizeof(child))
+    memcpy(child, path, plen);
+
+  filler(buf,".", NULL, 0);
+  filler(buf,"..", NULL, 0);
+
+  for (i = 0; i < RARRAY_LEN(list); i++) {
+    VALUE ent = RARRAY_PTR(list)[i];
+    VALUE name, stat = Qnil;
+    struct stat st;
+    const char *cname;
+    size_t nlen;
+
+    if (TYPE(ent) == T_ARRAY && RARRAY_LEN(ent) >= 1) {
+      name = RARRAY_PTR(ent)[0];
+      if (RARRAY_LEN(ent) >= 2)
+        stat = RARRAY_PTR(ent)[1];
+    } else {
+      name = ent;
+    }
+    if (TYPE(name) != T_STRING)
+      continue;
+    cname = StringValueCStr(name);
+
+    memset(&st, 0, sizeof(st));
+    if (NIL_P(stat) || rf_stat_to_struct(stat, &st) != 0) {
+      filler(buf, cname, NULL, 0);
+      continue;
+    }
+    filler(buf, cname, &st, 0);
+
+    nlen = RSTRING_LEN(name);
+    if (path && plen + 1 + nlen < sizeof(child)) {
+      child[plen] = '/';
+      memcpy(child + plen + 1, cname, nlen + 1);
+      rf_attrcache_store(&mount->attr_cache, child, &st);
+    }
+  }
+  return 0;
+}
+
 /* rf_readdir
  *
  * Used when: 'ls'
@@ -286,20 +699,25 @@ rf_getattr2(const char*path,struct stat* stbuf){
  *
  * '.' and '..' are automatically added, so the programmer does not
  *   need to worry about those.
+ *
+ * If FuseRoot has 'readdir_with_stat', that is called instead of both
+ *   and the attributes it returns are cached (see rf_readdir_stat).
  */
 static int
 rf_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
            off_t offset, struct fuse_file_info *fi) {
+  struct rf_mount *mount = rf_cur();
   VALUE retval;
+  VALUE argv[1];
 
-  dp("rf_readdir", path );
+  rf_trace_args(path,0,0);
 
   /* This is what fuse does to turn off 'unused' warnings. */
   (void) offset;
   (void) fi;
 
   /* FuseRoot must exist */
-  if (FuseRoot == Qnil) {
+  if (mount->root == Qnil) {
     if (!strcmp(path,"/")) {
       filler(buf,".", NULL, 0);
       filler(buf,"..", NULL, 0);
@@ -308,9 +726,22 @@ rf_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     return -ENOENT;
   }
 
-  if (strcmp(path,"/") != 0) {
+  argv[0] = rf_path_str(path);
+  if (mount->responds[RF_M_READDIR_WITH_STAT]) {
+    retval = rf_root_call(RF_M_READDIR_WITH_STAT,1,argv);
+    if (rf_strict_err(retval))
+      return rf_strict_err(retval);
+    if (TYPE(retval) != T_ARRAY) {
+      if (strcmp(path,"/") != 0)
+        return -ENOENT;
+      retval = rb_ary_new();
+    }
+    return rf_readdir_stat(path, retval, buf, filler);
+  }
+
+  if (strcmp(path,"/") != 0 && !strict_mode) {
     debug("  Checking is_directory? ...");
-    retval = rf_funcall(FuseRoot,"directory?",rb_str_new2(path));
+    retval = rf_root_call(RF_M_DIRECTORY_P,1,argv);
 
     if (!RTEST(retval)) {
       debug(" no.\n");
@@ -323,9 +754,11 @@ rf_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   filler(buf,".", NULL, 0);
   filler(buf,"..", NULL, 0);
 
-  VALUE args=rb_ary_new();
-  rb_ary_push(args,rb_str_new2(path));
-  retval = rf_funcall(FuseRoot, RF_READDIR,args);
+  retval = rf_root_call(RF_M_READDIR,1,argv);
+  if (rf_strict_err(retval))
+    return rf_strict_err(retval);
+  if (strict_mode && TYPE(retval) != T_ARRAY && strcmp(path,"/") != 0)
+    return -ENOENT;
   if (!RTEST(retval)) {
     return 0;
   }
@@ -357,8 +790,9 @@ rf_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
  */
 static int
 rf_mknod(const char *path, mode_t umode, dev_t rdev) {
+  struct rf_mount *mount = rf_cur();
 
-  dp("rf_mknod", path);
+  rf_trace_args(path,0,0);
   /* Make sure it's not already open. */
 
   /* We ONLY permit regular files. No blocks, characters, fifos, etc. */
@@ -369,10 +803,8 @@ rf_mknod(const char *path, mode_t umode, dev_t rdev) {
   }
   debug(" yes.\n");
 
-  VALUE stat=get_stat(path);
- 
   debug("  Checking if it's a file ..." );
-  if (stat_is_reg(stat)) {
+  if (!strict_mode && path_filetype(path)==S_IFREG) {
     debug(" yes.\n");
     return -EEXIST;
   }
@@ -384,14 +816,15 @@ rf_mknod(const char *path, mode_t umode, dev_t rdev) {
   }
 
   debug("call create method\n");
-  VALUE args=rb_ary_new();
-  VALUE pv=rb_str_new2(path);
-  rb_ary_push(args,pv);
-  rb_ary_push(args,INT2FIX(umode));
-  rf_funcall(FuseRoot,RF_CREATE,args);
+  VALUE argv[2];
+  argv[0]=rf_path_str(path);
+  argv[1]=INT2FIX(umode);
+  VALUE ret=rf_root_call(RF_M_CREATE,2,argv);
+  rf_attrcache_invalidate(&mount->attr_cache,path);
+  rf_attrcache_invalidate_parent(&mount->attr_cache,path);
 
 
-  return 0;
+  return rf_strict_err(ret);
 }
 
 /* rf_open
@@ -413,48 +846,56 @@ rf_mknod(const char *path, mode_t umode, dev_t rdev) {
  *   read and write.
  */
 static int
-rf_open(const char *path, struct fuse_file_info *fi) {
-  char open_opts[4], *optr;
-
-  dp("rf_open", path);
-
- 
+rf_open_target(VALUE target, struct fuse_file_info *fi) {
+  struct rf_mount *mount = rf_cur();
+  size_t wbuf = write_buffer_size;
+  int mode;
 
-  optr = open_opts;
-  switch (fi->flags & 3) {
-  case 0:
-    *(optr++) = 'r';
-    break;
-  case 1:
-    *(optr++) = 'w';
-    break;
-  case 2:
-    *(optr++) = 'w';
-    *(optr++) = 'r';
-    break;
-  default:
+  mode = fi->flags & 3;
+  if (mode == 3) {
     debug("Opening a file with something other than rd, wr, or rdwr?");
   }
   if (fi->flags & O_APPEND)
-    *(optr++) = 'a';
-  *(optr) = '\0';
+    mode += 4;
 
   
-  VALUE handle=rb_class_new_instance(0,NULL,rb_cObject);
-
-  VALUE h_table=handle_table();
-  rb_hash_aset(h_table,handle,Qtrue);
-  fi->fh=handle;
+  VALUE handle=rb_obj_alloc(cHandle);
+  fi->fh=rf_handle_open(handle);
+
+  fi->direct_io=mount->direct_io;
+  fi->keep_cache=mount->keep_cache;
+
+  VALUE argv[3];
+  argv[0]=target;
+  argv[1]=open_modes[mode];
+  argv[2]=handle;
+  VALUE ret=rf_root_call(RF_M_OPEN,3,argv);
+  int err=rf_strict_err(ret);
+  if (err || !RTEST(ret)) {
+    rf_handle_close(fi->fh);
+    return err ? err : -ENOENT;
+  }
+  if (TYPE(ret) == T_HASH) {
+    VALUE v=rb_hash_lookup2(ret,sym_handle,Qundef);
+    if (v != Qundef) rf_handle_set(fi->fh,v);
+    v=rb_hash_lookup2(ret,sym_direct_io,Qundef);
+    if (v != Qundef) fi->direct_io=RTEST(v);
+    v=rb_hash_lookup2(ret,sym_keep_cache,Qundef);
+    if (v != Qundef) fi->keep_cache=RTEST(v);
+    v=rb_hash_lookup2(ret,sym_write_buffer,Qundef);
+    if (v != Qundef) wbuf=RTEST(v) ? NUM2SIZET(v) : 0;
+  }
+  if (wbuf > 0 && (fi->flags & 3) != O_RDONLY &&
+      rf_handle_buffer(fi->fh,wbuf,mount) == 0)
+    write_buffer_used = 1;
+  return 0;
+}
 
-  VALUE args=rb_ary_new();
-  rb_ary_push(args,rb_str_new2(path));
-  rb_ary_push(args,rb_str_new2(open_opts));
-  rb_ary_push(args,handle);
-  if (RTEST(rf_funcall(FuseRoot,RF_OPEN,args))) {
-    return 0;
-  }else{
-    return -ENOENT;
-  }}
+static int
+rf_open(const char *path, struct fuse_file_info *fi) {
+  rf_trace_args(path,0,0);
+  return rf_open_target(rf_path_str(path), fi);
+}
 
 /* rf_release
  *
@@ -469,37 +910,28 @@ rf_open(const char *path, struct fuse_file_info *fi) {
  *   in-memory copy of the return value from rf_open.
  */
 static int
-rf_release(const char *path, struct fuse_file_info *fi) {
-   dp("rf_release", path);
-
-  VALUE handle=fi->fh;
+rf_release_target(VALUE target, struct fuse_file_info *fi) {
+  VALUE handle=rf_handle_get(fi->fh);
   
-
+  rf_wbuf_flush(fi->fh);
 
   /* If it's opened for raw read/write, call raw_close */
-  VALUE args=rb_ary_new();
-  rb_ary_push(args,rb_str_new2(path));
-  rb_ary_push(args,handle);
-  rf_funcall(FuseRoot,RF_CLOSE,args);
-  VALUE h_table=handle_table();
-  rb_hash_delete(h_table,handle);
+  VALUE argv[2];
+  argv[0]=target;
+  argv[1]=handle;
+  rf_root_call(RF_M_CLOSE,2,argv);
+  rf_handle_close(fi->fh);
 
   return 0;
  
 }
 
-/* rf_touch
- *
- * Used when: A program tries to modify the file's times.
- *
- * We use this for a neat side-effect thingy. When a file is touched, we
- * call the "touch" method. i.e: "touch button" would call
- * "FuseRoot.touch('/button')" and something *can* happen. =).
- */
 static int
-rf_touch(const char *path, struct utimbuf *ignore) {
-  dp("rf_touch", path);
-  rf_funcall(FuseRoot,"touch",rb_str_new2(path));
+rf_release(const char *path, struct fuse_file_info *fi) {
+  struct rf_mount *mount = rf_cur();
+  rf_trace_args(path,0,0);
+  rf_release_target(rf_path_str(path), fi);
+  rf_attrcache_invalidate(&mount->attr_cache,path);
   return 0;
 }
 
@@ -512,14 +944,23 @@ rf_touch(const char *path, struct utimbuf *ignore) {
  */
 static int
 rf_rename(const char *path, const char *dest) {
-  VALUE pathv=rb_str_new2(path);
-  VALUE destv=rb_str_new2(dest);
-
-  VALUE args=rb_ary_new();
-  rb_ary_push(args,pathv);
-  rb_ary_push(args,destv);
-  VALUE ret=rf_funcall(FuseRoot,RF_RENAME,args);
-  if(RTEST(ret)){
+  struct rf_mount *mount = rf_cur();
+  VALUE argv[2];
+  rf_trace_args(path,0,0);
+  rf_wbuf_flush_path(path);
+  argv[0]=rf_path_str(path);
+  argv[1]=rf_path_str(dest);
+  VALUE ret=rf_root_call(mount->responds[RF_M_RENAME_NATIVE] ?
+                         RF_M_RENAME_NATIVE : RF_M_RENAME,2,argv);
+  rf_attrcache_invalidate_tree(&mount->attr_cache,path);
+  rf_attrcache_invalidate_tree(&mount->attr_cache,dest);
+  rf_readcache_invalidate_tree(&mount->read_cache,path);
+  rf_readcache_invalidate_tree(&mount->read_cache,dest);
+  rf_attrcache_invalidate_parent(&mount->attr_cache,path);
+  rf_attrcache_invalidate_parent(&mount->attr_cache,dest);
+  if(rf_strict_err(ret))
+    return rf_strict_err(ret);
+  if(RTEST(ret) || (strict_mode && NIL_P(ret))){
     return 0;
   }else{
     return -EACCES;
@@ -535,11 +976,11 @@ rf_rename(const char *path, const char *dest) {
  */
 static int
 rf_unlink(const char *path) {
-  dp("unlink",path);
+  struct rf_mount *mount = rf_cur();
+  rf_trace_args(path,0,0);
   /* Does it exist to be removed? */
   debug("  Checking if it exists...");
-  VALUE stat=get_stat(path);
-  if (!stat_is_reg(stat)) {
+  if (!strict_mode && path_filetype(path)!=S_IFREG) {
     debug(" no.\n");
     return -ENOENT;
   }
@@ -555,11 +996,14 @@ rf_unlink(const char *path) {
  
   /* Ok, remove it! */
   debug("  Removing it.\n");
-  VALUE args=rb_ary_new();
-  rb_ary_push(args,rb_str_new2(path));
-  rf_funcall(FuseRoot,RF_UNLINK,args);
+  VALUE argv[1];
+  argv[0]=rf_path_str(path);
+  VALUE ret=rf_root_call(RF_M_UNLINK,1,argv);
+  rf_attrcache_invalidate(&mount->attr_cache,path);
+  rf_readcache_invalidate(&mount->read_cache,path);
+  rf_attrcache_invalidate_parent(&mount->attr_cache,path);
   
-  return 0;
+  return rf_strict_err(ret);
 
 }
 
@@ -572,22 +1016,26 @@ rf_unlink(const char *path) {
  */
 static int
 rf_truncate(const char *path, off_t length) {
-  dp( "rf_truncate", path);
+  struct rf_mount *mount = rf_cur();
+  rf_trace_args(path,length,0);
 
   
 
   /* Does it exist to be truncated? */
-  VALUE stat=get_stat(path);
-  if(!stat_is_reg(stat)){
+  if(!strict_mode && path_filetype(path)!=S_IFREG){
     return -ENOENT;
   }
   
-  if(rb_respond_to(FuseRoot,rb_intern(RF_TRUNCATE))){
-    VALUE args=rb_ary_new();
-    rb_ary_push(args,rb_str_new2(path));
-    rb_ary_push(args,LONG2NUM(length));
-    rf_funcall(FuseRoot,RF_TRUNCATE,args);
-    return 0;
+  if(mount->responds[RF_M_TRUNCATE_NATIVE] ||
+     mount->responds[RF_M_TRUNCATE]){
+    VALUE argv[2];
+    argv[0]=rf_path_str(path);
+    argv[1]=OFFT2NUM(length);
+    VALUE ret=rf_root_call(mount->responds[RF_M_TRUNCATE_NATIVE] ?
+                           RF_M_TRUNCATE_NATIVE : RF_M_TRUNCATE,2,argv);
+    rf_attrcache_invalidate(&mount->attr_cache,path);
+    rf_readcache_invalidate(&mount->read_cache,path);
+    return rf_strict_err(ret);
   }
 
  
@@ -603,22 +1051,24 @@ rf_truncate(const char *path, off_t length) {
  */
 static int
 rf_mkdir(const char *path, mode_t mode) {
-  dp("rf_mkdir",path);
+  struct rf_mount *mount = rf_cur();
+  rf_trace_args(path,0,0);
   /* Does it exist? */
 
-  VALUE stat=get_stat(path);
-  if(RTEST(stat)) return -EEXIST;
+  if(!strict_mode && path_filetype(path)!=0) return -EEXIST;
 
   /* Can we mkdir it? */
   if (!mkdirable(path))
     return -EACCES;
  
-  VALUE args=rb_ary_new();
-  rb_ary_push(args,rb_str_new2(path));
-  rb_ary_push(args,INT2FIX(mode));
+  VALUE argv[2];
+  argv[0]=rf_path_str(path);
+  argv[1]=INT2FIX(mode);
   /* Ok, mkdir it! */
-  rf_funcall(FuseRoot,RF_MKDIR,args);
-  return 0;
+  VALUE ret=rf_root_call(RF_M_MKDIR,2,argv);
+  rf_attrcache_invalidate(&mount->attr_cache,path);
+  rf_attrcache_invalidate_parent(&mount->attr_cache,path);
+  return rf_strict_err(ret);
  
 
 }
@@ -631,13 +1081,13 @@ rf_mkdir(const char *path, mode_t mode) {
  */
 static int
 rf_rmdir(const char *path) {
-  dp("rf_rmdir",path);
+  struct rf_mount *mount = rf_cur();
+  rf_trace_args(path,0,0);
   /* Does it exist? */
-  VALUE stat=get_stat(path);
-  if(RTEST(stat)){
-    if(!stat_is_dir(stat))  return -ENOTDIR;
-  }else{
-    return -ENOENT;
+  if(!strict_mode){
+    mode_t ftype=path_filetype(path);
+    if(ftype==0)  return -ENOENT;
+    if(ftype!=S_IFDIR)  return -ENOTDIR;
   }
 
   /* Can we rmdir it? */
@@ -645,9 +1095,14 @@ rf_rmdir(const char *path) {
     return -EACCES;
  
   /* Ok, rmdir it! */
-  rf_funcall(FuseRoot,RF_RMDIR,rb_str_new2(path));
+  VALUE argv[1];
+  argv[0]=rf_path_str(path);
+  VALUE ret=rf_root_call(RF_M_RMDIR,1,argv);
+  rf_attrcache_invalidate_tree(&mount->attr_cache,path);
+  rf_readcache_invalidate_tree(&mount->read_cache,path);
+  rf_attrcache_invalidate_parent(&mount->attr_cache,path);
 
-  return 0;
+  return rf_strict_err(ret);
 
 }
 
@@ -658,29 +1113,269 @@ rf_rmdir(const char *path) {
  * This does not access FuseRoot at all. Instead, it appends the written
  *   data to the opened_file entry, growing its memory usage if necessary.
  */
+static int
+rf_call_write(VALUE target, VALUE str, off_t offset, uint64_t fh) {
+  /* Make sure it's open for write ... */
+  /* If it's opened for raw read/write, call raw_write */
+    /* raw read */
+    VALUE argv[4];
+    debug(" yes.\n");
+    argv[0]=target;
+    argv[1]=OFFT2NUM(offset);
+    argv[2]=str;
+    argv[3]=rf_handle_get(fh);
+    rf_root_call(RF_M_WRITE,4,argv);
+    return rf_strict_raised();
+}
+
+/* Write-back buffers
+ *
+ * With RbFuse.write_buffer = n (or :write_buffer => n from open) a file
+ * opened for writing gets an n byte buffer in the handle table. Writes
+ * that continue where the buffered data ends are collected there and
+ * handed to write as one String when the buffer fills, or before anything
+ * that must see them: a read or getattr of the same file, truncate,
+ * rename, flush (close(2)), fsync and release. A write elsewhere in the
+ * file flushes the buffer first; one too large for the buffer is passed
+ * straight through.
+ *
+ * A write that fails in strict mode while being flushed is kept on the
+ * buffer and reported by the next flush or fsync of the handle
+ * (rf_wbuf_error), so close(2) and fsync(2) see it.
+ */
+static int
+rf_wbuf_flush(uint64_t fh) {
+  struct rf_wbuf *w = rf_handle_wbuf(fh);
+  VALUE str;
+  void *defer;
+  int err;
+
+  if (w == NULL || w->len == 0)
+    return 0;
+  str = rb_str_new(w->data, w->len);
+  w->len = 0;
+  defer = rf_ll_defer_suspend();
+  err = rf_call_write(w->target,str,w->offset,fh);
+  rf_ll_defer_resume(defer);
+  /* the handle may have been released while write ran */
+  w = rf_handle_wbuf(fh);
+  if (err && w && w->err == 0)
+    w->err = err;
+  return err;
+}
+
+/* rf_wbuf_error
+ *
+ * Takes the error kept by rf_wbuf_flush for fh, or 0.
+ */
+static int
+rf_wbuf_error(uint64_t fh) {
+  struct rf_wbuf *w = rf_handle_wbuf(fh);
+  int err;
+
+  if (w == NULL)
+    return 0;
+  err = w->err;
+  w->err = 0;
+  return err;
+}
+
+static void
+rf_wbuf_flush_target(VALUE target) {
+  struct rf_mount *mount = rf_cur();
+  uint64_t fh;
+  while ((fh = rf_handle_dirty(target,mount)) != 0)
+    rf_wbuf_flush(fh);
+}
+
+static void
+rf_wbuf_flush_path(const char *path) {
+  if (write_buffer_used)
+    rf_wbuf_flush_target(rf_path_str(path));
+}
+
+/* rf_wbuf_reserve
+ *
+ * Room for size bytes written at offset to fh, or NULL if the write is not
+ * to be buffered. Must be followed by rf_wbuf_commit.
+ */
+static char *
+rf_wbuf_reserve(uint64_t fh, VALUE target, size_t size, off_t offset) {
+  struct rf_wbuf *w = rf_handle_wbuf(fh);
+
+  if (w == NULL)
+    return NULL;
+  /* a loop: other writes to fh may come in while write runs */
+  while (w->len > 0 &&
+         (offset != w->offset + (off_t)w->len || w->len + size > w->limit))
+    rf_wbuf_flush(fh);
+  if (size >= w->limit)
+    return NULL;
+  if (w->len == 0)
+    w->offset = offset;
+  w->target = target;
+  return w->data + w->len;
+}
+
+static void
+rf_wbuf_commit(uint64_t fh, size_t size) {
+  struct rf_wbuf *w = rf_handle_wbuf(fh);
+
+  w->len += size;
+  if (w->len >= w->limit)
+    rf_wbuf_flush(fh);
+}
+
 static int
 rf_write(const char *path, const char *buf, size_t size, off_t offset,
          struct fuse_file_info *fi) {
-    dp("rf_write",path);
+    struct rf_mount *mount = rf_cur();
+    rf_trace_args(path,offset,size);
 
 
   debug( "  Offset is %d\n", offset );
 
+  VALUE target=rf_path_str(path);
+  char *dst=rf_wbuf_reserve(fi->fh,target,size,offset);
+  int err=0;
+  if (dst) {
+    memcpy(dst,buf,size);
+    rf_wbuf_commit(fi->fh,size);
+  } else {
+    err=rf_call_write(target,rb_str_new(buf,size),offset,fi->fh);
+  }
+  rf_attrcache_invalidate(&mount->attr_cache,path);
+  rf_readcache_invalidate(&mount->read_cache,path);
+  if (rf_ll_deferred())
+    return RF_LL_DEFERRED;
+  if (err)
+    return err;
+  return (int)size;
 
+}
 
-  /* Make sure it's open for write ... */
-  /* If it's opened for raw read/write, call raw_write */
-    /* raw read */
-    VALUE args = rb_ary_new();
-    debug(" yes.\n");
-    rb_ary_push(args,rb_str_new2(path));
-    rb_ary_push(args,INT2NUM(offset));
-    rb_ary_push(args,rb_str_new(buf,size));
-    rb_ary_push(args,fi->fh);
-    rf_funcall(FuseRoot,RF_WRITE,args);
-  return (int)size;
+/* rf_io_fd
+ *
+ * The file descriptor of an IO (or an Integer fd) returned by a callback,
+ * or -1. fileno is called through rf_send, so a closed IO gives -1
+ * rather than raising inside the FUSE callback.
+ */
+static int
+rf_io_fd(VALUE io) {
+  VALUE fd = FIXNUM_P(io) ? io : rf_call0(io, id_fileno);
+
+  if (!FIXNUM_P(fd) || FIX2LONG(fd) < 0 || FIX2LONG(fd) > INT_MAX)
+    return -1;
+  return (int)FIX2LONG(fd);
+}
+
+/* rf_io_num
+ *
+ * An offset or length given next to an IO by a callback: a non-negative
+ * Integer. Returns -1, without raising, for anything else.
+ */
+static int
+rf_io_num(VALUE v, off_t *out) {
+  if (!FIXNUM_P(v) || FIX2LONG(v) < 0)
+    return -1;
+  *out = (off_t)FIX2LONG(v);
+  return 0;
+}
+
+#if FUSE_VERSION >= 29
+/* rf_write_buf
+ *
+ * Used when: like rf_write, on FUSE 2.9 and later.
+ *
+ * If FuseRoot has write_to_fd(path, offset, length, handle) and it returns
+ * an IO/fd (or [io, offset]), the data is copied by FUSE straight into
+ * that fd at offset - spliced from the FUSE pipe when mounted with
+ * :splice_read - and write is not called. Otherwise the whole request,
+ * however it arrived, is handed to write as one String.
+ */
+static int
+rf_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+             struct fuse_file_info *fi) {
+  struct rf_mount *mount = rf_cur();
+  size_t size = fuse_buf_size(buf);
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+  ssize_t res;
+  VALUE str, target;
+  int err;
+
+  rf_trace_args(path,offset,size);
+
+  if (mount->responds[RF_M_WRITE_TO_FD]) {
+    VALUE argv[4];
+    VALUE io;
+    off_t pos = offset;
+    int fd;
+
+    /* what is buffered was written before, and must not land after */
+    rf_wbuf_flush(fi->fh);
+    argv[0]=rf_path_str(path);
+    argv[1]=OFFT2NUM(offset);
+    argv[2]=SIZET2NUM(size);
+    argv[3]=rf_handle_get(fi->fh);
+    io = rf_root_call(RF_M_WRITE_TO_FD,4,argv);
+    /* in strict mode a failed write_to_fd fails the write, without
+     * falling back to write; a non-negative Integer is an fd here */
+    err = rf_strict_raised();
+    if (strict_mode && err == 0) {
+      if (io == Qfalse)
+        err = -EACCES;
+      else if (FIXNUM_P(io) && FIX2LONG(io) < 0)
+        err = (int)FIX2LONG(io);
+    }
+    if (err)
+      return err;
+    if (RTEST(io)) {
+      if (TYPE(io) == T_ARRAY) {
+        if (RARRAY_LEN(io) < 2)
+          return -EIO;
+        if (rf_io_num(RARRAY_PTR(io)[1], &pos) < 0)
+          return -EIO;
+        io = RARRAY_PTR(io)[0];
+      }
+      fd = rf_io_fd(io);
+      if (fd < 0)
+        return -EIO;
+      dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      dst.buf[0].fd = fd;
+      dst.buf[0].pos = pos;
+      res = fuse_buf_copy(&dst, buf, 0);
+      rf_attrcache_invalidate(&mount->attr_cache,path);
+      rf_readcache_invalidate(&mount->read_cache,path);
+      return (int)res;
+    }
+  }
+
+  target = rf_path_str(path);
+  dst.buf[0].mem = rf_wbuf_reserve(fi->fh, target, size, offset);
+  if (dst.buf[0].mem) {
+    res = fuse_buf_copy(&dst, buf, FUSE_BUF_NO_SPLICE);
+    rf_wbuf_commit(fi->fh, res < 0 ? 0 : res);
+    if (res < 0)
+      return (int)res;
+    rf_attrcache_invalidate(&mount->attr_cache,path);
+    rf_readcache_invalidate(&mount->read_cache,path);
+    return (int)res;
+  }
 
+  str = rb_str_new(NULL, size);
+  dst.buf[0].mem = RSTRING_PTR(str);
+  res = fuse_buf_copy(&dst, buf, FUSE_BUF_NO_SPLICE);
+  if (res < 0)
+    return (int)res;
+  rb_str_set_len(str, res);
+  err = rf_call_write(target,str,offset,fi->fh);
+  rf_attrcache_invalidate(&mount->attr_cache,path);
+  rf_readcache_invalidate(&mount->read_cache,path);
+  if (err)
+    return err;
+  return (int)res;
 }
+#endif
 
 /* rf_read
  *
@@ -691,20 +1386,28 @@ rf_write(const char *path, const char *buf, size_t size, off_t offset,
  *
  * For files opened with raw_open, it calls raw_read
  */
-static int
-rf_read(const char *path, char *buf, size_t size, off_t offset,
-        struct fuse_file_info *fi) {
-    dp( "rf_read", path );
-
-
+static VALUE
+rf_call_read(VALUE target, size_t size, off_t offset,
+             struct fuse_file_info *fi) {
     /* If it's opened for raw read/write, call raw_read */
     /* raw read */
-    VALUE args = rb_ary_new();
-    rb_ary_push(args,rb_str_new2(path));
-    rb_ary_push(args,INT2NUM(offset));
-    rb_ary_push(args,INT2NUM(size));
-    rb_ary_push(args,fi->fh);
-    VALUE ret = rf_funcall(FuseRoot,RF_READ,args);
+    VALUE argv[4];
+    rf_wbuf_flush_target(target);
+    argv[0]=target;
+    argv[1]=OFFT2NUM(offset);
+    argv[2]=SIZET2NUM(size);
+    argv[3]=rf_handle_get(fi->fh);
+    return rf_root_call(RF_M_READ,4,argv);
+}
+
+static int
+rf_read_target(VALUE target, char *buf, size_t size, off_t offset,
+               struct fuse_file_info *fi) {
+    VALUE ret = rf_call_read(target,size,offset,fi);
+    if (rf_ll_deferred())
+      return RF_LL_DEFERRED;
+    if (rf_strict_err(ret))
+      return rf_strict_err(ret);
     if (!RTEST(ret))
       return 0;
     if (TYPE(ret) != T_STRING)
@@ -717,192 +1420,2625 @@ rf_read(const char *path, char *buf, size_t size, off_t offset,
  
 }
 
+/* rf_read_io
+ *
+ * Where to read from when read returned an IO form (see rf_read_buf)
+ * instead of a String: the fd, the position in it, and at most how many
+ * bytes.
+ */
+static int
+rf_read_io(VALUE ret, off_t offset, size_t size, int *fd, off_t *pos,
+           size_t *len) {
+    VALUE io = ret;
+
+    *pos = offset;
+    *len = size;
+    if (TYPE(ret) == T_ARRAY) {
+      if (RARRAY_LEN(ret) < 2)
+        return -EIO;
+      io = RARRAY_PTR(ret)[0];
+      if (rf_io_num(RARRAY_PTR(ret)[1], pos) < 0)
+        return -EIO;
+      if (RARRAY_LEN(ret) > 2) {
+        off_t l;
+        if (rf_io_num(RARRAY_PTR(ret)[2], &l) < 0)
+          return -EIO;
+        if ((size_t)l < *len) *len = (size_t)l;
+      }
+    }
+    *fd = rf_io_fd(io);
+    if (*fd < 0)
+      return -EIO;
+    return 0;
+}
+
+/* rf_read_cached
+ *
+ * rf_read through the read cache. The request is answered from it when
+ * every block it touches is cached; otherwise read is called once for all
+ * those blocks, on block boundaries, and they are stored. A shorter result
+ * than asked for is taken as the end of the file.
+ */
+static int
+rf_read_cached(const char *path, char *buf, size_t size, off_t offset,
+               struct fuse_file_info *fi) {
+    struct rf_mount *mount = rf_cur();
+    size_t bs = mount->read_cache.block_size;
+    unsigned long gen = mount->read_cache.gen;
+    off_t first = offset - offset % bs;
+    size_t skip = offset - first;
+    size_t want = (skip + size + bs - 1) / bs * bs;
+    size_t got, n;
+    char *data;
+    void *defer;
+    VALUE ret;
+    int res;
+
+    res = rf_readcache_read(&mount->read_cache,path,buf,size,offset);
+    if (res >= 0)
+      return res;
+
+    defer = rf_ll_defer_suspend();
+    ret = rf_call_read(rf_path_str(path),want,first,fi);
+    rf_ll_defer_resume(defer);
+    if (rf_strict_err(ret))
+      return rf_strict_err(ret);
+    if (!RTEST(ret))
+      return 0;
+    if (TYPE(ret) == T_STRING) {
+      data = RSTRING_PTR(ret);
+      got = RSTRING_LEN(ret);
+      if (got > want) got = want;
+      rf_readcache_store(&mount->read_cache,path,first,data,got,want,gen);
+    } else {
+      off_t pos;
+      ssize_t r;
+      int fd;
+
+      res = rf_read_io(ret,first,want,&fd,&pos,&got);
+      if (res != 0)
+        return res;
+      data = malloc(got);
+      if (data == NULL)
+        return -ENOMEM;
+      r = pread(fd,data,got,pos);
+      if (r < 0) {
+        res = -errno;
+        free(data);
+        return res;
+      }
+      got = r;
+      rf_readcache_store(&mount->read_cache,path,first,data,got,want,gen);
+    }
+
+    n = got > skip ? got - skip : 0;
+    if (n > size) n = size;
+    memcpy(buf,data + skip,n);
+    if (TYPE(ret) != T_STRING)
+      free(data);
+    RB_GC_GUARD(ret);
+    return (int)n;
+}
+
+static int
+rf_read(const char *path, char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fi) {
+    struct rf_mount *mount = rf_cur();
+    rf_trace_args(path,offset,size);
+    if (mount->read_cache.block_size)
+      return rf_read_cached(path,buf,size,offset,fi);
+    return rf_read_target(rf_path_str(path),buf,size,offset,fi);
+}
+
+#if FUSE_VERSION >= 29
+/* rf_read_buf
+ *
+ * Used when: like rf_read, on FUSE 2.9 and later.
+ *
+ * read may return, besides a String:
+ *   io                      - read size bytes at the requested offset
+ *   [io, offset]            - read size bytes at offset
+ *   [io, offset, length]    - read at most length bytes at offset
+ * where io is an IO (or an Integer fd). The data is then copied, or spliced
+ * when mounted with :splice_write, from the fd to the kernel by FUSE and
+ * never enters Ruby.
+ *
+ * The IO is pinned in the handle table until the next read on the handle,
+ * so it is not closed by the GC before FUSE is done with the fd.
+ */
+static int
+rf_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+            off_t offset, struct fuse_file_info *fi) {
+    struct rf_mount *mount = rf_cur();
+    struct fuse_bufvec *bufv;
+    VALUE ret;
+    off_t pos;
+    size_t len;
+    int fd, res;
+
+    rf_trace_args(path,offset,size);
+
+    bufv = malloc(sizeof(struct fuse_bufvec));
+    if (bufv == NULL)
+      return -ENOMEM;
+    *bufv = FUSE_BUFVEC_INIT(0);
+    *bufp = bufv;
+
+    if (mount->read_cache.block_size) {
+      bufv->buf[0].mem = malloc(size);
+      if (bufv->buf[0].mem == NULL)
+        return -ENOMEM;
+      res = rf_read_cached(path,bufv->buf[0].mem,size,offset,fi);
+      if (res < 0)
+        return res;
+      bufv->buf[0].size = res;
+      return 0;
+    }
+
+    ret = rf_call_read(rf_path_str(path),size,offset,fi);
+    if (rf_strict_err(ret))
+      return rf_strict_err(ret);
+    if (!RTEST(ret))
+      return 0;
+
+    if (TYPE(ret) == T_STRING) {
+      len=RSTRING_LEN(ret);
+      if(size<len)len=size;
+      bufv->buf[0].mem = malloc(len);
+      if (bufv->buf[0].mem == NULL && len > 0)
+        return -ENOMEM;
+      memcpy(bufv->buf[0].mem, RSTRING_PTR(ret), len);
+      bufv->buf[0].size = len;
+      return 0;
+    }
+
+    res = rf_read_io(ret,offset,size,&fd,&pos,&len);
+    if (res != 0)
+      return res;
+
+    rf_handle_pin(fi->fh, TYPE(ret) == T_ARRAY ? RARRAY_PTR(ret)[0] : ret);
+
+    bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bufv->buf[0].fd = fd;
+    bufv->buf[0].pos = pos;
+    bufv->buf[0].size = len;
+    return 0;
+}
+#endif
+
+/* rf_flush, rf_fsync
+ *
+ * Used when: a file is closed (once per close(2) of a descriptor) or
+ * fsync'd. Delivers what is left in its write-back buffer, and fails
+ * with the error of any buffered write that did not go through.
+ */
+static int
+rf_flush(const char *path, struct fuse_file_info *fi)
+{
+  rf_wbuf_flush(fi->fh);
+  return rf_wbuf_error(fi->fh);
+}
+
+static int
+rf_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  rf_wbuf_flush(fi->fh);
+  return rf_wbuf_error(fi->fh);
+}
+
 static int
 rf_fsyncdir(const char * path, int p, struct fuse_file_info *fi)
 {
   return 0;
 }
 
-static int 
-rf_utime(const char *path, struct utimbuf *ubuf)
-{
-  return 0;
+static int 
+rf_utime(const char *path, struct utimbuf *ubuf)
+{
+  return 0;
+}
+
+static int
+rf_statfs(const char *path, struct statvfs *buf)
+{
+  buf->f_frsize=1024;
+  buf->f_namemax=255;
+  buf->f_bsize=1024;
+  buf->f_blocks=1024*1024;
+  buf->f_bavail=1024*1024;
+  buf->f_bfree=1024*1024;
+  return 0;
+}
+
+/* The inode API
+ *
+ * Used when: mounted with :lowlevel => true and FuseRoot has 'lookup'.
+ *
+ * The callbacks of the lowlevel engine (struct rf_ll_ops), calling FuseRoot
+ * with inode numbers instead of paths:
+ *   lookup(parent, name)          #=> [ino, stat] or nil
+ *   forget(ino, nlookup)
+ *   getattr(ino)                  #=> stat or nil
+ *   readdir(ino)                  #=> [name, ...] or [[name, stat], ...]
+ *   create(parent, name, mode), mkdir(parent, name, mode),
+ *   unlink(parent, name), rmdir(parent, name),
+ *   rename(parent, name, newparent, newname), truncate(ino, size)
+ *   open(ino, mode, handle), read(ino, offset, size, handle),
+ *   write(ino, offset, str, handle), close(ino, handle)
+ * Inode 1 is the root directory.
+ */
+static int
+rf_ino_result(VALUE ret) {
+  if (strict_mode)
+    return rf_strict_err(ret);
+  return RTEST(ret) ? 0 : -EACCES;
+}
+
+static int
+rf_ino_lookup(fuse_ino_t parent, const char *name, fuse_ino_t *ino,
+              struct stat *st) {
+  VALUE argv[2];
+  VALUE ret;
+
+  argv[0]=ULONG2NUM(parent);
+  argv[1]=rb_str_new2(name);
+  ret=rf_root_call(RF_M_LOOKUP,2,argv);
+  if (rf_strict_err(ret))
+    return rf_strict_err(ret);
+  if (TYPE(ret) != T_ARRAY || RARRAY_LEN(ret) < 2)
+    return -ENOENT;
+  *ino=NUM2ULONG(RARRAY_PTR(ret)[0]);
+  return rf_stat_to_struct(RARRAY_PTR(ret)[1],st);
+}
+
+static int
+rf_ino_forget(fuse_ino_t ino, unsigned long nlookup) {
+  struct rf_mount *mount = rf_cur();
+  VALUE argv[2];
+
+  if (!mount->responds[RF_M_FORGET])
+    return 0;
+  argv[0]=ULONG2NUM(ino);
+  argv[1]=ULONG2NUM(nlookup);
+  rf_root_call(RF_M_FORGET,2,argv);
+  return 0;
+}
+
+static int
+rf_ino_getattr(fuse_ino_t ino, struct stat *st) {
+  VALUE argv[1];
+  VALUE ret;
+
+  argv[0]=ULONG2NUM(ino);
+  if (write_buffer_used)
+    rf_wbuf_flush_target(argv[0]);
+  ret=rf_root_call(RF_M_GETATTR,1,argv);
+  if (rf_ll_deferred())
+    return RF_LL_DEFERRED;
+  if (rf_strict_err(ret))
+    return rf_strict_err(ret);
+  if (!RTEST(ret))
+    return -ENOENT;
+  return rf_stat_to_struct(ret,st);
+}
+
+static int
+rf_ino_truncate(fuse_ino_t ino, off_t size) {
+  struct rf_mount *mount = rf_cur();
+  VALUE argv[2];
+
+  if (!mount->responds[RF_M_TRUNCATE])
+    return -EACCES;
+  argv[0]=ULONG2NUM(ino);
+  argv[1]=OFFT2NUM(size);
+  if (write_buffer_used)
+    rf_wbuf_flush_target(argv[0]);
+  return rf_ino_result(rf_root_call(RF_M_TRUNCATE,2,argv));
+}
+
+static int
+rf_ino_readdir(fuse_ino_t ino, void *buf, fuse_fill_dir_t filler) {
+  VALUE argv[1];
+  VALUE ret;
+
+  argv[0]=ULONG2NUM(ino);
+  ret=rf_root_call(RF_M_READDIR,1,argv);
+  if (rf_strict_err(ret))
+    return rf_strict_err(ret);
+  if (TYPE(ret) != T_ARRAY)
+    return -ENOENT;
+  return rf_readdir_stat(NULL,ret,buf,filler);
+}
+
+static int
+rf_ino_create(fuse_ino_t parent, const char *name, mode_t mode) {
+  VALUE argv[3];
+
+  if (!S_ISREG(mode))
+    return -EACCES;
+  argv[0]=ULONG2NUM(parent);
+  argv[1]=rb_str_new2(name);
+  argv[2]=INT2FIX(mode);
+  return rf_ino_result(rf_root_call(RF_M_CREATE,3,argv));
+}
+
+static int
+rf_ino_mkdir(fuse_ino_t parent, const char *name, mode_t mode) {
+  VALUE argv[3];
+
+  argv[0]=ULONG2NUM(parent);
+  argv[1]=rb_str_new2(name);
+  argv[2]=INT2FIX(mode);
+  return rf_ino_result(rf_root_call(RF_M_MKDIR,3,argv));
+}
+
+static int
+rf_ino_unlink(fuse_ino_t parent, const char *name) {
+  VALUE argv[2];
+
+  argv[0]=ULONG2NUM(parent);
+  argv[1]=rb_str_new2(name);
+  return rf_ino_result(rf_root_call(RF_M_UNLINK,2,argv));
+}
+
+static int
+rf_ino_rmdir(fuse_ino_t parent, const char *name) {
+  VALUE argv[2];
+
+  argv[0]=ULONG2NUM(parent);
+  argv[1]=rb_str_new2(name);
+  return rf_ino_result(rf_root_call(RF_M_RMDIR,2,argv));
+}
+
+static int
+rf_ino_rename(fuse_ino_t parent, const char *name,
+              fuse_ino_t newparent, const char *newname) {
+  VALUE argv[4];
+
+  argv[0]=ULONG2NUM(parent);
+  argv[1]=rb_str_new2(name);
+  argv[2]=ULONG2NUM(newparent);
+  argv[3]=rb_str_new2(newname);
+  return rf_ino_result(rf_root_call(RF_M_RENAME,4,argv));
+}
+
+static int
+rf_ino_open(fuse_ino_t ino, struct fuse_file_info *fi) {
+  return rf_open_target(ULONG2NUM(ino),fi);
+}
+
+static int
+rf_ino_read(fuse_ino_t ino, char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi) {
+  return rf_read_target(ULONG2NUM(ino),buf,size,offset,fi);
+}
+
+static int
+rf_ino_write(fuse_ino_t ino, const char *buf, size_t size, off_t offset,
+             struct fuse_file_info *fi) {
+  VALUE target=ULONG2NUM(ino);
+  char *dst=rf_wbuf_reserve(fi->fh,target,size,offset);
+  int err=0;
+  if (dst) {
+    memcpy(dst,buf,size);
+    rf_wbuf_commit(fi->fh,size);
+  } else {
+    err=rf_call_write(target,rb_str_new(buf,size),offset,fi->fh);
+  }
+  if (rf_ll_deferred())
+    return RF_LL_DEFERRED;
+  if (err)
+    return err;
+  return (int)size;
+}
+
+static int
+rf_ino_flush(fuse_ino_t ino, struct fuse_file_info *fi) {
+  rf_wbuf_flush(fi->fh);
+  return rf_wbuf_error(fi->fh);
+}
+
+static int
+rf_ino_fsync(fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+  rf_wbuf_flush(fi->fh);
+  return rf_wbuf_error(fi->fh);
+}
+
+static int
+rf_ino_release(fuse_ino_t ino, struct fuse_file_info *fi) {
+  return rf_release_target(ULONG2NUM(ino),fi);
+}
+
+/* Multi-threaded dispatch
+ *
+ * RbFuse.worker_loop lets a Ruby thread wait for and process FUSE commands
+ * without holding the GVL. The operations in rf_oper still touch Ruby
+ * objects, so each one is entered through an *_dispatch wrapper that takes
+ * the GVL back for just the duration of the operation. When commands are
+ * processed with the GVL held (RbFuse.process) the wrapper calls straight
+ * through.
+ *
+ * A non-StandardError exception raised by a callback (Interrupt, Thread#kill)
+ * cannot unwind through libfuse, so it is caught, the operation fails with
+ * EIO, and the worker re-raises it once it is back in Ruby.
+ */
+
+/* rf_worker
+ *
+ * One per thread in RbFuse.worker_loop. It lives on that thread's stack,
+ * which the GC scans, so the saved exception stays alive.
+ */
+struct rf_worker {
+  int wake[2];
+  volatile int stop;  /* set by the unblock function or a failed callback */
+  int exited;         /* the filesystem went away */
+  int main_loop;      /* RbFuse.main_loop rather than a pool worker */
+  int state;
+  VALUE error;
+  struct rf_worker *next;
+};
+
+static __thread struct rf_worker *rf_current_worker = NULL;
+static __thread int rf_without_gvl = 0;
+static struct rf_worker *rf_workers = NULL; /* only changed with the GVL */
+static volatile int rf_running = 0;
+
+struct rf_gvl_call {
+  void *(*func)(void *);
+  void *args;
+};
+
+static VALUE
+rf_gvl_protected(VALUE data) {
+  struct rf_gvl_call *call = (struct rf_gvl_call *)data;
+  call->func(call->args);
+  return Qnil;
+}
+
+static void *
+rf_gvl_trampoline(void *data) {
+  struct rf_worker *w = rf_current_worker;
+  int state = 0;
+
+  rf_without_gvl = 0;
+  rb_protect(rf_gvl_protected, (VALUE)data, &state);
+  rf_without_gvl = 1;
+  if (state && w && !w->state) {
+    w->state = state;
+    w->error = rb_errinfo();
+    w->stop = 1;
+    rb_set_errinfo(Qnil);
+  }
+  return NULL;
+}
+
+/* rf_call_ruby
+ *
+ * Runs func(args) with the GVL held.
+ */
+static void
+rf_call_ruby(void *(*func)(void *), void *args) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  struct rf_gvl_call call;
+
+  rf_stats_call_begin();
+
+  if (rf_without_gvl) {
+    if (rf_current_worker && rf_current_worker->state)
+      return;
+    call.func = func;
+    call.args = args;
+    rb_thread_call_with_gvl(rf_gvl_trampoline, &call);
+    return;
+  }
+#endif
+  func(args);
+}
+
+/* rf_dispatch_begin / rf_dispatch_end
+ *
+ * Count each operation for RbFuse.dispatch_stats and, when enabled, the
+ * Ruby objects allocated while it ran, and time it for RbFuse.stats.
+ * Called with the GVL held.
+ */
+static size_t
+rf_dispatch_begin(enum rf_op op) {
+  dispatch_calls[op]++;
+  rf_stats_op_begin(op);
+  if (rf_trace_on)
+    rf_trace_op(op, fusefs_pid());
+#ifdef HAVE_RB_GC_STAT
+  if (dispatch_stats_enabled)
+    return rb_gc_stat(sym_total_allocated_objects);
+#endif
+  return 0;
+}
+
+static void
+rf_dispatch_end(enum rf_op op, size_t before, int ret) {
+  if (ret == RF_LL_DEFERRED)
+    ret = 0;
+  rf_stats_op_end(op, ret, op == RF_OP_READ || op == RF_OP_WRITE);
+  rf_trace_result(ret);
+#ifdef HAVE_RB_GC_STAT
+  if (dispatch_stats_enabled)
+    dispatch_allocs[op] += rb_gc_stat(sym_total_allocated_objects) - before;
+#endif
+}
+
+#define RF_DISPATCH1(op, opid, T1)                                \
+  struct op##_args { T1 a1; int ret; };                           \
+  static void *op##_gvl(void *p) {                                \
+    struct op##_args *a = p;                                      \
+    size_t allocs = rf_dispatch_begin(opid);                      \
+    a->ret = op(a->a1);                                           \
+    rf_dispatch_end(opid, allocs, a->ret);                        \
+    return NULL;                                                  \
+  }                                                               \
+  static int op##_dispatch(T1 a1) {                               \
+    struct op##_args a;                                           \
+    a.a1 = a1; a.ret = -EIO;                                      \
+    rf_call_ruby(op##_gvl, &a);                                   \
+    return a.ret;                                                 \
+  }
+
+#define RF_DISPATCH2(op, opid, T1, T2)                            \
+  struct op##_args { T1 a1; T2 a2; int ret; };                    \
+  static void *op##_gvl(void *p) {                                \
+    struct op##_args *a = p;                                      \
+    size_t allocs = rf_dispatch_begin(opid);                      \
+    a->ret = op(a->a1, a->a2);                                    \
+    rf_dispatch_end(opid, allocs, a->ret);                        \
+    return NULL;                                                  \
+  }                                                               \
+  static int op##_dispatch(T1 a1, T2 a2) {                        \
+    struct op##_args a;                                           \
+    a.a1 = a1; a.a2 = a2; a.ret = -EIO;                           \
+    rf_call_ruby(op##_gvl, &a);                                   \
+    return a.ret;                                                 \
+  }
+
+#define RF_DISPATCH3(op, opid, T1, T2, T3)                        \
+  struct op##_args { T1 a1; T2 a2; T3 a3; int ret; };             \
+  static void *op##_gvl(void *p) {                                \
+    struct op##_args *a = p;                                      \
+    size_t allocs = rf_dispatch_begin(opid);                      \
+    a->ret = op(a->a1, a->a2, a->a3);                             \
+    rf_dispatch_end(opid, allocs, a->ret);                        \
+    return NULL;                                                  \
+  }                                                               \
+  static int op##_dispatch(T1 a1, T2 a2, T3 a3) {                 \
+    struct op##_args a;                                           \
+    a.a1 = a1; a.a2 = a2; a.a3 = a3; a.ret = -EIO;                \
+    rf_call_ruby(op##_gvl, &a);                                   \
+    return a.ret;                                                 \
+  }
+
+#define RF_DISPATCH4(op, opid, T1, T2, T3, T4)                    \
+  struct op##_args { T1 a1; T2 a2; T3 a3; T4 a4; int ret; };      \
+  static void *op##_gvl(void *p) {                                \
+    struct op##_args *a = p;                                      \
+    size_t allocs = rf_dispatch_begin(opid);                      \
+    a->ret = op(a->a1, a->a2, a->a3, a->a4);                      \
+    rf_dispatch_end(opid, allocs, a->ret);                        \
+    return NULL;                                                  \
+  }                                                               \
+  static int op##_dispatch(T1 a1, T2 a2, T3 a3, T4 a4) {          \
+    struct op##_args a;                                           \
+    a.a1 = a1; a.a2 = a2; a.a3 = a3; a.a4 = a4; a.ret = -EIO;     \
+    rf_call_ruby(op##_gvl, &a);                                   \
+    return a.ret;                                                 \
+  }
+
+#define RF_DISPATCH5(op, opid, T1, T2, T3, T4, T5)                \
+  struct op##_args { T1 a1; T2 a2; T3 a3; T4 a4; T5 a5; int ret; }; \
+  static void *op##_gvl(void *p) {                                \
+    struct op##_args *a = p;                                      \
+    size_t allocs = rf_dispatch_begin(opid);                      \
+    a->ret = op(a->a1, a->a2, a->a3, a->a4, a->a5);               \
+    rf_dispatch_end(opid, allocs, a->ret);                        \
+    return NULL;                                                  \
+  }                                                               \
+  static int op##_dispatch(T1 a1, T2 a2, T3 a3, T4 a4, T5 a5) {   \
+    struct op##_args a;                                           \
+    a.a1 = a1; a.a2 = a2; a.a3 = a3; a.a4 = a4; a.a5 = a5;        \
+    a.ret = -EIO;                                                 \
+    rf_call_ruby(op##_gvl, &a);                                   \
+    return a.ret;                                                 \
+  }
+
+RF_DISPATCH2(rf_getattr2, RF_OP_GETATTR, const char *, struct stat *)
+RF_DISPATCH5(rf_readdir, RF_OP_READDIR, const char *, void *,
+             fuse_fill_dir_t, off_t, struct fuse_file_info *)
+RF_DISPATCH3(rf_mknod, RF_OP_MKNOD, const char *, mode_t, dev_t)
+RF_DISPATCH1(rf_unlink, RF_OP_UNLINK, const char *)
+RF_DISPATCH2(rf_mkdir, RF_OP_MKDIR, const char *, mode_t)
+RF_DISPATCH1(rf_rmdir, RF_OP_RMDIR, const char *)
+RF_DISPATCH2(rf_truncate, RF_OP_TRUNCATE, const char *, off_t)
+RF_DISPATCH2(rf_rename, RF_OP_RENAME, const char *, const char *)
+RF_DISPATCH2(rf_open, RF_OP_OPEN, const char *, struct fuse_file_info *)
+RF_DISPATCH2(rf_release, RF_OP_RELEASE, const char *,
+             struct fuse_file_info *)
+RF_DISPATCH2(rf_flush, RF_OP_FLUSH, const char *, struct fuse_file_info *)
+RF_DISPATCH3(rf_fsync, RF_OP_FSYNC, const char *, int,
+             struct fuse_file_info *)
+RF_DISPATCH5(rf_read, RF_OP_READ, const char *, char *, size_t, off_t,
+             struct fuse_file_info *)
+RF_DISPATCH5(rf_write, RF_OP_WRITE, const char *, const char *, size_t,
+             off_t, struct fuse_file_info *)
+#if FUSE_VERSION >= 29
+RF_DISPATCH5(rf_read_buf, RF_OP_READ, const char *, struct fuse_bufvec **,
+             size_t, off_t, struct fuse_file_info *)
+RF_DISPATCH4(rf_write_buf, RF_OP_WRITE, const char *, struct fuse_bufvec *,
+             off_t, struct fuse_file_info *)
+#endif
+
+RF_DISPATCH4(rf_ino_lookup, RF_OP_LOOKUP, fuse_ino_t, const char *,
+             fuse_ino_t *, struct stat *)
+RF_DISPATCH2(rf_ino_forget, RF_OP_FORGET, fuse_ino_t, unsigned long)
+RF_DISPATCH2(rf_ino_getattr, RF_OP_GETATTR, fuse_ino_t, struct stat *)
+RF_DISPATCH2(rf_ino_truncate, RF_OP_TRUNCATE, fuse_ino_t, off_t)
+RF_DISPATCH3(rf_ino_readdir, RF_OP_READDIR, fuse_ino_t, void *,
+             fuse_fill_dir_t)
+RF_DISPATCH3(rf_ino_create, RF_OP_MKNOD, fuse_ino_t, const char *, mode_t)
+RF_DISPATCH3(rf_ino_mkdir, RF_OP_MKDIR, fuse_ino_t, const char *, mode_t)
+RF_DISPATCH2(rf_ino_unlink, RF_OP_UNLINK, fuse_ino_t, const char *)
+RF_DISPATCH2(rf_ino_rmdir, RF_OP_RMDIR, fuse_ino_t, const char *)
+RF_DISPATCH4(rf_ino_rename, RF_OP_RENAME, fuse_ino_t, const char *,
+             fuse_ino_t, const char *)
+RF_DISPATCH2(rf_ino_open, RF_OP_OPEN, fuse_ino_t, struct fuse_file_info *)
+RF_DISPATCH5(rf_ino_read, RF_OP_READ, fuse_ino_t, char *, size_t, off_t,
+             struct fuse_file_info *)
+RF_DISPATCH5(rf_ino_write, RF_OP_WRITE, fuse_ino_t, const char *, size_t,
+             off_t, struct fuse_file_info *)
+RF_DISPATCH2(rf_ino_release, RF_OP_RELEASE, fuse_ino_t,
+             struct fuse_file_info *)
+RF_DISPATCH2(rf_ino_flush, RF_OP_FLUSH, fuse_ino_t, struct fuse_file_info *)
+RF_DISPATCH3(rf_ino_fsync, RF_OP_FSYNC, fuse_ino_t, int,
+             struct fuse_file_info *)
+
+/* MemDir fast paths
+ *
+ * When the root is a RbFuse::MemDir, rf_oper enters through these. Paths in
+ * its tree are served right here, on the thread that read the request and
+ * without the GVL; only misses reach the *_dispatch wrappers and Ruby.
+ * Files opened from the tree carry RF_MEMFS_FH in fi->fh. RF_MEMFS_TRY
+ * expects the rf_mount of the request in mount.
+ */
+#define RF_MEMFS_TRY(call)                                        \
+  if (mount->memfs) {                                             \
+    int res = (call);                                             \
+    if (res != RF_MEMFS_MISS)                                     \
+      return res;                                                 \
+  }
+
+static int
+rf_getattr_entry(const char *path, struct stat *st) {
+  struct rf_mount *mount = rf_cur();
+  RF_MEMFS_TRY(rf_memfs_getattr(mount->memfs, path, st));
+  return rf_getattr2_dispatch(path, st);
+}
+
+static int
+rf_readdir_entry(const char *path, void *buf, fuse_fill_dir_t filler,
+                 off_t offset, struct fuse_file_info *fi) {
+  struct rf_mount *mount = rf_cur();
+  RF_MEMFS_TRY(rf_memfs_readdir(mount->memfs, path, buf, filler));
+  return rf_readdir_dispatch(path, buf, filler, offset, fi);
+}
+
+static int
+rf_open_entry(const char *path, struct fuse_file_info *fi) {
+  struct rf_mount *mount = rf_cur();
+  RF_MEMFS_TRY(rf_memfs_open(mount->memfs, path, fi));
+  return rf_open_dispatch(path, fi);
+}
+
+static int
+rf_read_entry(const char *path, char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi) {
+  struct rf_mount *mount = rf_cur();
+  if (fi->fh & RF_MEMFS_FH)
+    return rf_memfs_read(mount->memfs, fi->fh, buf, size, offset);
+  return rf_read_dispatch(path, buf, size, offset, fi);
+}
+
+#if FUSE_VERSION >= 29
+static int
+rf_read_buf_entry(const char *path, struct fuse_bufvec **bufp, size_t size,
+                  off_t offset, struct fuse_file_info *fi) {
+  struct rf_mount *mount = rf_cur();
+  struct fuse_bufvec *bufv;
+  int res;
+
+  if (!(fi->fh & RF_MEMFS_FH))
+    return rf_read_buf_dispatch(path, bufp, size, offset, fi);
+
+  bufv = malloc(sizeof(struct fuse_bufvec));
+  if (bufv == NULL)
+    return -ENOMEM;
+  *bufv = FUSE_BUFVEC_INIT(0);
+  bufv->buf[0].mem = malloc(size);
+  if (bufv->buf[0].mem == NULL) {
+    free(bufv);
+    return -ENOMEM;
+  }
+  res = rf_memfs_read(mount->memfs, fi->fh, bufv->buf[0].mem, size, offset);
+  if (res < 0) {
+    free(bufv->buf[0].mem);
+    free(bufv);
+    return res;
+  }
+  bufv->buf[0].size = res;
+  *bufp = bufv;
+  return 0;
+}
+#endif
+
+static int
+rf_release_entry(const char *path, struct fuse_file_info *fi) {
+  struct rf_mount *mount = rf_cur();
+  if (fi->fh & RF_MEMFS_FH) {
+    rf_memfs_release(mount->memfs, fi->fh);
+    return 0;
+  }
+  return rf_release_dispatch(path, fi);
+}
+
+/* Buffered data is only ever delivered under the GVL; until a buffer
+ * has been created there is nothing to flush and no reason to take it. */
+static int
+rf_flush_entry(const char *path, struct fuse_file_info *fi) {
+  if (!write_buffer_used || (fi->fh & RF_MEMFS_FH))
+    return 0;
+  return rf_flush_dispatch(path, fi);
+}
+
+static int
+rf_fsync_entry(const char *path, int datasync, struct fuse_file_info *fi) {
+  if (!write_buffer_used || (fi->fh & RF_MEMFS_FH))
+    return 0;
+  return rf_fsync_dispatch(path, datasync, fi);
+}
+
+static int
+rf_ino_flush_entry(fuse_ino_t ino, struct fuse_file_info *fi) {
+  if (!write_buffer_used)
+    return 0;
+  return rf_ino_flush_dispatch(ino, fi);
+}
+
+static int
+rf_ino_fsync_entry(fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+  if (!write_buffer_used)
+    return 0;
+  return rf_ino_fsync_dispatch(ino, datasync, fi);
+}
+
+static int
+rf_mknod_entry(const char *path, mode_t mode, dev_t rdev) {
+  struct rf_mount *mount = rf_cur();
+  RF_MEMFS_TRY(rf_memfs_changed(mount->memfs, path));
+  return rf_mknod_dispatch(path, mode, rdev);
+}
+
+static int
+rf_unlink_entry(const char *path) {
+  struct rf_mount *mount = rf_cur();
+  RF_MEMFS_TRY(rf_memfs_changed(mount->memfs, path));
+  return rf_unlink_dispatch(path);
+}
+
+static int
+rf_mkdir_entry(const char *path, mode_t mode) {
+  struct rf_mount *mount = rf_cur();
+  RF_MEMFS_TRY(rf_memfs_changed(mount->memfs, path));
+  return rf_mkdir_dispatch(path, mode);
+}
+
+static int
+rf_rmdir_entry(const char *path) {
+  struct rf_mount *mount = rf_cur();
+  RF_MEMFS_TRY(rf_memfs_changed(mount->memfs, path));
+  return rf_rmdir_dispatch(path);
+}
+
+static int
+rf_truncate_entry(const char *path, off_t length) {
+  struct rf_mount *mount = rf_cur();
+  RF_MEMFS_TRY(rf_memfs_changed(mount->memfs, path));
+  return rf_truncate_dispatch(path, length);
+}
+
+static int
+rf_rename_entry(const char *path, const char *dest) {
+  struct rf_mount *mount = rf_cur();
+  RF_MEMFS_TRY(rf_memfs_changed(mount->memfs, path));
+  RF_MEMFS_TRY(rf_memfs_changed(mount->memfs, dest));
+  return rf_rename_dispatch(path, dest);
+}
+
+/* rf_oper
+ *
+ * Used for: FUSE utilizes this to call operations at the appropriate time.
+ *
+ * This is utilized by rf_mount
+ */
+static struct fuse_operations rf_oper = {
+    .getattr   = rf_getattr_entry,
+    .readdir   = rf_readdir_entry,
+    .mknod     = rf_mknod_entry,
+    .unlink    = rf_unlink_entry,
+    .mkdir     = rf_mkdir_entry,
+    .rmdir     = rf_rmdir_entry,
+    .truncate  = rf_truncate_entry,
+    .rename    = rf_rename_entry,
+    .open      = rf_open_entry,
+    .release   = rf_release_entry,
+    .read      = rf_read_entry,
+#if FUSE_VERSION >= 29
+    .read_buf  = rf_read_buf_entry,
+    .write_buf = rf_write_buf_dispatch,
+#endif
+    .write     = rf_write_dispatch,
+    .flush     = rf_flush_entry,
+    .fsync     = rf_fsync_entry,
+    .fsyncdir  = rf_fsyncdir,
+    .utime     = rf_utime,
+    .statfs    = rf_statfs,
+};
+
+/* rf_ino_oper
+ *
+ * Used for: the lowlevel engine, when FuseRoot implements the inode API.
+ */
+static const struct rf_ll_ops rf_ino_oper = {
+    .lookup   = rf_ino_lookup_dispatch,
+    .forget   = rf_ino_forget_dispatch,
+    .getattr  = rf_ino_getattr_dispatch,
+    .truncate = rf_ino_truncate_dispatch,
+    .readdir  = rf_ino_readdir_dispatch,
+    .mknod    = rf_ino_create_dispatch,
+    .mkdir    = rf_ino_mkdir_dispatch,
+    .unlink   = rf_ino_unlink_dispatch,
+    .rmdir    = rf_ino_rmdir_dispatch,
+    .rename   = rf_ino_rename_dispatch,
+    .open     = rf_ino_open_dispatch,
+    .read     = rf_ino_read_dispatch,
+    .write    = rf_ino_write_dispatch,
+    .flush    = rf_ino_flush_entry,
+    .fsync    = rf_ino_fsync_entry,
+    .release  = rf_ino_release_dispatch,
+};
+
+/* rf_resolve_root
+ *
+ * Records which callbacks the root of m implements. Done once per
+ * set_root, so methods defined on the root afterwards are only picked up
+ * by calling set_root again.
+ */
+static void
+rf_resolve_root(struct rf_mount *m) {
+  int i;
+  for (i = 0; i < RF_M_MAX; i++) {
+    m->responds[i] =
+      !NIL_P(m->root) && rb_respond_to(m->root, rf_method_ids[i]);
+  }
+}
+
+static void
+rf_mount_set_root(struct rf_mount *m, VALUE rootval) {
+  m->rootval = rootval;
+  m->memfs = rf_memfs_get(rootval);
+  m->root = m->memfs ? rf_memfs_fallback(m->memfs) : rootval;
+  rf_resolve_root(m);
+}
+
+/* rf_set_root
+ *
+ * Used by: FuseFS.set_root
+ *
+ * This defines FuseRoot, which is the crux of FuseFS. It is required to
+ *   have the methods "directory?" "file?" "contents" "writable?" "read_file"
+ *   and "write_to"
+ */
+VALUE
+rf_set_root(VALUE self, VALUE rootval) {
+  if (self != cRbFuse) {
+    rb_raise(cFSException,"Error: 'set_root' called outside of FuseFS?!");
+    return Qnil;
+  }
+
+  rb_iv_set(cRbFuse,"@root",rootval);
+  rf_mount_set_root(default_mount, rootval);
+  return Qtrue;
+}
+
+/* RbFuse::Mount
+ *
+ * The Ruby side of struct rf_mount. Freed by the GC only once it is out
+ * of live_mounts, when no command can reach it any more.
+ */
+static void
+rf_mount_mark(void *p) {
+  struct rf_mount *m = p;
+  rb_gc_mark(m->rootval);
+  rb_gc_mark(m->root);
+  rb_gc_mark(m->mountpoint);
+}
+
+static void
+rf_mount_free(void *p) {
+  struct rf_mount *m = p;
+  struct rf_mount **q;
+
+  for (q = &all_mounts; *q; q = &(*q)->next) {
+    if (*q == m) {
+      *q = m->next;
+      break;
+    }
+  }
+  rf_attrcache_configure(&m->attr_cache, 0, 0, 0);
+  rf_readcache_configure(&m->read_cache, 0, 0);
+  xfree(m);
+}
+
+static size_t
+rf_mount_memsize(const void *p) {
+  return sizeof(struct rf_mount);
+}
+
+static const rb_data_type_t mount_type = {
+  .wrap_struct_name = "RbFuse::Mount",
+  .function = {
+    .dmark = rf_mount_mark,
+    .dfree = rf_mount_free,
+    .dsize = rf_mount_memsize,
+  },
+};
+
+/* rf_mount_caches
+ *
+ * Sets up the caches of m as RbFuse.attr_cache= and read_cache= were
+ * last given. Cached entries are dropped.
+ */
+static void
+rf_mount_caches(struct rf_mount *m) {
+  rf_attrcache_configure(&m->attr_cache, attr_cache_ttl,
+                         attr_cache_negative_ttl, attr_cache_max_entries);
+  rf_readcache_configure(&m->read_cache, read_cache_block_size,
+                         read_cache_max_bytes);
+}
+
+static VALUE
+rf_mount_alloc(VALUE klass) {
+  struct rf_mount *m;
+  VALUE self = TypedData_Make_Struct(klass, struct rf_mount, &mount_type, m);
+
+  m->self = self;
+  m->rootval = Qnil;
+  m->root = Qnil;
+  m->mountpoint = Qnil;
+  m->direct_io = 1;
+  rf_attrcache_init(&m->attr_cache);
+  rf_readcache_init(&m->read_cache);
+  rf_mount_caches(m);
+  m->next = all_mounts;
+  all_mounts = m;
+  return self;
+}
+
+static struct rf_mount *
+rf_mount_get(VALUE self) {
+  struct rf_mount *m;
+  TypedData_Get_Struct(self, struct rf_mount, &mount_type, m);
+  return m;
+}
+
+/* rf_mount_release
+ *
+ * The release callback of the fusefs_mount, on whichever thread processed
+ * its last command: only flags m for rf_mounts_prune.
+ */
+static void
+rf_mount_release(void *data) {
+  struct rf_mount *m = data;
+  __atomic_store_n(&m->released, 1, __ATOMIC_RELEASE);
+}
+
+/* rf_mounts_prune
+ *
+ * Gives up the mounts the kernel has unmounted (fusermount -u), and takes
+ * out of live_mounts those that have been torn down.
+ */
+static void
+rf_mounts_prune(void) {
+  long i;
+
+  for (i = RARRAY_LEN(live_mounts) - 1; i >= 0; i--) {
+    struct rf_mount *m = rf_mount_get(RARRAY_PTR(live_mounts)[i]);
+    if (m->fm && !fusefs_mounted(m->fm)) {
+      fusefs_unmount(m->fm);
+      m->fm = NULL;
+    }
+    if (m->fm == NULL && __atomic_load_n(&m->released, __ATOMIC_ACQUIRE))
+      rb_ary_delete_at(live_mounts, i);
+  }
+}
+
+struct mount_opts {
+  struct rf_mount *mount;
+  struct fuse_args *args;
+  struct rf_ll_conf *ll; /* NULL unless :lowlevel => true */
+  /* Request sizes, 0 for the FUSE default; see mount_io_opts */
+  size_t max_write, max_read, max_readahead;
+  int big_writes;
+};
+
+/* Largest request FUSE 2 can carry: the kernel sends at most 32 pages per
+ * request and libfuse sizes its receive buffer to match. */
+#define RF_MAX_IO (128 * 1024)
+
+/* mount_io_opt
+ *
+ * Takes the request size options out of the mount option Hash: big_writes,
+ * max_write, max_read, max_readahead, max_pages (the libfuse 3 name, in
+ * pages, for max_write and max_read) and large_io, which asks for the
+ * largest requests there are. Returns 0 for any other option.
+ */
+static int
+mount_io_opt(struct mount_opts *mo, const char *name, VALUE val) {
+  size_t n;
+
+  if (strcmp(name,"big_writes") == 0) {
+    mo->big_writes = RTEST(val);
+    return 1;
+  }
+  if (strcmp(name,"large_io") == 0) {
+    if (RTEST(val)) {
+      mo->big_writes = 1;
+      if (!mo->max_write) mo->max_write = RF_MAX_IO;
+      if (!mo->max_read) mo->max_read = RF_MAX_IO;
+      if (!mo->max_readahead) mo->max_readahead = RF_MAX_IO;
+    }
+    return 1;
+  }
+  if (strcmp(name,"max_write") != 0 && strcmp(name,"max_read") != 0 &&
+      strcmp(name,"max_readahead") != 0 && strcmp(name,"max_pages") != 0)
+    return 0;
+
+  n = NIL_P(val) ? 0 : NUM2SIZET(val);
+  if (strcmp(name,"max_pages") == 0) {
+    n *= (size_t)sysconf(_SC_PAGESIZE);
+    mo->max_write = mo->max_read = n;
+  } else if (strcmp(name,"max_write") == 0) {
+    mo->max_write = n;
+  } else if (strcmp(name,"max_read") == 0) {
+    mo->max_read = n;
+  } else {
+    mo->max_readahead = n;
+  }
+  return 1;
+}
+
+/* mount_io_opts
+ *
+ * Adds the "-o" arguments for the request sizes collected by mount_io_opt.
+ * Sizes above RF_MAX_IO are lowered to it, as FUSE 2 would do anyway, and
+ * a max_write above a page turns big_writes on, without which the kernel
+ * sends cached writes a page at a time.
+ */
+static void
+mount_io_opts(struct mount_opts *mo) {
+  char buf[64];
+
+  if (mo->max_write > RF_MAX_IO) mo->max_write = RF_MAX_IO;
+  if (mo->max_read > RF_MAX_IO) mo->max_read = RF_MAX_IO;
+  if (mo->max_write > (size_t)sysconf(_SC_PAGESIZE))
+    mo->big_writes = 1;
+
+  if (mo->big_writes)
+    fuse_opt_add_arg(mo->args, "-obig_writes");
+  if (mo->max_write) {
+    snprintf(buf, sizeof(buf), "-omax_write=%zu", mo->max_write);
+    fuse_opt_add_arg(mo->args, buf);
+  }
+  if (mo->max_read) {
+    snprintf(buf, sizeof(buf), "-omax_read=%zu", mo->max_read);
+    fuse_opt_add_arg(mo->args, buf);
+  }
+  if (mo->max_readahead) {
+    snprintf(buf, sizeof(buf), "-omax_readahead=%zu", mo->max_readahead);
+    fuse_opt_add_arg(mo->args, buf);
+  }
+}
+
+/* mount_opt_i
+ *
+ * rb_hash_foreach callback turning the mount option Hash into "-o"
+ * arguments. direct_io and keep_cache are not passed to FUSE: they are
+ * the defaults rf_open applies to every file it opens on the mount. With
+ * the lowlevel engine the timeouts are kept by the engine as well.
+ */
+static int
+mount_opt_i(VALUE key, VALUE val, VALUE arg) {
+  struct mount_opts *mo = (struct mount_opts *)arg;
+  struct fuse_args *opts = mo->args;
+  const char *name;
+  VALUE str;
+
+  if (SYMBOL_P(key)) {
+    name = rb_id2name(SYM2ID(key));
+  } else {
+    name = StringValueCStr(key);
+  }
+
+  if (strcmp(name,"direct_io") == 0) {
+    mo->mount->direct_io = RTEST(val);
+    return ST_CONTINUE;
+  }
+  if (strcmp(name,"keep_cache") == 0) {
+    mo->mount->keep_cache = RTEST(val);
+    return ST_CONTINUE;
+  }
+  if (strcmp(name,"lowlevel") == 0)
+    return ST_CONTINUE;
+  if (mount_io_opt(mo, name, val))
+    return ST_CONTINUE;
+  if (mo->ll && (FIXNUM_P(val) || TYPE(val) == T_FLOAT) &&
+      rf_ll_conf_opt(mo->ll, name, NUM2DBL(val)))
+    return ST_CONTINUE;
+
+  if (val == Qfalse || NIL_P(val))
+    return ST_CONTINUE;
+  if (val == Qtrue) {
+    str = rb_str_new2("-o");
+    rb_str_cat2(str, name);
+  } else {
+    str = rb_str_new2("-o");
+    rb_str_cat2(str, name);
+    rb_str_cat2(str, "=");
+    rb_str_append(str, rb_obj_as_string(val));
+  }
+  fuse_opt_add_arg(opts, StringValueCStr(str));
+  return ST_CONTINUE;
+}
+
+/* rf_mount_busy
+ *
+ * Whether m is mounted, or still draining the commands of its last mount.
+ */
+static int
+rf_mount_busy(struct rf_mount *m) {
+  rf_mounts_prune();
+  return m->fm != NULL || RTEST(rb_ary_includes(live_mounts, m->self));
+}
+
+/* rf_mount_start
+ *
+ * Mounts m. argv is what mount_to and Mount.new take: the directory, any
+ * further String "-o" options and a trailing Hash of options, e.g.
+ *   :attr_timeout => 60, :kernel_cache => true, :direct_io => false
+ * Files are opened with direct_io unless :direct_io => false is given.
+ *
+ * With :lowlevel => true the filesystem is served by the lowlevel engine
+ * (rbfuse_ll.c): through the inode API if the root has 'lookup',
+ * otherwise by resolving inodes to paths for the usual callbacks.
+ *
+ * Returns 0 if FUSE could not mount it.
+ */
+static int
+rf_mount_start(struct rf_mount *m, int argc, VALUE *argv) {
+  struct fuse_args opts = FUSE_ARGS_INIT(0, NULL);
+  struct fusefs_mount *fm;
+  struct rf_ll_conf ll;
+  struct mount_opts mo;
+  VALUE mountpoint;
+  VALUE hash = Qnil;
+  int i;
+  char *cur;
+
+  mountpoint = argv[0];
+
+  Check_Type(mountpoint, T_STRING);
+  if (argc > 1 && TYPE(argv[argc-1]) == T_HASH) {
+    hash = argv[argc-1];
+    argc--;
+  }
+
+  m->direct_io = 1;
+  m->keep_cache = 0;
+
+  /* argv[0] is the program name as far as FUSE's option parser goes */
+  fuse_opt_add_arg(&opts, "rbfuse");
+
+  for (i = 1; i < argc; i++) {
+    VALUE o = rb_str_new2("-o");
+    cur = StringValueCStr(argv[i]);
+    rb_str_cat2(o, cur);
+    fuse_opt_add_arg(&opts, StringValueCStr(o));
+  }
+  memset(&mo, 0, sizeof(mo));
+  mo.mount = m;
+  mo.args = &opts;
+  if (!NIL_P(hash)) {
+    if (RTEST(rb_hash_aref(hash, ID2SYM(rb_intern("lowlevel"))))) {
+      rf_ll_conf_init(&ll);
+      mo.ll = &ll;
+    }
+    rb_hash_foreach(hash, mount_opt_i, (VALUE)&mo);
+  }
+  mount_io_opts(&mo);
+
+  m->released = 0;
+  if (mo.ll) {
+    fm = rf_ll_mount(StringValueCStr(mountpoint), &opts,
+                     m->responds[RF_M_LOOKUP] ? &rf_ino_oper : NULL,
+                     &rf_oper, mo.ll, m, rf_mount_release);
+  } else {
+    fm = fusefs_setup(StringValueCStr(mountpoint), &rf_oper, &opts,
+                      m, rf_mount_release);
+  }
+  fuse_opt_free_args(&opts);
+  if (fm == NULL)
+    return 0;
+
+  m->fm = fm;
+  m->mountpoint = mountpoint;
+  rb_ary_push(live_mounts, m->self);
+  rf_running = 1;
+  return 1;
+}
+
+/* rf_mount_to
+ *
+ * Used by: FuseFS.mount_to(dir)
+ *
+ * FuseFS.mount_to(dir) calls FUSE to mount FuseFS under the given directory,
+ * with the root given to set_root, which must be called first. The
+ * options are those of RbFuse::Mount.new. Only one filesystem is mounted
+ * this way at a time; use RbFuse::Mount for more.
+ */
+VALUE
+rf_mount_to(int argc, VALUE *argv, VALUE self) {
+  if (self != cRbFuse) {
+    rb_raise(cFSException,"Error: 'mount_to' called outside of FuseFS?!");
+    return Qnil;
+  }
+
+  if (argc == 0) {
+    rb_raise(rb_eArgError,"mount_to requires at least 1 argument!");
+    return Qnil;
+  }
+
+  rb_iv_set(cRbFuse,"@mountpoint",argv[0]);
+  if (!rf_mount_busy(default_mount))
+    rf_mount_start(default_mount, argc, argv);
+  return Qtrue;
+}
+
+/* rf_mount_initialize
+ *
+ * Used by: RbFuse::Mount.new(dir, root, *options)
+ *
+ * Mounts root under dir alongside any other mount of the process, with
+ * the options of mount_to. Every mount has its own root, caches and
+ * inode table; the commands of all of them are served by the same run
+ * loop or worker threads.
+ */
+static VALUE
+rf_mount_initialize(int argc, VALUE *argv, VALUE self) {
+  struct rf_mount *m = rf_mount_get(self);
+  VALUE *args;
+  int i;
+
+  if (argc < 2)
+    rb_raise(rb_eArgError,"Mount.new requires a directory and a root");
+  if (rf_mount_busy(m))
+    rb_raise(cFSException,"already mounted");
+
+  args = ALLOCA_N(VALUE, argc - 1);
+  rf_mount_set_root(m, argv[1]);
+  args[0] = argv[0];
+  for (i = 2; i < argc; i++)
+    args[i - 1] = argv[i];
+  if (!rf_mount_start(m, argc - 1, args))
+    rb_raise(cFSException,"could not mount %s",StringValueCStr(argv[0]));
+  return self;
+}
+
+/* rf_mount_unmount
+ *
+ * Used by: RbFuse::Mount#unmount
+ *
+ * Unmounts once the commands being processed on the mount are done.
+ */
+static VALUE
+rf_mount_unmount(VALUE self) {
+  struct rf_mount *m = rf_mount_get(self);
+
+  if (m->fm) {
+    fusefs_unmount(m->fm);
+    m->fm = NULL;
+  }
+  rf_mounts_prune();
+  return Qnil;
+}
+
+static VALUE
+rf_mount_mounted_p(VALUE self) {
+  struct rf_mount *m = rf_mount_get(self);
+  return m->fm && fusefs_mounted(m->fm) ? Qtrue : Qfalse;
+}
+
+static VALUE
+rf_mount_root(VALUE self) {
+  return rf_mount_get(self)->rootval;
+}
+
+static VALUE
+rf_mount_mountpoint(VALUE self) {
+  return rf_mount_get(self)->mountpoint;
+}
+
+/* rf_mount_fd
+ *
+ * Used by: RbFuse::Mount#fuse_fd
+ *
+ * The /dev/fuse descriptor of this mount alone, or nil once unmounted.
+ */
+static VALUE
+rf_mount_fd(VALUE self) {
+  struct rf_mount *m = rf_mount_get(self);
+  int fd = m->fm ? fusefs_mount_fd(m->fm) : -1;
+  if (fd < 0)
+    return Qnil;
+  return INT2NUM(fd);
+}
+
+/* rf_mounts
+ *
+ * Used by: RbFuse.mounts
+ *
+ * Every filesystem mounted by this process, with mount_to or Mount.new,
+ * that has not been torn down yet.
+ */
+static VALUE
+rf_mounts(VALUE self) {
+  rf_mounts_prune();
+  return rb_ary_dup(live_mounts);
+}
+
+/* rf_fd
+ *
+ * Used by: FuseFS.fuse_fd(dir)
+ *
+ * FuseFS.fuse_fd returns the file descriptor of the open handle on the
+ *   /dev/fuse object that is utilized by FUSE. This is crucial for letting
+ *   ruby keep control of the script, as it can now use IO.select, rather
+ *   than turning control over to fuse_main.
+ *
+ * One descriptor covers every mount only where there is epoll; elsewhere
+ * this raises once a second filesystem is mounted, so that a loop
+ * selecting on it does not silently leave that mount unserved.
+ */
+VALUE
+rf_fd(VALUE self) {
+  int fd = fusefs_fd();
+  if (fd == -2)
+    rb_raise(cFSException, "several mounts need epoll to be watched "
+             "through one descriptor; use RbFuse.run without :scheduler");
+  if (fd < 0)
+    return Qnil;
+  return INT2NUM(fd);
+}
+
+/* rf_process
+ *
+ * Used for: FuseFS.process
+ *
+ * rf_process, which calls fusefs_process, is the other crucial portion to
+ *   keeping ruby in control of the script. fusefs_process will read and
+ *   process exactly one command from the fuse_fd. If this is called when
+ *   there is no incoming data waiting, it *will* hang until it receives a
+ *   command on the fuse_fd
+ */
+VALUE
+rf_process(VALUE self) {
+  fusefs_process();
+  return Qnil;
+}
+
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+/* rf_worker_run
+ *
+ * Body of a worker outside the GVL: wait for commands and process all
+ * that are ready. A pool worker keeps going until it is woken up, the
+ * filesystem is unmounted, or a callback raised; the main loop returns to
+ * Ruby after each batch so that RbFuse.exit and signal handlers are seen.
+ */
+static void *
+rf_worker_run(void *data) {
+  struct rf_worker *w = data;
+
+  rf_current_worker = w;
+  rf_without_gvl = 1;
+  while (!w->stop && (w->main_loop || rf_running)) {
+    int res = fusefs_wait(w->wake[0]);
+    if (res < 0) {
+      w->exited = 1;
+      break;
+    }
+    if (res == 0)
+      break;
+    if (fusefs_drain(&w->stop) < 0) {
+      w->exited = 1;
+      break;
+    }
+    if (w->main_loop)
+      break;
+  }
+  rf_without_gvl = 0;
+  rf_current_worker = NULL;
+  return NULL;
+}
+
+static void
+rf_worker_ubf(void *data) {
+  struct rf_worker *w = data;
+  ssize_t r;
+  w->stop = 1;
+  r = write(w->wake[1], "", 1);
+  (void)r;
+}
+
+static int
+rf_worker_keep_going(struct rf_worker *w) {
+  if (w->exited)
+    return 0;
+  if (w->main_loop)
+    return RTEST(rb_iv_get(cRbFuse,"@running"));
+  return rf_running;
+}
+
+static VALUE
+rf_worker_body(VALUE data) {
+  struct rf_worker *w = (struct rf_worker *)data;
+  char buf[64];
+
+  while (rf_worker_keep_going(w)) {
+    w->stop = 0;
+    rb_thread_call_without_gvl(rf_worker_run, w, rf_worker_ubf, w);
+    while (read(w->wake[0], buf, sizeof(buf)) > 0)
+      ;
+    rf_mounts_prune();
+    if (w->state) {
+      int state = w->state;
+      VALUE error = w->error;
+      w->state = 0;
+      w->error = Qnil;
+      if (rb_obj_is_kind_of(error, rb_eException))
+        rb_exc_raise(error);
+      rb_jump_tag(state);
+    }
+    rb_thread_check_ints();
+  }
+  if (w->exited)
+    rf_running = 0;
+  return Qnil;
+}
+
+static VALUE
+rf_worker_cleanup(VALUE data) {
+  struct rf_worker *w = (struct rf_worker *)data;
+  struct rf_worker **p;
+
+  for (p = &rf_workers; *p; p = &(*p)->next) {
+    if (*p == w) {
+      *p = w->next;
+      break;
+    }
+  }
+  close(w->wake[0]);
+  close(w->wake[1]);
+  return Qnil;
+}
+
+static VALUE
+rf_worker_start(int main_loop) {
+  struct rf_worker w;
+
+  memset(&w, 0, sizeof(w));
+  w.error = Qnil;
+  w.main_loop = main_loop;
+  if (pipe(w.wake) != 0)
+    rb_sys_fail("pipe");
+  fcntl(w.wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(w.wake[1], F_SETFL, O_NONBLOCK);
+  w.next = rf_workers;
+  rf_workers = &w;
+
+  rb_ensure(rf_worker_body, (VALUE)&w, rf_worker_cleanup, (VALUE)&w);
+  return Qnil;
+}
+
+/* rf_worker_loop
+ *
+ * Used by: RbFuse.worker_loop, from each thread started by
+ *   RbFuse.run(:threads => n)
+ *
+ * Processes commands until RbFuse.stop_workers is called or the filesystem
+ * is unmounted. Waiting on the fuse fd and reading commands happens
+ * without the GVL; it is only taken to run the Ruby callbacks, so callbacks
+ * blocked on I/O in one thread don't hold up requests handled by others.
+ */
+static VALUE
+rf_worker_loop(VALUE self) {
+  return rf_worker_start(0);
+}
+
+/* rf_main_loop
+ *
+ * Used by: RbFuse.run
+ *
+ * The single-threaded run loop. Sleeps in poll() without the GVL, so other
+ * Ruby threads, timers and trap handlers keep running, then processes every
+ * command that is ready before checking @running again. RbFuse.exit (or
+ * any interrupt) wakes it up.
+ */
+static VALUE
+rf_main_loop(VALUE self) {
+  return rf_worker_start(1);
+}
+#else
+#define rf_worker_loop rb_f_notimplement
+#define rf_main_loop   rb_f_notimplement
+#endif
+
+/* rf_stop_workers
+ *
+ * Used by: RbFuse.exit
+ *
+ * Makes every thread in RbFuse.worker_loop return once it finishes the
+ * command it is processing.
+ */
+static VALUE
+rf_stop_workers(VALUE self) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  struct rf_worker *w;
+  rf_running = 0;
+  for (w = rf_workers; w; w = w->next)
+    rf_worker_ubf(w);
+#endif
+  return Qnil;
+}
+
+/* rf_uid and rf_gid
+ *
+ * Used by: FuseFS.reader_uid and FuseFS.reader_gid
+ *
+ * These return the UID and GID of the processes that are causing the
+ *   separate Fuse methods to be called. This can be used for permissions
+ *   checking, returning a different file for different users, etc.
+ */
+VALUE
+rf_uid(VALUE self) {
+  int fd = fusefs_uid();
+  if (fd < 0)
+    return Qnil;
+  return INT2NUM(fd);
+}
+
+VALUE
+rf_gid(VALUE self) {
+  int fd = fusefs_gid();
+  if (fd < 0)
+    return Qnil;
+  return INT2NUM(fd);
+}
+
+static VALUE
+rf_debugmode(VALUE self){
+  if(debugMode){
+    return Qtrue;
+  }else{
+    return Qfalse;
+  }
+}
+
+static VALUE
+rf_debugmode_set(VALUE self,VALUE val){
+  debugMode=RTEST(val);
+  return val;
+}
+
+/* rf_attr_cache_set
+ *
+ * Used by: RbFuse.attr_cache = {:ttl => 1.0, :max_entries => 10000}
+ *
+ * Configures the attribute cache in front of getattr. :ttl defaults to
+ * 1.0, the attr timeout of the lowlevel engine; :negative_ttl sets how
+ * long a nil result from getattr is remembered and defaults to :ttl.
+ * nil or false turns the cache off. Cached entries are dropped. Every
+ * mount has a cache of its own, of this size.
+ */
+static VALUE
+rf_attr_cache_set(VALUE self,VALUE conf){
+  struct rf_mount *m;
+  double ttl=0,negative_ttl;
+  long max_entries=0;
+
+  if(RTEST(conf)){
+    VALUE v;
+    Check_Type(conf,T_HASH);
+    v=rb_hash_aref(conf,ID2SYM(rb_intern("ttl")));
+    ttl=NIL_P(v) ? 1.0 : NUM2DBL(v);
+    if(ttl<0) rb_raise(rb_eArgError,"ttl must not be negative");
+    v=rb_hash_aref(conf,ID2SYM(rb_intern("max_entries")));
+    max_entries=NIL_P(v) ? 4096 : NUM2LONG(v);
+    if(max_entries<0) rb_raise(rb_eArgError,"max_entries must not be negative");
+    v=rb_hash_aref(conf,ID2SYM(rb_intern("negative_ttl")));
+    negative_ttl=NIL_P(v) ? ttl : NUM2DBL(v);
+  }else{
+    negative_ttl=0;
+  }
+  attr_cache_ttl=ttl;
+  attr_cache_negative_ttl=negative_ttl;
+  attr_cache_max_entries=(size_t)max_entries;
+  for(m=all_mounts;m;m=m->next)
+    rf_mount_caches(m);
+  return conf;
+}
+
+/* rf_attr_cache_get
+ *
+ * Used by: RbFuse.attr_cache
+ *
+ * Returns the attribute cache settings, which every mount shares, along
+ * with its hit/miss counters summed over all mounts.
+ */
+static VALUE
+rf_attr_cache_get(VALUE self){
+  VALUE h=rb_hash_new();
+  struct rf_mount *m;
+  size_t count=0;
+  unsigned long hits=0,misses=0,evictions=0;
+  rb_hash_aset(h,ID2SYM(rb_intern("ttl")),rb_float_new(attr_cache_ttl));
+  rb_hash_aset(h,ID2SYM(rb_intern("negative_ttl")),rb_float_new(attr_cache_negative_ttl));
+  rb_hash_aset(h,ID2SYM(rb_intern("max_entries")),SIZET2NUM(attr_cache_max_entries));
+  for(m=all_mounts;m;m=m->next){
+    count+=m->attr_cache.count;
+    hits+=m->attr_cache.hits;
+    misses+=m->attr_cache.misses;
+    evictions+=m->attr_cache.evictions;
+  }
+  rb_hash_aset(h,ID2SYM(rb_intern("entries")),ULONG2NUM(count));
+  rb_hash_aset(h,ID2SYM(rb_intern("hits")),ULONG2NUM(hits));
+  rb_hash_aset(h,ID2SYM(rb_intern("misses")),ULONG2NUM(misses));
+  rb_hash_aset(h,ID2SYM(rb_intern("evictions")),ULONG2NUM(evictions));
+  return h;
+}
+
+/* rf_read_cache_set
+ *
+ * Used by: RbFuse.read_cache = {:block_size => 65536, :max_bytes => 64<<20}
+ *
+ * Configures the block cache in front of read. nil or false turns the
+ * cache off. Cached blocks are dropped. Every mount has a cache of its
+ * own, of this size.
+ */
+static VALUE
+rf_read_cache_set(VALUE self,VALUE conf){
+  struct rf_mount *m;
+  size_t block_size=0,max_bytes=0;
+
+  if(RTEST(conf)){
+    VALUE v;
+    Check_Type(conf,T_HASH);
+    v=rb_hash_aref(conf,ID2SYM(rb_intern("block_size")));
+    block_size=NIL_P(v) ? 65536 : NUM2SIZET(v);
+    v=rb_hash_aref(conf,ID2SYM(rb_intern("max_bytes")));
+    max_bytes=NIL_P(v) ? 64*1024*1024 : NUM2SIZET(v);
+    if(block_size==0 || block_size>INT_MAX)
+      rb_raise(rb_eArgError,"block_size out of range");
+  }
+  read_cache_block_size=block_size;
+  read_cache_max_bytes=max_bytes;
+  for(m=all_mounts;m;m=m->next)
+    rf_mount_caches(m);
+  return conf;
+}
+
+/* rf_read_cache_get
+ *
+ * Used by: RbFuse.read_cache
+ *
+ * Returns the read cache settings, which every mount shares, along with
+ * its hit/miss counters summed over all mounts.
+ */
+static VALUE
+rf_read_cache_get(VALUE self){
+  VALUE h=rb_hash_new();
+  struct rf_mount *m;
+  size_t blocks=0;
+  unsigned long hits=0,misses=0,evictions=0;
+  size_t bs=read_cache_block_size;
+  /* what is used of max_bytes: whole blocks, none if not even one fits */
+  size_t nblocks=bs ? read_cache_max_bytes/bs : 0;
+  rb_hash_aset(h,ID2SYM(rb_intern("block_size")),SIZET2NUM(nblocks ? bs : 0));
+  rb_hash_aset(h,ID2SYM(rb_intern("max_bytes")),SIZET2NUM(nblocks*bs));
+  for(m=all_mounts;m;m=m->next){
+    blocks+=m->read_cache.used;
+    hits+=m->read_cache.hits;
+    misses+=m->read_cache.misses;
+    evictions+=m->read_cache.evictions;
+  }
+  rb_hash_aset(h,ID2SYM(rb_intern("blocks")),SIZET2NUM(blocks));
+  rb_hash_aset(h,ID2SYM(rb_intern("hits")),ULONG2NUM(hits));
+  rb_hash_aset(h,ID2SYM(rb_intern("misses")),ULONG2NUM(misses));
+  rb_hash_aset(h,ID2SYM(rb_intern("evictions")),ULONG2NUM(evictions));
+  return h;
+}
+
+/* rf_self_mount
+ *
+ * The mount a cache or notification method is about: the RbFuse::Mount
+ * it is called on or, called on RbFuse, the mount of the command being
+ * processed, else the one of mount_to.
+ */
+static struct rf_mount *
+rf_self_mount(VALUE self) {
+  if (rb_typeddata_is_kind_of(self, &mount_type))
+    return rf_mount_get(self);
+  return rf_cur();
+}
+
+/* rf_invalidate_read
+ *
+ * Used by: RbFuse.invalidate_read(path), RbFuse::Mount#invalidate_read
+ *
+ * Drops the cached contents of path (and of anything below it).
+ */
+static VALUE
+rf_invalidate_read(VALUE self,VALUE path){
+  rf_readcache_invalidate_tree(&rf_self_mount(self)->read_cache,
+                               StringValueCStr(path));
+  return Qnil;
+}
+
+/* rf_invalidate_attr
+ *
+ * Used by: RbFuse.invalidate_attr(path), RbFuse::Mount#invalidate_attr
+ *
+ * Drops the cached attributes of path (and anything below it), for
+ * filesystems whose backend can change without going through rbfuse.
+ */
+static VALUE
+rf_invalidate_attr(VALUE self,VALUE path){
+  rf_attrcache_invalidate_tree(&rf_self_mount(self)->attr_cache,
+                               StringValueCStr(path));
+  return Qnil;
+}
+
+/* Kernel notifications
+ *
+ * RbFuse.invalidate_entry, invalidate_inode and store (and the same
+ * methods of RbFuse::Mount), for lowlevel mounts whose backend changes
+ * behind the kernel's back. The target is a path, or with the inode API
+ * an inode number. The notification is written to the FUSE channel
+ * without the GVL, so worker threads keep processing the requests the
+ * kernel may be waiting on; the mount is held meanwhile.
+ */
+struct rf_notify {
+  enum { RF_NOTIFY_INODE, RF_NOTIFY_ENTRY, RF_NOTIFY_STORE } kind;
+  struct fusefs_mount *fm;
+  fuse_ino_t ino;
+  off_t offset;
+  off_t len;
+  const char *data;  /* name for RF_NOTIFY_ENTRY */
+  int res;
+};
+
+static void *
+rf_notify_run(void *data) {
+  struct rf_notify *n = data;
+
+  switch (n->kind) {
+  case RF_NOTIFY_INODE:
+    n->res = rf_ll_notify_inval_inode(n->fm, n->ino, n->offset, n->len);
+    break;
+  case RF_NOTIFY_ENTRY:
+    n->res = rf_ll_notify_inval_entry(n->fm, n->ino, n->data);
+    break;
+  case RF_NOTIFY_STORE:
+    n->res = rf_ll_notify_store(n->fm, n->ino, n->offset, n->data,
+                                n->len);
+    break;
+  }
+  return NULL;
+}
+
+/* rf_notify
+ *
+ * Resolves target into n->ino and sends n on the lowlevel mount m.
+ * Returns true once the kernel was told, false if it had nothing cached
+ * for target.
+ */
+static VALUE
+rf_notify(struct rf_mount *m, VALUE target, struct rf_notify *n) {
+  int res;
+
+  if (m->fm == NULL || fusefs_ll_chan(m->fm) == NULL)
+    rb_raise(cFSException, "kernel notifications need a :lowlevel mount");
+  n->fm = m->fm;
+  if (FIXNUM_P(target) || TYPE(target) == T_BIGNUM) {
+    n->ino = NUM2ULONG(target);
+    res = 0;
+  } else {
+    res = rf_ll_path_ino(n->fm, StringValueCStr(target), &n->ino);
+  }
+  if (res == 0) {
+    fusefs_hold(n->fm);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(rf_notify_run, n, RUBY_UBF_IO, NULL);
+#else
+    rf_notify_run(n);
+#endif
+    fusefs_put(n->fm);
+    res = n->res;
+  }
+  if (res == -ENOENT)
+    return Qfalse;
+  if (res == -EINVAL && TYPE(target) == T_STRING)
+    rb_raise(rb_eArgError, "the inode API takes inode numbers");
+  if (res < 0) {
+    errno = -res;
+    rb_sys_fail("notify");
+  }
+  return Qtrue;
+}
+
+/* rf_invalidate_entry
+ *
+ * Used by: RbFuse.invalidate_entry(parent, name)
+ *
+ * Makes the kernel forget the name in the directory parent, so the next
+ * use of it is looked up again.
+ */
+static VALUE
+rf_invalidate_entry(VALUE self, VALUE parent, VALUE name) {
+  struct rf_mount *m = rf_self_mount(self);
+  struct rf_notify n;
+  VALUE ret;
+
+  memset(&n, 0, sizeof(n));
+  n.kind = RF_NOTIFY_ENTRY;
+  n.data = StringValueCStr(name);
+  if (TYPE(parent) == T_STRING) {
+    VALUE child = rb_str_dup(parent);
+    long len = RSTRING_LEN(child);
+    if (len == 0 || RSTRING_PTR(child)[len - 1] != '/')
+      rb_str_cat2(child, "/");
+    rb_str_append(child, name);
+    rf_attrcache_invalidate(&m->attr_cache, StringValueCStr(child));
+  }
+  ret = rf_notify(m, parent, &n);
+  RB_GC_GUARD(name);
+  return ret;
+}
+
+/* rf_invalidate_inode
+ *
+ * Used by: RbFuse.invalidate_inode(path, offset = 0, len = 0)
+ *
+ * Makes the kernel drop the attributes of path and len bytes (0: all) of
+ * its cached data from offset; with a negative offset only the attributes.
+ * The attribute and read caches of rbfuse are dropped too.
+ */
+static VALUE
+rf_invalidate_inode(int argc, VALUE *argv, VALUE self) {
+  struct rf_mount *m = rf_self_mount(self);
+  struct rf_notify n;
+  VALUE target, offset, len;
+
+  rb_scan_args(argc, argv, "12", &target, &offset, &len);
+  memset(&n, 0, sizeof(n));
+  n.kind = RF_NOTIFY_INODE;
+  n.offset = NIL_P(offset) ? 0 : NUM2OFFT(offset);
+  n.len = NIL_P(len) ? 0 : NUM2OFFT(len);
+  if (TYPE(target) == T_STRING) {
+    rf_attrcache_invalidate(&m->attr_cache, StringValueCStr(target));
+    if (n.offset >= 0)
+      rf_readcache_invalidate(&m->read_cache, StringValueCStr(target));
+  }
+  return rf_notify(m, target, &n);
+}
+
+/* rf_store
+ *
+ * Used by: RbFuse.store(path, offset, data)
+ *
+ * Puts data into the kernel's page cache of path at offset, growing the
+ * file if it ends beyond it, so readers see it without calling read.
+ */
+static VALUE
+rf_store(VALUE self, VALUE target, VALUE offset, VALUE data) {
+  struct rf_mount *m = rf_self_mount(self);
+  struct rf_notify n;
+  VALUE ret;
+
+  StringValue(data);
+  memset(&n, 0, sizeof(n));
+  n.kind = RF_NOTIFY_STORE;
+  n.offset = NUM2OFFT(offset);
+  n.data = RSTRING_PTR(data);
+  n.len = RSTRING_LEN(data);
+  if (TYPE(target) == T_STRING) {
+    rf_attrcache_invalidate(&m->attr_cache, StringValueCStr(target));
+    rf_readcache_invalidate(&m->read_cache, StringValueCStr(target));
+  }
+  ret = rf_notify(m, target, &n);
+  RB_GC_GUARD(data);
+  return ret;
 }
 
-static int
-rf_statfs(const char *path, struct statvfs *buf)
-{
-  buf->f_frsize=1024;
-  buf->f_namemax=255;
-  buf->f_bsize=1024;
-  buf->f_blocks=1024*1024;
-  buf->f_bavail=1024*1024;
-  buf->f_bfree=1024*1024;
-  return 0;
+/* rf_open_handles
+ *
+ * Used by: RbFuse.open_handles
+ *
+ * The number of files currently open, for spotting handles that are never
+ * released.
+ */
+static VALUE
+rf_open_handles(VALUE self){
+  return SIZET2NUM(rf_handle_count());
 }
 
-/* rf_oper
+/* rf_path_cache_set
  *
- * Used for: FUSE utilizes this to call operations at the appropriate time.
+ * Used by: RbFuse.path_cache = n
  *
- * This is utilized by rf_mount
+ * How many distinct paths are kept as shared frozen Strings (1024 by
+ * default). 0 hands out a new String per call again.
  */
-static struct fuse_operations rf_oper = {
-    .getattr   = rf_getattr2,
-    .readdir   = rf_readdir,
-    .mknod     = rf_mknod,
-    .unlink    = rf_unlink,
-    .mkdir     = rf_mkdir,
-    .rmdir     = rf_rmdir,
-    .truncate  = rf_truncate,
-    .rename    = rf_rename,
-    .open      = rf_open,
-    .release   = rf_release,
-    .utime     = rf_touch,
-    .read      = rf_read,
-    .write     = rf_write,
-    .fsyncdir  = rf_fsyncdir,
-    .utime     = rf_utime,
-    .statfs    = rf_statfs,
-};
+static VALUE
+rf_path_cache_set(VALUE self,VALUE n){
+  rf_paths_configure(NIL_P(n) ? 0 : NUM2SIZET(n));
+  return n;
+}
 
-/* rf_set_root
+/* rf_write_buffer_set
  *
- * Used by: FuseFS.set_root
+ * Used by: RbFuse.write_buffer = bytes
  *
- * This defines FuseRoot, which is the crux of FuseFS. It is required to
- *   have the methods "directory?" "file?" "contents" "writable?" "read_file"
- *   and "write_to"
+ * Gives files opened for writing from now on a write-back buffer of that
+ * size; nil or 0 turns buffering off.
  */
-VALUE
-rf_set_root(VALUE self, VALUE rootval) {
-  if (self != cRbFuse) {
-    rb_raise(cFSException,"Error: 'set_root' called outside of FuseFS?!");
-    return Qnil;
-  }
+static VALUE
+rf_write_buffer_set(VALUE self,VALUE n){
+  write_buffer_size = NIL_P(n) ? 0 : NUM2SIZET(n);
+  return n;
+}
 
-  rb_iv_set(cRbFuse,"@root",rootval);
-  FuseRoot = rootval;
-  return Qtrue;
+static VALUE
+rf_write_buffer_get(VALUE self){
+  return SIZET2NUM(write_buffer_size);
 }
 
+/* rf_strict_set
+ *
+ * Used by: RbFuse.strict = true/false
+ *
+ * Switches to the strict protocol, see rf_strict_err.
+ */
+static VALUE
+rf_strict_set(VALUE self,VALUE val){
+  strict_mode = RTEST(val);
+  return val;
+}
 
+static VALUE
+rf_strict_get(VALUE self){
+  return strict_mode ? Qtrue : Qfalse;
+}
 
-/* rf_mount_to
+/* rf_dispatch_stats
  *
- * Used by: FuseFS.mount_to(dir)
+ * Used by: RbFuse.dispatch_stats
  *
- * FuseFS.mount_to(dir) calls FUSE to mount FuseFS under the given directory.
+ * Returns {op => {:calls => n, :allocations => n}} for each FUSE operation
+ * that reached Ruby. Allocations are only counted while
+ * RbFuse.dispatch_stats = true.
  */
-VALUE
-rf_mount_to(int argc, VALUE *argv, VALUE self) {
-  struct fuse_args *opts;
-  VALUE mountpoint;
+static VALUE
+rf_dispatch_stats(VALUE self) {
+  VALUE h = rb_hash_new();
+  VALUE sym_calls = ID2SYM(rb_intern("calls"));
+  VALUE sym_allocs = ID2SYM(rb_intern("allocations"));
   int i;
-  char *cur;
 
-  if (self != cRbFuse) {
-    rb_raise(cFSException,"Error: 'mount_to' called outside of FuseFS?!");
-    return Qnil;
+  for (i = 0; i < RF_OP_MAX; i++) {
+    VALUE op = rb_hash_new();
+    rb_hash_aset(op, sym_calls, ULONG2NUM(dispatch_calls[i]));
+    rb_hash_aset(op, sym_allocs, ULONG2NUM(dispatch_allocs[i]));
+    rb_hash_aset(h, ID2SYM(rb_intern(rf_op_names[i])), op);
   }
+  return h;
+}
 
-  if (argc == 0) {
-    rb_raise(rb_eArgError,"mount_to requires at least 1 argument!");
-    return Qnil;
-  }
+/* rf_dispatch_stats_set
+ *
+ * Used by: RbFuse.dispatch_stats = true/false
+ *
+ * Resets the counters and turns allocation counting on or off.
+ */
+static VALUE
+rf_dispatch_stats_set(VALUE self, VALUE val) {
+#ifdef HAVE_RB_GC_STAT
+  dispatch_stats_enabled = RTEST(val);
+#else
+  if (RTEST(val))
+    rb_raise(rb_eNotImpError, "allocation counting needs rb_gc_stat");
+#endif
+  memset(dispatch_calls, 0, sizeof(dispatch_calls));
+  memset(dispatch_allocs, 0, sizeof(dispatch_allocs));
+  return val;
+}
 
-  mountpoint = argv[0];
+/* rf_hist_hash
+ *
+ * A latency histogram as {:count, :total, :max, :p50, :p90, :p99,
+ * :buckets => {upper bound => count}}, times in seconds.
+ */
+static VALUE
+rf_hist_hash(const struct rf_hist *h) {
+  VALUE r = rb_hash_new();
+  VALUE b = rb_hash_new();
+  int i;
 
-  Check_Type(mountpoint, T_STRING);
-  opts = ALLOC(struct fuse_args);
-  opts->argc = argc;
-  opts->argv = ALLOC_N(char *, opts->argc);
-  opts->allocated = 1;
-  
-  opts->argv[0] = strdup("-odirect_io");
+  rb_hash_aset(r, ID2SYM(rb_intern("count")), ULONG2NUM(h->count));
+  rb_hash_aset(r, ID2SYM(rb_intern("total")), rb_float_new(h->sum_ns / 1e9));
+  rb_hash_aset(r, ID2SYM(rb_intern("max")), rb_float_new(h->max_ns / 1e9));
+  rb_hash_aset(r, ID2SYM(rb_intern("p50")),
+               rb_float_new(rf_hist_percentile(h, 0.50) / 1e9));
+  rb_hash_aset(r, ID2SYM(rb_intern("p90")),
+               rb_float_new(rf_hist_percentile(h, 0.90) / 1e9));
+  rb_hash_aset(r, ID2SYM(rb_intern("p99")),
+               rb_float_new(rf_hist_percentile(h, 0.99) / 1e9));
+  for (i = 0; i < RF_HIST_BUCKETS; i++) {
+    if (h->buckets[i] == 0)
+      continue;
+    rb_hash_aset(b, i == RF_HIST_BUCKETS - 1 ? rb_float_new(HUGE_VAL) :
+                 rb_float_new((rf_hist_bucket_limit(i) + 1) / 1e9),
+                 ULONG2NUM(h->buckets[i]));
+  }
+  rb_hash_aset(r, ID2SYM(rb_intern("buckets")), b);
+  return r;
+}
 
-  for (i = 1; i < argc; i++) {
-    cur = StringValuePtr(argv[i]);
-    opts->argv[i] = ALLOC_N(char, RSTRING_LEN(argv[i]) + 2);
-    sprintf(opts->argv[i], "-o%s", cur);
+/* rf_stats
+ *
+ * Used by: RbFuse.stats
+ *
+ * Returns {:requests => histogram, :errors => {errno => n},
+ * :ops => {op => {:calls, :errors, :bytes, :ruby, :wait, :fuse}}} where
+ * :ruby is the time spent in the callback, :wait the time spent getting
+ * the GVL and :fuse the rest of the request.
+ */
+static VALUE
+rf_stats(VALUE self) {
+  VALUE h = rb_hash_new();
+  VALUE ops = rb_hash_new();
+  VALUE errs = rb_hash_new();
+  int i;
+
+  for (i = 0; i < RF_OP_MAX; i++) {
+    const struct rf_opstat *s = &rf_opstats[i];
+    VALUE op = rb_hash_new();
+    rb_hash_aset(op, ID2SYM(rb_intern("calls")), ULONG2NUM(s->calls));
+    rb_hash_aset(op, ID2SYM(rb_intern("errors")), ULONG2NUM(s->errors));
+    rb_hash_aset(op, ID2SYM(rb_intern("bytes")), ULL2NUM(s->bytes));
+    rb_hash_aset(op, ID2SYM(rb_intern("ruby")), rf_hist_hash(&s->ruby));
+    rb_hash_aset(op, ID2SYM(rb_intern("wait")), rf_hist_hash(&s->wait));
+    rb_hash_aset(op, ID2SYM(rb_intern("fuse")), rf_hist_hash(&s->fuse));
+    rb_hash_aset(ops, ID2SYM(rb_intern(rf_op_names[i])), op);
+  }
+  for (i = 1; i < RF_STATS_ERRNOS; i++) {
+    if (rf_errno_counts[i])
+      rb_hash_aset(errs, INT2FIX(i), ULONG2NUM(rf_errno_counts[i]));
   }
+  rb_hash_aset(h, ID2SYM(rb_intern("requests")), rf_hist_hash(&rf_request_hist));
+  rb_hash_aset(h, ID2SYM(rb_intern("errors")), errs);
+  rb_hash_aset(h, ID2SYM(rb_intern("ops")), ops);
+  return h;
+}
 
-  rb_iv_set(cRbFuse,"@mountpoint",mountpoint);
-  fusefs_setup(StringValueCStr(mountpoint), &rf_oper, opts);
-  return Qtrue;
+/* rf_stats_set
+ *
+ * Used by: RbFuse.stats = true/false
+ *
+ * Resets the metrics and turns the timing on (the default) or off. The
+ * counters are kept either way.
+ */
+static VALUE
+rf_stats_set(VALUE self, VALUE val) {
+  rf_stats_enabled = RTEST(val);
+  rf_stats_reset();
+  return val;
 }
 
-/* rf_fd
+static VALUE
+rf_reset_stats(VALUE self) {
+  rf_stats_reset();
+  return Qnil;
+}
+
+/* rf_trace_set
  *
- * Used by: FuseFS.fuse_fd(dir)
+ * Used by: RbFuse.trace = records
  *
- * FuseFS.fuse_fd returns the file descriptor of the open handle on the
- *   /dev/fuse object that is utilized by FUSE. This is crucial for letting
- *   ruby keep control of the script, as it can now use IO.select, rather
- *   than turning control over to fuse_main.
+ * Starts recording every request into a ring of (at least) that many
+ * entries, replacing what was recorded before. nil or false stops.
  */
-VALUE
-rf_fd(VALUE self) {
-  int fd = fusefs_fd();
-  if (fd < 0)
-    return Qnil;
-  return INT2NUM(fd);
+static VALUE
+rf_trace_set(VALUE self, VALUE n) {
+  if (!RTEST(n)) {
+    rf_trace_stop();
+    return n;
+  }
+  if (rf_trace_start(NUM2SIZET(n)) != 0)
+    rb_memerror();
+  return n;
 }
 
-/* rf_process
+static VALUE
+rf_trace_get(VALUE self) {
+  return rf_trace_on ? SIZET2NUM(rf_trace_capacity()) : Qnil;
+}
+
+/* rf_trace_dump
  *
- * Used for: FuseFS.process
+ * Used by: RbFuse.trace_dump(filename)
  *
- * rf_process, which calls fusefs_process, is the other crucial portion to
- *   keeping ruby in control of the script. fusefs_process will read and
- *   process exactly one command from the fuse_fd. If this is called when
- *   there is no incoming data waiting, it *will* hang until it receives a
- *   command on the fuse_fd
+ * Writes the recorded requests to filename and returns how many. The file
+ * is: "RBFTRACE", version (u32), record size (u32), record count (u64),
+ * CLOCK_REALTIME - CLOCK_MONOTONIC in ns (i64), number of operation names
+ * (u32) and the names, each NUL terminated, then the struct rf_trace_rec
+ * records, all in host byte order. bin/rbfuse-trace2json turns it into a
+ * Chrome trace.
  */
-VALUE
-rf_process(VALUE self) {
-  fusefs_process();
-  return Qnil;
+static VALUE
+rf_trace_dump(VALUE self, VALUE filename) {
+  size_t cap = rf_trace_capacity();
+  struct rf_trace_rec *recs;
+  struct timespec rt, mt;
+  uint32_t u32;
+  uint64_t count;
+  int64_t offset;
+  FILE *f;
+  int i, ok;
+
+  f = fopen(StringValueCStr(filename), "wb");
+  if (f == NULL)
+    rb_sys_fail(StringValueCStr(filename));
+  recs = malloc(cap ? cap * sizeof(*recs) : 1);
+  if (recs == NULL) {
+    fclose(f);
+    rb_memerror();
+  }
+  count = rf_trace_snapshot(recs, cap);
+
+  clock_gettime(CLOCK_REALTIME, &rt);
+  clock_gettime(CLOCK_MONOTONIC, &mt);
+  offset = ((int64_t)rt.tv_sec - mt.tv_sec) * 1000000000LL +
+           (rt.tv_nsec - mt.tv_nsec);
+
+  ok = fwrite("RBFTRACE", 8, 1, f) == 1;
+  u32 = 1;
+  ok = ok && fwrite(&u32, sizeof(u32), 1, f) == 1;
+  u32 = sizeof(struct rf_trace_rec);
+  ok = ok && fwrite(&u32, sizeof(u32), 1, f) == 1;
+  ok = ok && fwrite(&count, sizeof(count), 1, f) == 1;
+  ok = ok && fwrite(&offset, sizeof(offset), 1, f) == 1;
+  u32 = RF_OP_MAX;
+  ok = ok && fwrite(&u32, sizeof(u32), 1, f) == 1;
+  for (i = 0; i < RF_OP_MAX; i++)
+    ok = ok && fwrite(rf_op_names[i], strlen(rf_op_names[i]) + 1, 1, f) == 1;
+  if (count > 0)
+    ok = ok && fwrite(recs, sizeof(*recs), count, f) == count;
+  free(recs);
+  if (fclose(f) != 0 || !ok)
+    rb_sys_fail(StringValueCStr(filename));
+  return ULL2NUM(count);
 }
 
 
-/* rf_uid and rf_gid
+/* Deferred replies
  *
- * Used by: FuseFS.reader_uid and FuseFS.reader_gid
+ * On the lowlevel engine read, write and getattr may call RbFuse.defer and
+ * answer the request later, from any thread, with RbFuse.reply or
+ * RbFuse.reply_error. What the callback returns is then ignored. The token
+ * is a RbFuse::Pending. Every error path of the binding answers the token
+ * it took before returning; a token the Ruby code drops without a reply
+ * is answered EIO when it is collected, as a last resort, so the process
+ * waiting on it is not stuck forever.
+ */
+struct rf_pending {
+  struct rf_ll_deferred d;
+  int replied;
+};
+
+static void
+rf_pending_free(void *p) {
+  struct rf_pending *pd = p;
+  if (!pd->replied)
+    rf_ll_reply_error(&pd->d, EIO);
+  xfree(pd);
+}
+
+static size_t
+rf_pending_memsize(const void *p) {
+  return sizeof(struct rf_pending);
+}
+
+static const rb_data_type_t pending_type = {
+  .wrap_struct_name = "RbFuse::Pending",
+  .function = {
+    .dfree = rf_pending_free,
+    .dsize = rf_pending_memsize,
+  },
+};
+
+static struct rf_pending *
+rf_pending_peek(VALUE token) {
+  struct rf_pending *pd;
+
+  TypedData_Get_Struct(token, struct rf_pending, &pending_type, pd);
+  if (pd->replied)
+    rb_raise(cFSException, "request already answered");
+  return pd;
+}
+
+static struct rf_pending *
+rf_pending_get(VALUE token) {
+  struct rf_pending *pd = rf_pending_peek(token);
+  pd->replied = 1;
+  return pd;
+}
+
+/* rf_pending_abort
  *
- * These return the UID and GID of the processes that are causing the
- *   separate Fuse methods to be called. This can be used for permissions
- *   checking, returning a different file for different users, etc.
+ * Fails the request of token with e unless it has been answered already.
  */
-VALUE
-rf_uid(VALUE self) {
-  int fd = fusefs_uid();
-  if (fd < 0)
-    return Qnil;
-  return INT2NUM(fd);
+static void
+rf_pending_abort(VALUE token, int e) {
+  struct rf_pending *pd;
+
+  TypedData_Get_Struct(token, struct rf_pending, &pending_type, pd);
+  if (pd->replied)
+    return;
+  pd->replied = 1;
+  rf_ll_reply_error(&pd->d, e);
 }
 
-VALUE
-rf_gid(VALUE self) {
-  int fd = fusefs_gid();
-  if (fd < 0)
-    return Qnil;
-  return INT2NUM(fd);
+/* rf_defer
+ *
+ * Used by: RbFuse.defer, from read, write or getattr
+ *
+ * Takes the request being handled and returns its RbFuse::Pending.
+ */
+static VALUE
+rf_defer(VALUE self) {
+  struct rf_pending *pd;
+  VALUE token = TypedData_Make_Struct(cPending, struct rf_pending,
+                                      &pending_type, pd);
+
+  if (rf_ll_defer(&pd->d) != 0) {
+    pd->replied = 1;
+    rb_raise(cFSException, "this request cannot be deferred");
+  }
+  return token;
 }
 
+/* rf_deferrable_p
+ *
+ * Used by: RbFuse.deferrable?
+ */
 static VALUE
-rf_debugmode(VALUE self){
-  if(debugMode){
-    return Qtrue;
-  }else{
-    return Qfalse;
+rf_deferrable_p(VALUE self) {
+  return rf_ll_deferrable() ? Qtrue : Qfalse;
+}
+
+/* rf_reply
+ *
+ * Used by: RbFuse.reply(token, value)
+ *
+ * Answers a deferred request with what its callback would have returned:
+ * a String (or nil, for end of file) for read, the bytes written (or
+ * true for all of them) for write, a stat for getattr. Any other value
+ * for write raises ArgumentError and leaves the request unanswered.
+ */
+static VALUE
+rf_reply(VALUE self, VALUE token, VALUE val) {
+  struct rf_pending *pd = rf_pending_peek(token);
+  struct stat st;
+  size_t written = 0;
+  int res = 0;
+
+  /* what can raise is done before the token counts as answered */
+  if (pd->d.kind == RF_LL_REPLY_ATTR) {
+    memset(&st, 0, sizeof(st));
+    res = RTEST(val) ? rf_stat_to_struct(val, &st) : -ENOENT;
+  } else if (pd->d.kind == RF_LL_REPLY_WRITE) {
+    if (val == Qtrue)
+      written = pd->d.size;
+    else if ((FIXNUM_P(val) || TYPE(val) == T_BIGNUM) &&
+             !RTEST(rb_funcall(val, '<', 1, INT2FIX(0))) &&
+             !RTEST(rb_funcall(val, '>', 1, SIZET2NUM(pd->d.size))))
+      written = NUM2SIZET(val);
+    else
+      rb_raise(rb_eArgError, "write must be answered with a byte count "
+               "up to %lu or true", (unsigned long)pd->d.size);
   }
+  pd->replied = 1;
+
+  switch (pd->d.kind) {
+  case RF_LL_REPLY_DATA:
+    if (TYPE(val) == T_STRING)
+      res = rf_ll_reply_data(&pd->d, RSTRING_PTR(val), RSTRING_LEN(val));
+    else
+      res = rf_ll_reply_data(&pd->d, NULL, 0);
+    break;
+  case RF_LL_REPLY_WRITE:
+    res = rf_ll_reply_write(&pd->d, written);
+    break;
+  case RF_LL_REPLY_ATTR:
+    if (res == 0)
+      res = rf_ll_reply_attr(&pd->d, &st);
+    else
+      res = rf_ll_reply_error(&pd->d, -res);
+    break;
+  default:
+    res = rf_ll_reply_error(&pd->d, EIO);
+  }
+  return res == 0 ? Qtrue : Qfalse;
 }
 
+/* rf_reply_error
+ *
+ * Used by: RbFuse.reply_error(token, errno)
+ *
+ * errno is an Integer, an Errno class or an exception. An exception fails
+ * the request as in strict mode: with the errno of a SystemCallError, or
+ * EIO if it has none. Only an explicit errno that is not positive raises.
+ */
 static VALUE
-rf_debugmode_set(VALUE self,VALUE val){
-  debugMode=RTEST(val);
-  return val;
+rf_reply_error(VALUE self, VALUE token, VALUE err) {
+  struct rf_pending *pd;
+  int e;
+
+  if (rb_obj_is_kind_of(err, rb_eException))
+    err = INT2FIX(rf_exception_errno(err));
+  else if (TYPE(err) == T_CLASS)
+    err = rb_const_get(err, rb_intern("Errno"));
+  e = NUM2INT(err);
+  if (e <= 0)
+    rb_raise(rb_eArgError, "errno must be positive");
+  pd = rf_pending_get(token);
+  return rf_ll_reply_error(&pd->d, e) == 0 ? Qtrue : Qfalse;
+}
+
+
+/* In-process benchmark
+ *
+ * RbFuse.bench_op calls the entries of rf_oper in a loop the way libfuse
+ * would, on a thread that has given up the GVL, with a synthetic
+ * fuse_file_info and no mount. It measures what the binding adds around
+ * the Ruby callbacks without needing /dev/fuse.
+ */
+enum rf_bench_op {
+  RF_BENCH_GETATTR, RF_BENCH_READDIR, RF_BENCH_OPEN,
+  RF_BENCH_READ, RF_BENCH_WRITE
+};
+
+struct rf_bench {
+  enum rf_bench_op op;
+  const char *path;
+  long iterations;
+  size_t size;
+  off_t offset;
+  off_t file_size;  /* sequential offsets wrap, random ones stay below */
+  int random;
+  char *buf;
+  struct fuse_file_info fi;
+  struct rf_worker worker;
+  uint64_t elapsed_ns;
+  long entries;
+  int ret;
+};
+
+static int
+rf_bench_fill(void *buf, const char *name, const struct stat *st, off_t off) {
+  ((struct rf_bench *)buf)->entries++;
+  return 0;
+}
+
+#if FUSE_VERSION >= 29
+static void
+rf_bench_free_buf(struct fuse_bufvec *bufv) {
+  size_t i;
+  if (bufv == NULL)
+    return;
+  for (i = 0; i < bufv->count; i++)
+    free(bufv->buf[i].mem);
+  free(bufv);
+}
+#endif
+
+/* rf_bench_one
+ *
+ * One request of b->op at offset off, as libfuse would make it.
+ */
+static int
+rf_bench_one(struct rf_bench *b, off_t off) {
+  struct stat st;
+  int ret;
+
+  switch (b->op) {
+  case RF_BENCH_GETATTR:
+    return rf_oper.getattr(b->path, &st);
+  case RF_BENCH_READDIR:
+    return rf_oper.readdir(b->path, b, rf_bench_fill, 0, &b->fi);
+  case RF_BENCH_OPEN:
+    ret = rf_oper.open(b->path, &b->fi);
+    if (ret == 0)
+      ret = rf_oper.release(b->path, &b->fi);
+    return ret;
+  case RF_BENCH_READ:
+#if FUSE_VERSION >= 29
+    {
+      struct fuse_bufvec *bufv = NULL;
+      struct fuse_bufvec dst = FUSE_BUFVEC_INIT(b->size);
+      dst.buf[0].mem = b->buf;
+      ret = rf_oper.read_buf(b->path, &bufv, b->size, off, &b->fi);
+      if (ret == 0 && bufv)
+        ret = fuse_buf_copy(&dst, bufv, 0);
+      rf_bench_free_buf(bufv);
+      return ret;
+    }
+#else
+    return rf_oper.read(b->path, b->buf, b->size, off, &b->fi);
+#endif
+  case RF_BENCH_WRITE:
+#if FUSE_VERSION >= 29
+    {
+      struct fuse_bufvec src = FUSE_BUFVEC_INIT(b->size);
+      src.buf[0].mem = b->buf;
+      return rf_oper.write_buf(b->path, &src, off, &b->fi);
+    }
+#else
+    return rf_oper.write(b->path, b->buf, b->size, off, &b->fi);
+#endif
+  }
+  return -ENOSYS;
+}
+
+static void *
+rf_bench_run(void *data) {
+  struct rf_bench *b = data;
+  uint64_t x = 88172645463325252ULL;
+  off_t off = b->offset;
+  off_t blocks = b->file_size / (off_t)(b->size ? b->size : 1);
+  struct timespec t0, t1;
+  long i;
+
+  rf_current_worker = &b->worker;
+  rf_without_gvl = 1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < b->iterations; i++) {
+    if (b->random) {
+      x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+      off = (off_t)(x % (blocks > 0 ? blocks : 1)) * b->size;
+    } else if (b->file_size > 0 && off + (off_t)b->size > b->file_size) {
+      off = b->offset;
+    }
+    b->ret = rf_bench_one(b, off);
+    if (b->ret < 0 || b->worker.state)
+      break;
+    off += b->size;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  b->elapsed_ns = (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+                  t1.tv_nsec - t0.tv_nsec;
+  rf_without_gvl = 0;
+  rf_current_worker = NULL;
+  return NULL;
+}
+
+/* rf_bench_op
+ *
+ * Used by: RbFuse.bench_op(op, path, iterations, opts = {}), see
+ *   bench/bench.rb
+ *
+ * Makes iterations requests of op (:getattr, :readdir, :open - open and
+ * release -, :read or :write) for path against the root set with
+ * set_root, and returns the seconds they took. For read and write the file
+ * is opened once around the loop; opts are :size (bytes per request,
+ * default 4096), :offset (where to start), :file_size (sequential requests
+ * wrap around there) and :random (block aligned offsets below :file_size).
+ * Raises the errno of the first request that fails.
+ */
+static VALUE
+rf_bench_op(int argc, VALUE *argv, VALUE self) {
+  VALUE op, path, iterations, opts, v;
+  struct rf_bench b;
+  ID id;
+  int ret = 0;
+
+  rb_scan_args(argc, argv, "31", &op, &path, &iterations, &opts);
+  if (default_mount->root == Qnil)
+    rb_raise(cFSException, "bench_op needs a root, see set_root");
+
+  memset(&b, 0, sizeof(b));
+  b.worker.error = Qnil;
+  b.path = StringValueCStr(path);
+  b.iterations = NUM2LONG(iterations);
+  b.size = 4096;
+  id = SYM2ID(op);
+  if (id == rb_intern("getattr"))      b.op = RF_BENCH_GETATTR;
+  else if (id == rb_intern("readdir")) b.op = RF_BENCH_READDIR;
+  else if (id == rb_intern("open"))    b.op = RF_BENCH_OPEN;
+  else if (id == rb_intern("read"))    b.op = RF_BENCH_READ;
+  else if (id == rb_intern("write"))   b.op = RF_BENCH_WRITE;
+  else rb_raise(rb_eArgError, "unknown operation %s", rb_id2name(id));
+
+  if (!NIL_P(opts)) {
+    Check_Type(opts, T_HASH);
+    v = rb_hash_aref(opts, ID2SYM(rb_intern("size")));
+    if (!NIL_P(v)) b.size = NUM2SIZET(v);
+    v = rb_hash_aref(opts, ID2SYM(rb_intern("offset")));
+    if (!NIL_P(v)) b.offset = NUM2OFFT(v);
+    v = rb_hash_aref(opts, ID2SYM(rb_intern("file_size")));
+    if (!NIL_P(v)) b.file_size = NUM2OFFT(v);
+    b.random = RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("random"))));
+  }
+  if (b.size == 0 || b.size > 128 * 1024 * 1024)
+    rb_raise(rb_eArgError, "size out of range");
+
+  if (b.op == RF_BENCH_READ || b.op == RF_BENCH_WRITE) {
+    b.buf = malloc(b.size);
+    if (b.buf == NULL)
+      rb_memerror();
+    memset(b.buf, 'x', b.size);
+    b.fi.flags = b.op == RF_BENCH_READ ? O_RDONLY : O_WRONLY;
+    ret = rf_oper.open(b.path, &b.fi);
+  }
+
+  if (ret == 0) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(rf_bench_run, &b, RUBY_UBF_IO, NULL);
+#else
+    rf_bench_run(&b);
+#endif
+    ret = b.ret;
+    if (b.buf) {
+      rf_oper.flush(b.path, &b.fi);
+      rf_oper.release(b.path, &b.fi);
+    }
+  }
+  free(b.buf);
+
+  if (b.worker.state) {
+    if (rb_obj_is_kind_of(b.worker.error, rb_eException))
+      rb_exc_raise(b.worker.error);
+    rb_jump_tag(b.worker.state);
+  }
+  if (ret < 0) {
+    errno = -ret;
+    rb_sys_fail(b.path);
+  }
+  return rb_float_new(b.elapsed_ns / 1e9);
 }
 
 
@@ -917,6 +4053,36 @@ void
 Init_rbfuse_lib() {
   init_time = time(NULL);
 
+  {
+    static const char *const modes[8] =
+      { "r", "w", "wr", "", "ra", "wa", "wra", "a" };
+    int i;
+    for (i = 0; i < RF_M_MAX; i++)
+      rf_method_ids[i] = rb_intern(rf_method_names[i]);
+    for (i = 0; i < 8; i++) {
+      open_modes[i] = rb_obj_freeze(rb_str_new2(modes[i]));
+      rb_global_variable(&open_modes[i]);
+    }
+  }
+  id_perm     = rb_intern("perm");
+  id_filetype = rb_intern("filetype");
+  id_size     = rb_intern("size");
+  id_nlink    = rb_intern("nlink");
+  id_uid      = rb_intern("uid");
+  id_gid      = rb_intern("gid");
+  id_atime    = rb_intern("atime");
+  id_mtime    = rb_intern("mtime");
+  id_ctime    = rb_intern("ctime");
+  id_to_i     = rb_intern("to_i");
+  id_fileno   = rb_intern("fileno");
+  id_errno    = rb_intern("errno");
+  id_fiber_call = rb_intern("fiber_call");
+  sym_direct_io  = ID2SYM(rb_intern("direct_io"));
+  sym_keep_cache = ID2SYM(rb_intern("keep_cache"));
+  sym_handle     = ID2SYM(rb_intern("handle"));
+  sym_write_buffer = ID2SYM(rb_intern("write_buffer"));
+  sym_total_allocated_objects = ID2SYM(rb_intern("total_allocated_objects"));
+
   /* module FuseFS */
   cRbFuse = rb_define_module("RbFuse");
 
@@ -930,6 +4096,9 @@ Init_rbfuse_lib() {
   rb_define_singleton_method(cRbFuse,"reader_gid",  (rbfunc) rf_gid, 0);
   rb_define_singleton_method(cRbFuse,"gid",         (rbfunc) rf_gid, 0);
   rb_define_singleton_method(cRbFuse,"process",     (rbfunc) rf_process, 0);
+  rb_define_singleton_method(cRbFuse,"worker_loop", (rbfunc) rf_worker_loop, 0);
+  rb_define_singleton_method(cRbFuse,"main_loop",   (rbfunc) rf_main_loop, 0);
+  rb_define_singleton_method(cRbFuse,"stop_workers",(rbfunc) rf_stop_workers, 0);
   rb_define_singleton_method(cRbFuse,"mount_to",    (rbfunc) rf_mount_to, -1);
   rb_define_singleton_method(cRbFuse,"mount_under", (rbfunc) rf_mount_to, -1);
   rb_define_singleton_method(cRbFuse,"mountpoint",  (rbfunc) rf_mount_to, -1);
@@ -937,9 +4106,67 @@ Init_rbfuse_lib() {
   rb_define_singleton_method(cRbFuse,"root=",       (rbfunc) rf_set_root, 1);
   rb_define_singleton_method(cRbFuse,"debug",(rbfunc)rf_debugmode,0);
   rb_define_singleton_method(cRbFuse,"debug=",(rbfunc)rf_debugmode_set,1);
-  
+  rb_define_singleton_method(cRbFuse,"attr_cache",     (rbfunc) rf_attr_cache_get, 0);
+  rb_define_singleton_method(cRbFuse,"attr_cache=",    (rbfunc) rf_attr_cache_set, 1);
+  rb_define_singleton_method(cRbFuse,"invalidate_attr",(rbfunc) rf_invalidate_attr, 1);
+  rb_define_singleton_method(cRbFuse,"read_cache",     (rbfunc) rf_read_cache_get, 0);
+  rb_define_singleton_method(cRbFuse,"read_cache=",    (rbfunc) rf_read_cache_set, 1);
+  rb_define_singleton_method(cRbFuse,"invalidate_read",(rbfunc) rf_invalidate_read, 1);
+  rb_define_singleton_method(cRbFuse,"invalidate_entry",(rbfunc) rf_invalidate_entry, 2);
+  rb_define_singleton_method(cRbFuse,"invalidate_inode",(rbfunc) rf_invalidate_inode, -1);
+  rb_define_singleton_method(cRbFuse,"store",          (rbfunc) rf_store, 3);
+  rb_define_singleton_method(cRbFuse,"open_handles",(rbfunc) rf_open_handles, 0);
+  rb_define_singleton_method(cRbFuse,"path_cache=",(rbfunc) rf_path_cache_set, 1);
+  rb_define_singleton_method(cRbFuse,"write_buffer", (rbfunc) rf_write_buffer_get, 0);
+  rb_define_singleton_method(cRbFuse,"write_buffer=",(rbfunc) rf_write_buffer_set, 1);
+  rb_define_singleton_method(cRbFuse,"strict", (rbfunc) rf_strict_get, 0);
+  rb_define_singleton_method(cRbFuse,"strict=",(rbfunc) rf_strict_set, 1);
+  rb_define_singleton_method(cRbFuse,"dispatch_stats", (rbfunc) rf_dispatch_stats, 0);
+  rb_define_singleton_method(cRbFuse,"dispatch_stats=",(rbfunc) rf_dispatch_stats_set, 1);
+  rb_define_singleton_method(cRbFuse,"stats",      (rbfunc) rf_stats, 0);
+  rb_define_singleton_method(cRbFuse,"stats=",     (rbfunc) rf_stats_set, 1);
+  rb_define_singleton_method(cRbFuse,"reset_stats",(rbfunc) rf_reset_stats, 0);
+  rb_define_singleton_method(cRbFuse,"trace",      (rbfunc) rf_trace_get, 0);
+  rb_define_singleton_method(cRbFuse,"trace=",     (rbfunc) rf_trace_set, 1);
+  rb_define_singleton_method(cRbFuse,"trace_dump", (rbfunc) rf_trace_dump, 1);
+  rb_define_singleton_method(cRbFuse,"bench_op",   (rbfunc) rf_bench_op, -1);
+  rb_define_singleton_method(cRbFuse,"defer",      (rbfunc) rf_defer, 0);
+  rb_define_singleton_method(cRbFuse,"deferrable?",(rbfunc) rf_deferrable_p, 0);
+  rb_define_singleton_method(cRbFuse,"reply",      (rbfunc) rf_reply, 2);
+  rb_define_singleton_method(cRbFuse,"reply_error",(rbfunc) rf_reply_error, 2);
+  rb_define_singleton_method(cRbFuse,"mounts",     (rbfunc) rf_mounts, 0);
+
+  cMount = rb_define_class_under(cRbFuse,"Mount",rb_cObject);
+  rb_define_alloc_func(cMount,rf_mount_alloc);
+  rb_define_method(cMount,"initialize",      (rbfunc) rf_mount_initialize, -1);
+  rb_define_method(cMount,"unmount",         (rbfunc) rf_mount_unmount, 0);
+  rb_define_method(cMount,"mounted?",        (rbfunc) rf_mount_mounted_p, 0);
+  rb_define_method(cMount,"root",            (rbfunc) rf_mount_root, 0);
+  rb_define_method(cMount,"mountpoint",      (rbfunc) rf_mount_mountpoint, 0);
+  rb_define_method(cMount,"fuse_fd",         (rbfunc) rf_mount_fd, 0);
+  rb_define_method(cMount,"invalidate_attr", (rbfunc) rf_invalidate_attr, 1);
+  rb_define_method(cMount,"invalidate_read", (rbfunc) rf_invalidate_read, 1);
+  rb_define_method(cMount,"invalidate_entry",(rbfunc) rf_invalidate_entry, 2);
+  rb_define_method(cMount,"invalidate_inode",(rbfunc) rf_invalidate_inode, -1);
+  rb_define_method(cMount,"store",           (rbfunc) rf_store, 3);
+
+  live_mounts = rb_ary_new();
+  rb_global_variable(&live_mounts);
+  {
+    VALUE def = rf_mount_alloc(cMount);
+    rb_gc_register_mark_object(def);
+    default_mount = rf_mount_get(def);
+  }
+
+  cHandle = rb_define_class_under(cRbFuse,"Handle",rb_cObject);
+  rb_define_attr(cHandle,"data",1,1);
+  cPending = rb_define_class_under(cRbFuse,"Pending",rb_cObject);
+  rb_undef_alloc_func(cPending);
+  Init_rbfuse_handles();
 
-  rb_iv_set(cRbFuse,"@handles",rb_hash_new());
+  Init_rbfuse_stat(cRbFuse,init_time);
+  Init_rbfuse_paths();
+  Init_rbfuse_memfs(cRbFuse);
 
   rb_define_const(cRbFuse,"S_IFDIR",INT2FIX(S_IFDIR));
   rb_define_const(cRbFuse,"S_IFREG",INT2FIX(S_IFREG));
@@ -0,0 +1,1153 @@
+/* rbfuse_ll.c */
+
+/* The lowlevel engine.
+ *
+ * Requests from the kernel name inodes, not paths. Through the high-level
+ * API libfuse keeps its own inode table and turns every request back into
+ * a full path; here the inodes are either handed to the filesystem as they
+ * are (struct rf_ll_ops) or, for filesystems written against the path API,
+ * resolved through a native inode table and passed on to the same
+ * fuse_operations the high-level API would call. */
+
+#define FUSE_USE_VERSION 26
+#define _FILE_OFFSET_BITS 64
+
+#include <fuse.h>
+#include <fuse/fuse_lowlevel.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "rbfuse_fuse.h"
+#include "rbfuse_ll.h"
+
+/* d_ino of entries whose inode readdir does not know */
+#define RF_LL_UNKNOWN_INO 0xffffffff
+
+
+/* Inode table
+ *
+ * Used by the path adapter. A node is created by the first lookup of a
+ * (parent, name) pair and lives until the kernel forgets every lookup of
+ * it. Unlinked nodes stay in the inode hash, still knowing their old path,
+ * so that open handles can be released.
+ */
+struct rf_node {
+  struct rf_node *ino_next;  /* by ino */
+  struct rf_node *name_next; /* by (parent, name) */
+  fuse_ino_t ino;
+  fuse_ino_t parent;
+  unsigned long nlookup;
+  uint32_t hash;
+  int linked;
+  char *name;
+};
+
+struct ll_nodes {
+  pthread_mutex_t lock;
+  struct rf_node **inos;
+  struct rf_node **names;
+  size_t size;     /* buckets in each hash */
+  size_t count;
+  fuse_ino_t next_ino;
+};
+
+/* One lowlevel mount, the userdata of its session: the callbacks it is
+ * served through and, for the path adapter, its inode table. */
+struct ll_mount {
+  const struct rf_ll_ops *ops;
+  const struct fuse_operations *paths;
+  struct rf_ll_conf conf;
+  struct ll_nodes nodes;
+};
+
+/* The mount the path adapter is called for on this thread */
+static __thread struct ll_mount *ll_cur = NULL;
+
+/* FNV-1a over the parent inode and the name */
+static uint32_t
+name_hash(fuse_ino_t parent, const char *name) {
+  uint32_t h = 2166136261U;
+  size_t i;
+  for (i = 0; i < sizeof(parent); i++) {
+    h ^= (unsigned char)(parent >> (i * 8));
+    h *= 16777619U;
+  }
+  for (; *name; name++) {
+    h ^= (unsigned char)*name;
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static struct rf_node *
+node_by_ino(struct ll_nodes *nodes, fuse_ino_t ino) {
+  struct rf_node *n = nodes->inos[ino & (nodes->size - 1)];
+  while (n && n->ino != ino)
+    n = n->ino_next;
+  return n;
+}
+
+static struct rf_node *
+node_by_name(struct ll_nodes *nodes, fuse_ino_t parent, const char *name) {
+  uint32_t h = name_hash(parent, name);
+  struct rf_node *n = nodes->names[h & (nodes->size - 1)];
+  while (n && !(n->hash == h && n->parent == parent &&
+                strcmp(n->name, name) == 0))
+    n = n->name_next;
+  return n;
+}
+
+static void
+node_link(struct ll_nodes *nodes, struct rf_node *n) {
+  struct rf_node **b;
+  n->hash = name_hash(n->parent, n->name);
+  b = &nodes->names[n->hash & (nodes->size - 1)];
+  n->name_next = *b;
+  *b = n;
+  n->linked = 1;
+}
+
+static void
+node_unlink(struct ll_nodes *nodes, struct rf_node *n) {
+  struct rf_node **p;
+  if (!n->linked)
+    return;
+  for (p = &nodes->names[n->hash & (nodes->size - 1)]; *p;
+       p = &(*p)->name_next) {
+    if (*p == n) {
+      *p = n->name_next;
+      break;
+    }
+  }
+  n->linked = 0;
+}
+
+static void
+node_remove(struct ll_nodes *nodes, struct rf_node *n) {
+  struct rf_node **p;
+  node_unlink(nodes, n);
+  for (p = &nodes->inos[n->ino & (nodes->size - 1)]; *p;
+       p = &(*p)->ino_next) {
+    if (*p == n) {
+      *p = n->ino_next;
+      break;
+    }
+  }
+  nodes->count--;
+  free(n->name);
+  free(n);
+}
+
+static int
+nodes_resize(struct ll_nodes *nodes, size_t size) {
+  struct rf_node **inos = calloc(size, sizeof(*inos));
+  struct rf_node **names = calloc(size, sizeof(*names));
+  size_t i;
+
+  if (inos == NULL || names == NULL) {
+    free(inos);
+    free(names);
+    return -ENOMEM;
+  }
+  for (i = 0; i < nodes->size; i++) {
+    struct rf_node *n = nodes->inos[i];
+    while (n) {
+      struct rf_node *next = n->ino_next;
+      n->ino_next = inos[n->ino & (size - 1)];
+      inos[n->ino & (size - 1)] = n;
+      if (n->linked) {
+        n->name_next = names[n->hash & (size - 1)];
+        names[n->hash & (size - 1)] = n;
+      }
+      n = next;
+    }
+  }
+  free(nodes->inos);
+  free(nodes->names);
+  nodes->inos = inos;
+  nodes->names = names;
+  nodes->size = size;
+  return 0;
+}
+
+static struct rf_node *
+node_new(struct ll_nodes *nodes, fuse_ino_t ino, fuse_ino_t parent,
+         const char *name) {
+  struct rf_node *n;
+  struct rf_node **b;
+
+  if (nodes->count >= nodes->size &&
+      nodes_resize(nodes, nodes->size * 2) != 0)
+    return NULL;
+  n = calloc(1, sizeof(*n));
+  if (n == NULL)
+    return NULL;
+  n->name = strdup(name);
+  if (n->name == NULL) {
+    free(n);
+    return NULL;
+  }
+  n->ino = ino;
+  n->parent = parent;
+  b = &nodes->inos[ino & (nodes->size - 1)];
+  n->ino_next = *b;
+  *b = n;
+  node_link(nodes, n);
+  nodes->count++;
+  return n;
+}
+
+static int
+nodes_init(struct ll_nodes *nodes) {
+  struct rf_node *root;
+
+  memset(nodes, 0, sizeof(*nodes));
+  pthread_mutex_init(&nodes->lock, NULL);
+  if (nodes_resize(nodes, 1024) != 0)
+    return 0;
+  nodes->next_ino = FUSE_ROOT_ID + 1;
+  root = node_new(nodes, FUSE_ROOT_ID, 0, "");
+  if (root)
+    root->nlookup = 1;
+  return root != NULL;
+}
+
+static void
+nodes_free(struct ll_nodes *nodes) {
+  size_t i;
+
+  for (i = 0; i < nodes->size; i++)
+    while (nodes->inos[i])
+      node_remove(nodes, nodes->inos[i]);
+  free(nodes->inos);
+  free(nodes->names);
+  pthread_mutex_destroy(&nodes->lock);
+}
+
+/* node_path
+ *
+ * Writes the path of ino, followed by "/name" when name is given, into the
+ * end of buf and returns where it starts. Called with nodes->lock held.
+ */
+static char *
+node_path(struct ll_nodes *nodes, fuse_ino_t ino, const char *name,
+          char *buf, size_t size, int *err) {
+  char *p = buf + size - 1;
+  struct rf_node *n;
+
+  *p = '\0';
+  if (name) {
+    size_t len = strlen(name);
+    if (len + 1 >= (size_t)(p - buf))
+      goto toolong;
+    p -= len;
+    memcpy(p, name, len);
+    *--p = '/';
+  }
+  while (ino != FUSE_ROOT_ID) {
+    size_t len;
+    n = node_by_ino(nodes, ino);
+    if (n == NULL) {
+      *err = -ENOENT;
+      return NULL;
+    }
+    len = strlen(n->name);
+    if (len + 1 >= (size_t)(p - buf))
+      goto toolong;
+    p -= len;
+    memcpy(p, n->name, len);
+    *--p = '/';
+    ino = n->parent;
+  }
+  if (*p == '\0')
+    *--p = '/';
+  return p;
+toolong:
+  *err = -ENAMETOOLONG;
+  return NULL;
+}
+
+#define WITH_PATH(ino, name, path)                                \
+  char path##_buf[PATH_MAX];                                      \
+  const char *path;                                               \
+  int path##_err = 0;                                             \
+  pthread_mutex_lock(&m->nodes.lock);                             \
+  path = node_path(&m->nodes, ino, name, path##_buf,              \
+                   sizeof(path##_buf), &path##_err);              \
+  pthread_mutex_unlock(&m->nodes.lock);                           \
+  if (path == NULL)                                               \
+    return path##_err
+
+
+/* The path adapter
+ *
+ * rf_ll_ops implemented on top of the path based fuse_operations.
+ */
+static int
+path_lookup(fuse_ino_t parent, const char *name, fuse_ino_t *ino,
+            struct stat *st) {
+  struct ll_mount *m = ll_cur;
+  struct rf_node *n;
+  int res;
+  WITH_PATH(parent, name, path);
+
+  res = m->paths->getattr(path, st);
+  if (res != 0)
+    return res;
+
+  pthread_mutex_lock(&m->nodes.lock);
+  n = node_by_name(&m->nodes, parent, name);
+  if (n == NULL)
+    n = node_new(&m->nodes, m->nodes.next_ino++, parent, name);
+  if (n)
+    n->nlookup++;
+  pthread_mutex_unlock(&m->nodes.lock);
+  if (n == NULL)
+    return -ENOMEM;
+  *ino = n->ino;
+  return 0;
+}
+
+static int
+path_forget(fuse_ino_t ino, unsigned long nlookup) {
+  struct ll_mount *m = ll_cur;
+  struct rf_node *n;
+
+  if (ino == FUSE_ROOT_ID)
+    return 0;
+  pthread_mutex_lock(&m->nodes.lock);
+  n = node_by_ino(&m->nodes, ino);
+  if (n) {
+    n->nlookup = n->nlookup > nlookup ? n->nlookup - nlookup : 0;
+    if (n->nlookup == 0)
+      node_remove(&m->nodes, n);
+  }
+  pthread_mutex_unlock(&m->nodes.lock);
+  return 0;
+}
+
+static int
+path_getattr(fuse_ino_t ino, struct stat *st) {
+  struct ll_mount *m = ll_cur;
+  WITH_PATH(ino, NULL, path);
+  return m->paths->getattr(path, st);
+}
+
+static int
+path_truncate(fuse_ino_t ino, off_t size) {
+  struct ll_mount *m = ll_cur;
+  WITH_PATH(ino, NULL, path);
+  if (m->paths->truncate == NULL)
+    return -ENOSYS;
+  return m->paths->truncate(path, size);
+}
+
+static int
+path_readdir(fuse_ino_t ino, void *buf, fuse_fill_dir_t filler) {
+  struct ll_mount *m = ll_cur;
+  WITH_PATH(ino, NULL, path);
+  return m->paths->readdir(path, buf, filler, 0, NULL);
+}
+
+static int
+path_mknod(fuse_ino_t parent, const char *name, mode_t mode) {
+  struct ll_mount *m = ll_cur;
+  WITH_PATH(parent, name, path);
+  if (m->paths->mknod == NULL)
+    return -ENOSYS;
+  return m->paths->mknod(path, mode, 0);
+}
+
+static int
+path_mkdir(fuse_ino_t parent, const char *name, mode_t mode) {
+  struct ll_mount *m = ll_cur;
+  WITH_PATH(parent, name, path);
+  if (m->paths->mkdir == NULL)
+    return -ENOSYS;
+  return m->paths->mkdir(path, mode);
+}
+
+static void
+path_removed(fuse_ino_t parent, const char *name) {
+  struct ll_mount *m = ll_cur;
+  struct rf_node *n;
+  pthread_mutex_lock(&m->nodes.lock);
+  n = node_by_name(&m->nodes, parent, name);
+  if (n)
+    node_unlink(&m->nodes, n);
+  pthread_mutex_unlock(&m->nodes.lock);
+}
+
+static int
+path_unlink(fuse_ino_t parent, const char *name) {
+  struct ll_mount *m = ll_cur;
+  int res;
+  WITH_PATH(parent, name, path);
+  if (m->paths->unlink == NULL)
+    return -ENOSYS;
+  res = m->paths->unlink(path);
+  if (res == 0)
+    path_removed(parent, name);
+  return res;
+}
+
+static int
+path_rmdir(fuse_ino_t parent, const char *name) {
+  struct ll_mount *m = ll_cur;
+  int res;
+  WITH_PATH(parent, name, path);
+  if (m->paths->rmdir == NULL)
+    return -ENOSYS;
+  res = m->paths->rmdir(path);
+  if (res == 0)
+    path_removed(parent, name);
+  return res;
+}
+
+static int
+path_rename(fuse_ino_t parent, const char *name,
+            fuse_ino_t newparent, const char *newname) {
+  struct ll_mount *m = ll_cur;
+  struct rf_node *n;
+  char *copy;
+  int res;
+  WITH_PATH(parent, name, path);
+  WITH_PATH(newparent, newname, dest);
+
+  if (m->paths->rename == NULL)
+    return -ENOSYS;
+  res = m->paths->rename(path, dest);
+  if (res != 0)
+    return res;
+
+  path_removed(newparent, newname);
+  copy = strdup(newname);
+  pthread_mutex_lock(&m->nodes.lock);
+  n = node_by_name(&m->nodes, parent, name);
+  if (n) {
+    node_unlink(&m->nodes, n);
+    if (copy) {
+      free(n->name);
+      n->name = copy;
+      n->parent = newparent;
+      node_link(&m->nodes, n);
+      copy = NULL;
+    }
+  }
+  pthread_mutex_unlock(&m->nodes.lock);
+  free(copy);
+  return 0;
+}
+
+static int
+path_open(fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct ll_mount *m = ll_cur;
+  WITH_PATH(ino, NULL, path);
+  return m->paths->open(path, fi);
+}
+
+static int
+path_read(fuse_ino_t ino, char *buf, size_t size, off_t off,
+          struct fuse_file_info *fi) {
+  struct ll_mount *m = ll_cur;
+  WITH_PATH(ino, NULL, path);
+  return m->paths->read(path, buf, size, off, fi);
+}
+
+static int
+path_write(fuse_ino_t ino, const char *buf, size_t size, off_t off,
+           struct fuse_file_info *fi) {
+  struct ll_mount *m = ll_cur;
+  WITH_PATH(ino, NULL, path);
+  if (m->paths->write == NULL)
+    return -ENOSYS;
+  return m->paths->write(path, buf, size, off, fi);
+}
+
+static int
+path_flush(fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct ll_mount *m = ll_cur;
+  WITH_PATH(ino, NULL, path);
+  if (m->paths->flush == NULL)
+    return 0;
+  return m->paths->flush(path, fi);
+}
+
+static int
+path_fsync(fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+  struct ll_mount *m = ll_cur;
+  WITH_PATH(ino, NULL, path);
+  if (m->paths->fsync == NULL)
+    return 0;
+  return m->paths->fsync(path, datasync, fi);
+}
+
+static int
+path_release(fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct ll_mount *m = ll_cur;
+  WITH_PATH(ino, NULL, path);
+  if (m->paths->release == NULL)
+    return 0;
+  return m->paths->release(path, fi);
+}
+
+static const struct rf_ll_ops path_ops = {
+  .lookup   = path_lookup,
+  .forget   = path_forget,
+  .getattr  = path_getattr,
+  .truncate = path_truncate,
+  .readdir  = path_readdir,
+  .mknod    = path_mknod,
+  .mkdir    = path_mkdir,
+  .unlink   = path_unlink,
+  .rmdir    = path_rmdir,
+  .rename   = path_rename,
+  .open     = path_open,
+  .read     = path_read,
+  .write    = path_write,
+  .flush    = path_flush,
+  .fsync    = path_fsync,
+  .release  = path_release,
+};
+
+
+/* Requests
+ *
+ * Each handler calls the matching rf_ll_ops callback of the mount m the
+ * request came in on, and replies. The request is published to
+ * fusefs_uid/fusefs_gid for the duration.
+ */
+#define LL_CALL(m, req, cb, args)                                 \
+  ((m)->ops->cb == NULL ? -ENOSYS :                               \
+   (fusefs_set_request(req), ll_cur = (m),                        \
+    ll_call_res = (m)->ops->cb args,                              \
+    fusefs_set_request(NULL), ll_call_res))
+
+static __thread int ll_call_res;
+
+/* Deferred replies
+ *
+ * ll_read, ll_write and ll_getattr let the callback keep the request and
+ * answer it later, from any thread (RbFuse.defer). While the callback runs
+ * the request is offered in ll_defer; rf_ll_defer takes it, and the
+ * handler then leaves the reply to whoever holds it.
+ */
+struct ll_defer {
+  struct rf_ll_deferred d;
+  int taken;
+};
+
+static __thread struct ll_defer *ll_defer = NULL;
+
+#define LL_DEFER(req, kind, ino, size)                            \
+  struct ll_defer defer = { { req, kind, ino, size, fusefs_current() }, 0 }
+
+/* A request deferred on a filesystem since unmounted is gone. Every
+ * reply drops the hold rf_ll_defer took on the mount. */
+static int
+ll_defer_live(const struct rf_ll_deferred *d) {
+  return fusefs_mounted(d->mount);
+}
+
+static int
+ll_defer_done(const struct rf_ll_deferred *d, int res) {
+  fusefs_put(d->mount);
+  return res;
+}
+
+/* rf_ll_deferrable
+ *
+ * Whether the request being handled on this thread may be deferred.
+ */
+int
+rf_ll_deferrable(void) {
+  return ll_defer != NULL && !ll_defer->taken;
+}
+
+/* rf_ll_defer
+ *
+ * Takes the request being handled on this thread: fills *d, and its
+ * handler will not reply. Returns -1 if it cannot be deferred.
+ */
+int
+rf_ll_defer(struct rf_ll_deferred *d) {
+  if (!rf_ll_deferrable())
+    return -1;
+  *d = ll_defer->d;
+  ll_defer->taken = 1;
+  fusefs_hold(d->mount);
+  return 0;
+}
+
+/* rf_ll_deferred
+ *
+ * Whether the request being handled on this thread has been deferred.
+ */
+int
+rf_ll_deferred(void) {
+  return ll_defer != NULL && ll_defer->taken;
+}
+
+/* rf_ll_defer_suspend, rf_ll_defer_resume
+ *
+ * Around callbacks made on behalf of something other than the request
+ * (flushing a write-back buffer, filling the read cache), which must not
+ * take it.
+ */
+void *
+rf_ll_defer_suspend(void) {
+  struct ll_defer *saved = ll_defer;
+  ll_defer = NULL;
+  return saved;
+}
+
+void
+rf_ll_defer_resume(void *saved) {
+  ll_defer = saved;
+}
+
+int
+rf_ll_reply_data(const struct rf_ll_deferred *d, const char *buf,
+                 size_t len) {
+  if (!ll_defer_live(d))
+    return ll_defer_done(d, -ENOENT);
+  return ll_defer_done(d, fuse_reply_buf(d->req, buf,
+                                         len < d->size ? len : d->size));
+}
+
+int
+rf_ll_reply_write(const struct rf_ll_deferred *d, size_t count) {
+  if (!ll_defer_live(d))
+    return ll_defer_done(d, -ENOENT);
+  return ll_defer_done(d, fuse_reply_write(d->req, count));
+}
+
+int
+rf_ll_reply_attr(const struct rf_ll_deferred *d, struct stat *st) {
+  struct ll_mount *m;
+
+  if (!ll_defer_live(d))
+    return ll_defer_done(d, -ENOENT);
+  m = fuse_req_userdata(d->req);
+  st->st_ino = d->ino;
+  return ll_defer_done(d, fuse_reply_attr(d->req, st,
+                                          m->conf.attr_timeout));
+}
+
+int
+rf_ll_reply_error(const struct rf_ll_deferred *d, int err) {
+  if (!ll_defer_live(d))
+    return ll_defer_done(d, -ENOENT);
+  return ll_defer_done(d, fuse_reply_err(d->req, err));
+}
+
+static void
+ll_reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  struct fuse_entry_param e;
+  int res;
+
+  memset(&e, 0, sizeof(e));
+  res = LL_CALL(m, req, lookup, (parent, name, &e.ino, &e.attr));
+  if (res == 0) {
+    e.attr.st_ino = e.ino;
+    e.attr_timeout = m->conf.attr_timeout;
+    e.entry_timeout = m->conf.entry_timeout;
+    fuse_reply_entry(req, &e);
+  } else if (res == -ENOENT && m->conf.negative_timeout > 0) {
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = m->conf.negative_timeout;
+    fuse_reply_entry(req, &e);
+  } else {
+    fuse_reply_err(req, -res);
+  }
+}
+
+static void
+ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  ll_reply_entry(req, parent, name);
+}
+
+static void
+ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  if (m->ops->forget) {
+    ll_cur = m;
+    m->ops->forget(ino, nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+static void
+ll_reply_attr(fuse_req_t req, fuse_ino_t ino) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  struct stat st;
+  int res;
+
+  memset(&st, 0, sizeof(st));
+  res = LL_CALL(m, req, getattr, (ino, &st));
+  if (res != 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, m->conf.attr_timeout);
+}
+
+static void
+ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  struct stat st;
+  int res;
+  LL_DEFER(req, RF_LL_REPLY_ATTR, ino, 0);
+
+  memset(&st, 0, sizeof(st));
+  ll_defer = &defer;
+  res = LL_CALL(m, req, getattr, (ino, &st));
+  ll_defer = NULL;
+  if (defer.taken)
+    return;
+  if (res != 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, m->conf.attr_timeout);
+}
+
+/* ll_setattr
+ *
+ * Only the size can be changed. Times are accepted and ignored, as the
+ * high-level rf_utime does; mode and owner changes fail with ENOSYS.
+ */
+static void
+ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+           struct fuse_file_info *fi) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  int res;
+
+  if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+    fuse_reply_err(req, ENOSYS);
+    return;
+  }
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    res = LL_CALL(m, req, truncate, (ino, attr->st_size));
+    if (res != 0) {
+      fuse_reply_err(req, -res);
+      return;
+    }
+  }
+  ll_reply_attr(req, ino);
+}
+
+static void
+ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+         dev_t rdev) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  int res = LL_CALL(m, req, mknod, (parent, name, mode));
+  if (res != 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  ll_reply_entry(req, parent, name);
+}
+
+static void
+ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  int res = LL_CALL(m, req, mkdir, (parent, name, mode));
+  if (res != 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  ll_reply_entry(req, parent, name);
+}
+
+static void
+ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  fuse_reply_err(req, -LL_CALL(m, req, unlink, (parent, name)));
+}
+
+static void
+ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  fuse_reply_err(req, -LL_CALL(m, req, rmdir, (parent, name)));
+}
+
+static void
+ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+          fuse_ino_t newparent, const char *newname) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  fuse_reply_err(req, -LL_CALL(m, req, rename,
+                               (parent, name, newparent, newname)));
+}
+
+static void
+ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  int res = LL_CALL(m, req, open, (ino, fi));
+  if (res != 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  if (fuse_reply_open(req, fi) == -ENOENT && m->ops->release) {
+    ll_cur = m;
+    m->ops->release(ino, fi);  /* interrupted */
+  }
+}
+
+static void
+ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+        struct fuse_file_info *fi) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  char *buf = malloc(size);
+  int res;
+  LL_DEFER(req, RF_LL_REPLY_DATA, ino, size);
+
+  if (buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  ll_defer = &defer;
+  res = LL_CALL(m, req, read, (ino, buf, size, off, fi));
+  ll_defer = NULL;
+  if (!defer.taken) {
+    if (res < 0)
+      fuse_reply_err(req, -res);
+    else
+      fuse_reply_buf(req, buf, res);
+  }
+  free(buf);
+}
+
+static void
+ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+         off_t off, struct fuse_file_info *fi) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  int res;
+  LL_DEFER(req, RF_LL_REPLY_WRITE, ino, size);
+
+  ll_defer = &defer;
+  res = LL_CALL(m, req, write, (ino, buf, size, off, fi));
+  ll_defer = NULL;
+  if (defer.taken)
+    return;
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_write(req, res);
+}
+
+static void
+ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  int res = m->ops->flush ? LL_CALL(m, req, flush, (ino, fi)) : 0;
+  fuse_reply_err(req, -res);
+}
+
+static void
+ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+         struct fuse_file_info *fi) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  int res = m->ops->fsync ? LL_CALL(m, req, fsync, (ino, datasync, fi)) : 0;
+  fuse_reply_err(req, -res);
+}
+
+static void
+ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  LL_CALL(m, req, release, (ino, fi));
+  fuse_reply_err(req, 0);
+}
+
+/* Directory listings are collected in full on the first readdir of an
+ * open directory and then handed out in the slices the kernel asks for. */
+struct ll_dirbuf {
+  fuse_req_t req;
+  char *p;
+  size_t size;
+  int filled;
+};
+
+static int
+ll_filler(void *data, const char *name, const struct stat *stbuf,
+          off_t off) {
+  struct ll_dirbuf *d = data;
+  struct stat st;
+  size_t oldsize = d->size;
+  char *p;
+
+  memset(&st, 0, sizeof(st));
+  if (stbuf) {
+    st.st_ino = stbuf->st_ino;
+    st.st_mode = stbuf->st_mode;
+  }
+  if (st.st_ino == 0)
+    st.st_ino = RF_LL_UNKNOWN_INO;
+
+  d->size += fuse_add_direntry(d->req, NULL, 0, name, NULL, 0);
+  p = realloc(d->p, d->size);
+  if (p == NULL) {
+    d->size = oldsize;
+    return 1;
+  }
+  d->p = p;
+  fuse_add_direntry(d->req, d->p + oldsize, d->size - oldsize, name, &st,
+                    d->size);
+  return 0;
+}
+
+static void
+ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct ll_dirbuf *d = calloc(1, sizeof(*d));
+  if (d == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  fi->fh = (uintptr_t)d;
+  if (fuse_reply_open(req, fi) == -ENOENT)
+    free(d);
+}
+
+static void
+ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+           struct fuse_file_info *fi) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  struct ll_dirbuf *d = (struct ll_dirbuf *)(uintptr_t)fi->fh;
+
+  if (!d->filled || off == 0) {
+    int res;
+    free(d->p);
+    d->p = NULL;
+    d->size = 0;
+    d->req = req;
+    res = LL_CALL(m, req, readdir, (ino, d, ll_filler));
+    if (res != 0) {
+      fuse_reply_err(req, -res);
+      return;
+    }
+    d->filled = 1;
+  }
+  if ((size_t)off < d->size) {
+    size_t len = d->size - off;
+    fuse_reply_buf(req, d->p + off, len < size ? len : size);
+  } else {
+    fuse_reply_buf(req, NULL, 0);
+  }
+}
+
+static void
+ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct ll_dirbuf *d = (struct ll_dirbuf *)(uintptr_t)fi->fh;
+  free(d->p);
+  free(d);
+  fuse_reply_err(req, 0);
+}
+
+static void
+ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+            struct fuse_file_info *fi) {
+  fuse_reply_err(req, 0);
+}
+
+static void
+ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+  struct ll_mount *m = fuse_req_userdata(req);
+  struct statvfs buf;
+  int res = -ENOSYS;
+
+  memset(&buf, 0, sizeof(buf));
+  if (m->paths && m->paths->statfs)
+    res = m->paths->statfs("/", &buf);
+  if (res != 0)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_statfs(req, &buf);
+}
+
+static struct fuse_lowlevel_ops ll_oper = {
+  .lookup     = ll_lookup,
+  .forget     = ll_forget,
+  .getattr    = ll_getattr,
+  .setattr    = ll_setattr,
+  .mknod      = ll_mknod,
+  .mkdir      = ll_mkdir,
+  .unlink     = ll_unlink,
+  .rmdir      = ll_rmdir,
+  .rename     = ll_rename,
+  .open       = ll_open,
+  .read       = ll_read,
+  .write      = ll_write,
+  .flush      = ll_flush,
+  .fsync      = ll_fsync,
+  .release    = ll_release,
+  .opendir    = ll_opendir,
+  .readdir    = ll_readdir,
+  .releasedir = ll_releasedir,
+  .fsyncdir   = ll_fsyncdir,
+  .statfs     = ll_statfs,
+};
+
+
+/* Kernel cache invalidation
+ *
+ * Tell the kernel that what it cached about an inode or a name is stale,
+ * or push fresh data into its page cache, on a lowlevel mount (-ENOTCONN
+ * otherwise). -ENOENT means the kernel has nothing cached for it. Safe
+ * from any thread, but not from a callback handling a request on the
+ * directory concerned when requests are processed one at a time: the
+ * kernel waits for that request to finish first.
+ */
+
+/* rf_ll_path_ino
+ *
+ * The inode the kernel knows path by, through the path adapter's inode
+ * table. -ENOENT if it was never looked up, -EINVAL with the inode API.
+ */
+int
+rf_ll_path_ino(struct fusefs_mount *fm, const char *path, fuse_ino_t *ino) {
+  struct ll_mount *m = fusefs_ll_data(fm);
+  struct ll_nodes *nodes;
+  fuse_ino_t cur = FUSE_ROOT_ID;
+  char name[NAME_MAX + 1];
+
+  if (m == NULL || m->ops != &path_ops)
+    return -EINVAL;
+  nodes = &m->nodes;
+  pthread_mutex_lock(&nodes->lock);
+  while (*path) {
+    const char *end;
+    struct rf_node *n;
+
+    while (*path == '/')
+      path++;
+    if (*path == '\0')
+      break;
+    end = strchr(path, '/');
+    if (end == NULL)
+      end = path + strlen(path);
+    if (end - path > NAME_MAX) {
+      pthread_mutex_unlock(&nodes->lock);
+      return -ENAMETOOLONG;
+    }
+    memcpy(name, path, end - path);
+    name[end - path] = '\0';
+    n = node_by_name(nodes, cur, name);
+    if (n == NULL) {
+      pthread_mutex_unlock(&nodes->lock);
+      return -ENOENT;
+    }
+    cur = n->ino;
+    path = end;
+  }
+  pthread_mutex_unlock(&nodes->lock);
+  *ino = cur;
+  return 0;
+}
+
+int
+rf_ll_notify_inval_inode(struct fusefs_mount *fm, fuse_ino_t ino, off_t off,
+                         off_t len) {
+#if FUSE_VERSION >= 28
+  struct fuse_chan *ch = fusefs_ll_chan(fm);
+  if (ch == NULL)
+    return -ENOTCONN;
+  return fuse_lowlevel_notify_inval_inode(ch, ino, off, len);
+#else
+  return -ENOSYS;
+#endif
+}
+
+int
+rf_ll_notify_inval_entry(struct fusefs_mount *fm, fuse_ino_t parent,
+                         const char *name) {
+#if FUSE_VERSION >= 28
+  struct fuse_chan *ch = fusefs_ll_chan(fm);
+  if (ch == NULL)
+    return -ENOTCONN;
+  return fuse_lowlevel_notify_inval_entry(ch, parent, name, strlen(name));
+#else
+  return -ENOSYS;
+#endif
+}
+
+int
+rf_ll_notify_store(struct fusefs_mount *fm, fuse_ino_t ino, off_t off,
+                   const char *data, size_t len) {
+#if FUSE_VERSION >= 29
+  struct fuse_chan *ch = fusefs_ll_chan(fm);
+  struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(len);
+
+  if (ch == NULL)
+    return -ENOTCONN;
+  bufv.buf[0].mem = (void *)data;
+  return fuse_lowlevel_notify_store(ch, ino, off, &bufv, 0);
+#else
+  return -ENOSYS;
+#endif
+}
+
+void
+rf_ll_conf_init(struct rf_ll_conf *conf) {
+  conf->attr_timeout = 1.0;
+  conf->entry_timeout = 1.0;
+  conf->negative_timeout = 0.0;
+}
+
+/* rf_ll_conf_opt
+ *
+ * The timeouts are options of libfuse's path layer, which the lowlevel
+ * engine replaces, so they are taken out of the mount options here.
+ * Returns 1 if name was one of them.
+ */
+int
+rf_ll_conf_opt(struct rf_ll_conf *conf, const char *name, double val) {
+  if (strcmp(name, "attr_timeout") == 0)
+    conf->attr_timeout = val;
+  else if (strcmp(name, "entry_timeout") == 0)
+    conf->entry_timeout = val;
+  else if (strcmp(name, "negative_timeout") == 0)
+    conf->negative_timeout = val;
+  else
+    return 0;
+  return 1;
+}
+
+static void
+ll_mount_free(void *data) {
+  struct ll_mount *m = data;
+  if (m->ops == &path_ops)
+    nodes_free(&m->nodes);
+  free(m);
+}
+
+/* rf_ll_mount
+ *
+ * Mounts with the lowlevel engine. Every mount has its own inode table
+ * and configuration, freed with the mount. data and release are the
+ * owner's, as for fusefs_setup.
+ */
+struct fusefs_mount *
+rf_ll_mount(char *mountpoint, struct fuse_args *args,
+            const struct rf_ll_ops *ops, const struct fuse_operations *paths,
+            const struct rf_ll_conf *conf, void *data,
+            void (*release)(void *)) {
+  struct ll_mount *m = calloc(1, sizeof(*m));
+
+  if (m == NULL)
+    return NULL;
+  m->ops = ops ? ops : &path_ops;
+  m->paths = paths;
+  m->conf = *conf;
+  if (ops == NULL && !nodes_init(&m->nodes)) {
+    free(m);
+    return NULL;
+  }
+  return fusefs_setup_ll(mountpoint, &ll_oper, sizeof(ll_oper), args, m,
+                         ll_mount_free, data, release);
+}
@@ -0,0 +1,99 @@
+/* rbfuse_ll.h */
+
+/* The lowlevel engine: serves the kernel's inode based requests through
+ * fuse_lowlevel_ops instead of libfuse's path layer. */
+
+#ifndef __RBFUSE_LL_H_
+#define __RBFUSE_LL_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fuse.h>
+#include <fuse/fuse_lowlevel.h>
+
+struct fusefs_mount;
+
+/* Inode based callbacks. Each returns 0 or -errno, like fuse_operations.
+ * lookup fills *ino and *st for name in parent; mknod and mkdir are
+ * followed by a lookup of the new entry. Callbacks left NULL fail with
+ * ENOSYS (forget, flush and fsync just succeed). */
+struct rf_ll_ops {
+  int (*lookup)(fuse_ino_t parent, const char *name, fuse_ino_t *ino,
+                struct stat *st);
+  int (*forget)(fuse_ino_t ino, unsigned long nlookup);
+  int (*getattr)(fuse_ino_t ino, struct stat *st);
+  int (*truncate)(fuse_ino_t ino, off_t size);
+  int (*readdir)(fuse_ino_t ino, void *buf, fuse_fill_dir_t filler);
+  int (*mknod)(fuse_ino_t parent, const char *name, mode_t mode);
+  int (*mkdir)(fuse_ino_t parent, const char *name, mode_t mode);
+  int (*unlink)(fuse_ino_t parent, const char *name);
+  int (*rmdir)(fuse_ino_t parent, const char *name);
+  int (*rename)(fuse_ino_t parent, const char *name,
+                fuse_ino_t newparent, const char *newname);
+  int (*open)(fuse_ino_t ino, struct fuse_file_info *fi);
+  int (*read)(fuse_ino_t ino, char *buf, size_t size, off_t off,
+              struct fuse_file_info *fi);
+  int (*write)(fuse_ino_t ino, const char *buf, size_t size, off_t off,
+               struct fuse_file_info *fi);
+  int (*flush)(fuse_ino_t ino, struct fuse_file_info *fi);
+  int (*fsync)(fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+  int (*release)(fuse_ino_t ino, struct fuse_file_info *fi);
+};
+
+struct rf_ll_conf {
+  double attr_timeout;     /* seconds the kernel may cache attributes */
+  double entry_timeout;    /* seconds the kernel may cache a lookup */
+  double negative_timeout; /* seconds a failed lookup is remembered */
+};
+
+/* A request whose reply was deferred with rf_ll_defer. */
+enum rf_ll_reply {
+  RF_LL_REPLY_DATA,  /* read: up to size bytes */
+  RF_LL_REPLY_WRITE, /* write: bytes written */
+  RF_LL_REPLY_ATTR   /* getattr: the attributes of ino */
+};
+
+struct rf_ll_deferred {
+  fuse_req_t req;
+  enum rf_ll_reply kind;
+  fuse_ino_t ino;
+  size_t size;
+  struct fusefs_mount *mount;  /* held, answered only while it is up */
+};
+
+/* Returned by a callback whose request was deferred, instead of a result */
+#define RF_LL_DEFERRED (-0x10000)
+
+int   rf_ll_deferrable(void);
+int   rf_ll_defer(struct rf_ll_deferred *d);
+int   rf_ll_deferred(void);
+void *rf_ll_defer_suspend(void);
+void  rf_ll_defer_resume(void *saved);
+int   rf_ll_reply_data(const struct rf_ll_deferred *d, const char *buf,
+                       size_t len);
+int   rf_ll_reply_write(const struct rf_ll_deferred *d, size_t count);
+int   rf_ll_reply_attr(const struct rf_ll_deferred *d, struct stat *st);
+int   rf_ll_reply_error(const struct rf_ll_deferred *d, int err);
+
+int rf_ll_path_ino(struct fusefs_mount *m, const char *path, fuse_ino_t *ino);
+int rf_ll_notify_inval_inode(struct fusefs_mount *m, fuse_ino_t ino,
+                             off_t off, off_t len);
+int rf_ll_notify_inval_entry(struct fusefs_mount *m, fuse_ino_t parent,
+                             const char *name);
+int rf_ll_notify_store(struct fusefs_mount *m, fuse_ino_t ino, off_t off,
+                       const char *data, size_t len);
+
+void rf_ll_conf_init(struct rf_ll_conf *conf);
+int  rf_ll_conf_opt(struct rf_ll_conf *conf, const char *name, double val);
+
+/* Mounts with inode callbacks, or, when ops is NULL, with the path based
+ * operations in paths behind a native inode table. data and release are
+ * the owner's, see fusefs_setup. */
+struct fusefs_mount *rf_ll_mount(char *mountpoint, struct fuse_args *args,
+                                 const struct rf_ll_ops *ops,
+                                 const struct fuse_operations *paths,
+                                 const struct rf_ll_conf *conf,
+                                 void *data, void (*release)(void *data));
+
+#endif
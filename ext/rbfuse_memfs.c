@@ -0,0 +1,743 @@
+/* rbfuse_memfs.c */
+
+/* RbFuse::MemDir
+ *
+ * A tree of directories and files kept in C. Nodes are found through one
+ * hash keyed by their full path; each directory also links its children
+ * for readdir. File contents are stored in fixed size extents, so large
+ * files grow without reallocating what is already there.
+ *
+ * Requests for paths in the tree are answered here under a read lock,
+ * without the GVL. Everything else - paths the tree does not have, paths
+ * below a passthrough prefix, and any change made through the mount - goes
+ * to the fallback filesystem, if there is one. A change drops the affected
+ * entry and marks its directory incomplete, so that from then on the
+ * fallback lists it. Without a fallback the tree is all there is, and the
+ * mount is read-only.
+ *
+ * The tree is filled and pruned from Ruby (add_file, add_dir, remove). */
+
+#define FUSE_USE_VERSION 26
+#define _FILE_OFFSET_BITS 64
+
+#include <fuse.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ruby.h>
+
+#include "rbfuse_stat.h"
+#include "rbfuse_memfs.h"
+
+#ifndef RUBY_TYPED_FREE_IMMEDIATELY
+#define RUBY_TYPED_FREE_IMMEDIATELY 0
+#endif
+
+#define RF_MEMFS_EXTENT (64 * 1024)
+
+struct rf_mnode {
+  struct rf_mnode *hnext;     /* hash chain */
+  struct rf_mnode *parent;
+  struct rf_mnode *child;     /* first child, directories only */
+  struct rf_mnode *sib_prev;
+  struct rf_mnode *sib_next;
+  struct stat st;
+  int complete;               /* directories: children are the listing */
+  int detached;               /* removed while open */
+  unsigned long refs;         /* open handles */
+  char **extents;
+  size_t nextents;
+  uint32_t hash;
+  size_t pathlen;
+  const char *name;           /* points into path */
+  char path[1];
+};
+
+struct rf_memfs {
+  pthread_rwlock_t lock;
+  struct rf_mnode **buckets;
+  size_t nbuckets;
+  size_t count;
+  struct rf_mnode *root;
+  char **prefixes;            /* always sent to the fallback */
+  size_t nprefixes;
+  VALUE fallback;
+};
+
+static VALUE cMemDir = Qnil;
+
+/* FNV-1a */
+static uint32_t
+path_hash(const char *path, size_t len) {
+  uint32_t h = 2166136261U;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)path[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static struct rf_mnode *
+node_find(struct rf_memfs *m, const char *path, size_t len) {
+  uint32_t h = path_hash(path, len);
+  struct rf_mnode *n = m->buckets[h & (m->nbuckets - 1)];
+  while (n && !(n->hash == h && n->pathlen == len &&
+                memcmp(n->path, path, len) == 0))
+    n = n->hnext;
+  return n;
+}
+
+static void
+hash_insert(struct rf_memfs *m, struct rf_mnode *n) {
+  struct rf_mnode **b = &m->buckets[n->hash & (m->nbuckets - 1)];
+  n->hnext = *b;
+  *b = n;
+}
+
+static void
+hash_remove(struct rf_memfs *m, struct rf_mnode *n) {
+  struct rf_mnode **p = &m->buckets[n->hash & (m->nbuckets - 1)];
+  for (; *p; p = &(*p)->hnext) {
+    if (*p == n) {
+      *p = n->hnext;
+      return;
+    }
+  }
+}
+
+static void
+hash_grow(struct rf_memfs *m) {
+  size_t size = m->nbuckets * 2;
+  struct rf_mnode **old = m->buckets;
+  size_t oldsize = m->nbuckets;
+  size_t i;
+
+  m->buckets = calloc(size, sizeof(*m->buckets));
+  if (m->buckets == NULL) {
+    m->buckets = old;
+    return;
+  }
+  m->nbuckets = size;
+  for (i = 0; i < oldsize; i++) {
+    struct rf_mnode *n = old[i];
+    while (n) {
+      struct rf_mnode *next = n->hnext;
+      hash_insert(m, n);
+      n = next;
+    }
+  }
+  free(old);
+}
+
+static void
+node_free_data(struct rf_mnode *n) {
+  size_t i;
+  for (i = 0; i < n->nextents; i++)
+    free(n->extents[i]);
+  free(n->extents);
+  n->extents = NULL;
+  n->nextents = 0;
+  n->st.st_size = 0;
+}
+
+static void
+node_free(struct rf_mnode *n) {
+  node_free_data(n);
+  free(n);
+}
+
+/* node_detach
+ *
+ * Takes n and everything below it out of the tree. Nodes still open are
+ * freed by their last release.
+ */
+static void
+node_detach(struct rf_memfs *m, struct rf_mnode *n) {
+  while (n->child)
+    node_detach(m, n->child);
+  if (n->sib_prev) n->sib_prev->sib_next = n->sib_next;
+  else if (n->parent) n->parent->child = n->sib_next;
+  if (n->sib_next) n->sib_next->sib_prev = n->sib_prev;
+  hash_remove(m, n);
+  m->count--;
+  if (n->refs > 0)
+    n->detached = 1;
+  else
+    node_free(n);
+}
+
+static void
+default_stat(struct stat *st, mode_t mode) {
+  memset(st, 0, sizeof(*st));
+  st->st_mode = mode;
+  st->st_nlink = S_ISDIR(mode) ? 2 : 1;
+  st->st_uid = getuid();
+  st->st_gid = getgid();
+  st->st_atime = st->st_mtime = st->st_ctime = time(NULL);
+  if (S_ISDIR(mode))
+    st->st_size = 4096;
+}
+
+static struct rf_mnode *
+node_new(struct rf_memfs *m, struct rf_mnode *parent, const char *path,
+         size_t len, mode_t mode) {
+  struct rf_mnode *n = calloc(1, sizeof(*n) + len);
+  if (n == NULL)
+    return NULL;
+  memcpy(n->path, path, len);
+  n->path[len] = '\0';
+  n->pathlen = len;
+  n->hash = path_hash(path, len);
+  n->name = len ? strrchr(n->path, '/') + 1 : n->path;
+  n->complete = 1;
+  default_stat(&n->st, mode);
+
+  if (m->count >= m->nbuckets)
+    hash_grow(m);
+  hash_insert(m, n);
+  m->count++;
+
+  n->parent = parent;
+  if (parent) {
+    n->sib_next = parent->child;
+    if (parent->child) parent->child->sib_prev = n;
+    parent->child = n;
+  }
+  return n;
+}
+
+/* mkpath
+ *
+ * The directory at path, created along with any missing parents. Returns
+ * NULL if something on the way is a file.
+ */
+static struct rf_mnode *
+mkpath(struct rf_memfs *m, const char *path, size_t len) {
+  struct rf_mnode *n, *parent;
+  size_t plen;
+
+  if (len == 0)
+    return m->root;
+  n = node_find(m, path, len);
+  if (n)
+    return S_ISDIR(n->st.st_mode) ? n : NULL;
+
+  for (plen = len; plen > 0 && path[plen - 1] != '/'; plen--)
+    ;
+  parent = mkpath(m, path, plen > 0 ? plen - 1 : 0);
+  if (parent == NULL)
+    return NULL;
+  return node_new(m, parent, path, len, S_IFDIR | 0755);
+}
+
+static int
+under_prefix(struct rf_memfs *m, const char *path) {
+  size_t i;
+  for (i = 0; i < m->nprefixes; i++) {
+    size_t len = strlen(m->prefixes[i]);
+    if (strncmp(path, m->prefixes[i], len) == 0 &&
+        (path[len] == '\0' || path[len] == '/' || len == 1))
+      return 1;
+  }
+  return 0;
+}
+
+/* lookup
+ *
+ * The node for path, or NULL. *miss is set when the answer must come from
+ * the fallback instead. Called with the lock held.
+ */
+static struct rf_mnode *
+lookup(struct rf_memfs *m, const char *path, int *miss) {
+  struct rf_mnode *n;
+  size_t len = strlen(path);
+
+  *miss = 0;
+  if (under_prefix(m, path)) {
+    *miss = 1;
+    return NULL;
+  }
+  if (len == 1)
+    return m->root;
+  n = node_find(m, path, len);
+  if (n == NULL && !NIL_P(m->fallback))
+    *miss = 1;
+  return n;
+}
+
+
+/* Request side, called from any thread, without the GVL */
+
+int
+rf_memfs_getattr(struct rf_memfs *m, const char *path, struct stat *st) {
+  struct rf_mnode *n;
+  int miss;
+
+  pthread_rwlock_rdlock(&m->lock);
+  n = lookup(m, path, &miss);
+  if (n)
+    memcpy(st, &n->st, sizeof(*st));
+  pthread_rwlock_unlock(&m->lock);
+  if (miss)
+    return RF_MEMFS_MISS;
+  return n ? 0 : -ENOENT;
+}
+
+int
+rf_memfs_readdir(struct rf_memfs *m, const char *path, void *buf,
+                 fuse_fill_dir_t filler) {
+  struct rf_mnode *n, *c;
+  int miss, res = 0;
+
+  pthread_rwlock_rdlock(&m->lock);
+  n = lookup(m, path, &miss);
+  if (n && !n->complete && !NIL_P(m->fallback)) {
+    miss = 1;
+  } else if (n && !S_ISDIR(n->st.st_mode)) {
+    res = -ENOTDIR;
+  } else if (n) {
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    for (c = n->child; c; c = c->sib_next)
+      if (filler(buf, c->name, &c->st, 0))
+        break;
+  } else {
+    res = -ENOENT;
+  }
+  pthread_rwlock_unlock(&m->lock);
+  return miss ? RF_MEMFS_MISS : res;
+}
+
+/* rf_memfs_open
+ *
+ * Files in the tree are opened read-only. Opening one for writing is a
+ * change: with a fallback it is dropped from the tree and the open goes
+ * to Ruby, without one it fails with EROFS.
+ */
+int
+rf_memfs_open(struct rf_memfs *m, const char *path,
+              struct fuse_file_info *fi) {
+  struct rf_mnode *n;
+  int miss, res = 0;
+
+  if ((fi->flags & 3) != O_RDONLY || (fi->flags & O_TRUNC))
+    return rf_memfs_changed(m, path);
+
+  pthread_rwlock_rdlock(&m->lock);
+  n = lookup(m, path, &miss);
+  if (n && S_ISDIR(n->st.st_mode)) {
+    res = -EISDIR;
+  } else if (n) {
+    __sync_fetch_and_add(&n->refs, 1);
+    fi->fh = RF_MEMFS_FH | (uint64_t)(uintptr_t)n;
+    fi->direct_io = 0;
+    fi->keep_cache = 0;
+  } else {
+    res = -ENOENT;
+  }
+  pthread_rwlock_unlock(&m->lock);
+  return miss ? RF_MEMFS_MISS : res;
+}
+
+int
+rf_memfs_read(struct rf_memfs *m, uint64_t fh, char *buf, size_t size,
+              off_t offset) {
+  struct rf_mnode *n = (struct rf_mnode *)(uintptr_t)(fh & ~RF_MEMFS_FH);
+  size_t done = 0;
+
+  pthread_rwlock_rdlock(&m->lock);
+  if (offset < n->st.st_size) {
+    if ((off_t)size > n->st.st_size - offset)
+      size = n->st.st_size - offset;
+    while (done < size) {
+      off_t pos = offset + done;
+      size_t idx = pos / RF_MEMFS_EXTENT;
+      size_t in = pos % RF_MEMFS_EXTENT;
+      size_t len = RF_MEMFS_EXTENT - in;
+      if (len > size - done)
+        len = size - done;
+      memcpy(buf + done, n->extents[idx] + in, len);
+      done += len;
+    }
+  }
+  pthread_rwlock_unlock(&m->lock);
+  return (int)done;
+}
+
+void
+rf_memfs_release(struct rf_memfs *m, uint64_t fh) {
+  struct rf_mnode *n = (struct rf_mnode *)(uintptr_t)(fh & ~RF_MEMFS_FH);
+
+  pthread_rwlock_wrlock(&m->lock);
+  if (--n->refs == 0 && n->detached)
+    node_free(n);
+  pthread_rwlock_unlock(&m->lock);
+}
+
+/* rf_memfs_changed
+ *
+ * Called before a request that changes path. Returns RF_MEMFS_MISS to let
+ * the fallback do it, having dropped path from the tree, or -EROFS when
+ * there is no fallback and path is not below a passthrough prefix.
+ */
+int
+rf_memfs_changed(struct rf_memfs *m, const char *path) {
+  struct rf_mnode *n, *parent;
+  size_t len = strlen(path);
+  size_t plen;
+
+  if (NIL_P(m->fallback)) {
+    int pass;
+    pthread_rwlock_rdlock(&m->lock);
+    pass = under_prefix(m, path);
+    pthread_rwlock_unlock(&m->lock);
+    return pass ? RF_MEMFS_MISS : -EROFS;
+  }
+
+  pthread_rwlock_wrlock(&m->lock);
+  n = len > 1 ? node_find(m, path, len) : NULL;
+  if (n)
+    node_detach(m, n);
+  for (plen = len; plen > 0 && path[plen - 1] != '/'; plen--)
+    ;
+  parent = plen > 1 ? node_find(m, path, plen - 1) : m->root;
+  if (parent)
+    parent->complete = 0;
+  pthread_rwlock_unlock(&m->lock);
+  return RF_MEMFS_MISS;
+}
+
+
+/* Ruby side */
+
+static void
+memfs_mark(void *ptr) {
+  struct rf_memfs *m = ptr;
+  rb_gc_mark(m->fallback);
+}
+
+static void
+memfs_free(void *ptr) {
+  struct rf_memfs *m = ptr;
+  size_t i;
+
+  if (m->root)
+    node_detach(m, m->root);
+  for (i = 0; i < m->nprefixes; i++)
+    free(m->prefixes[i]);
+  free(m->prefixes);
+  free(m->buckets);
+  pthread_rwlock_destroy(&m->lock);
+  free(m);
+}
+
+static const rb_data_type_t memfs_type = {
+  .wrap_struct_name = "RbFuse::MemDir",
+  .function = {
+    .dmark = memfs_mark,
+    .dfree = memfs_free,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE
+memfs_alloc(VALUE klass) {
+  struct rf_memfs *m = calloc(1, sizeof(*m));
+  if (m == NULL)
+    rb_memerror();
+  pthread_rwlock_init(&m->lock, NULL);
+  m->fallback = Qnil;
+  m->nbuckets = 64;
+  m->buckets = calloc(m->nbuckets, sizeof(*m->buckets));
+  if (m->buckets)
+    m->root = node_new(m, NULL, "", 0, S_IFDIR | 0755);
+  if (m->root == NULL) {
+    free(m->buckets);
+    free(m);
+    rb_memerror();
+  }
+  return TypedData_Wrap_Struct(klass, &memfs_type, m);
+}
+
+struct rf_memfs *
+rf_memfs_get(VALUE obj) {
+  if (!rb_typeddata_is_kind_of(obj, &memfs_type))
+    return NULL;
+  return RTYPEDDATA_DATA(obj);
+}
+
+VALUE
+rf_memfs_fallback(struct rf_memfs *m) {
+  return m->fallback;
+}
+
+static struct rf_memfs *
+get_memfs(VALUE self) {
+  struct rf_memfs *m;
+  TypedData_Get_Struct(self, struct rf_memfs, &memfs_type, m);
+  return m;
+}
+
+/* Normalizes a path given to the Ruby API: "/a/b" with no trailing slash,
+ * "" for the root. */
+static VALUE
+norm_path(VALUE path) {
+  VALUE str = rb_str_dup(StringValue(path));
+  long len = RSTRING_LEN(str);
+  const char *p = RSTRING_PTR(str);
+
+  if (len == 0 || p[0] != '/')
+    rb_raise(rb_eArgError, "path must be absolute: %s", StringValueCStr(path));
+  while (len > 0 && p[len - 1] == '/')
+    len--;
+  rb_str_set_len(str, len);
+  return str;
+}
+
+static const struct stat *
+stat_arg(VALUE stat) {
+  const struct stat *st;
+  if (NIL_P(stat))
+    return NULL;
+  st = rf_stat_ptr(stat);
+  if (st == NULL)
+    rb_raise(rb_eTypeError, "expected RbFuse::Stat");
+  return st;
+}
+
+/* Applies the attributes of a RbFuse::Stat, keeping the file type and
+ * the size of files. Called with the lock held. */
+static void
+apply_stat(struct rf_mnode *n, const struct stat *st) {
+  mode_t fmt = n->st.st_mode & S_IFMT;
+  off_t size = n->st.st_size;
+
+  if (st == NULL)
+    return;
+  memcpy(&n->st, st, sizeof(*st));
+  n->st.st_mode = fmt | (st->st_mode & ~S_IFMT);
+  if (!S_ISDIR(fmt))
+    n->st.st_size = size;
+}
+
+/* MemDir#initialize(fallback = nil)
+ *
+ * fallback gets the requests the tree cannot answer, and every change.
+ */
+static VALUE
+memfs_initialize(int argc, VALUE *argv, VALUE self) {
+  VALUE fallback;
+  rb_scan_args(argc, argv, "01", &fallback);
+  get_memfs(self)->fallback = fallback;
+  return self;
+}
+
+static VALUE
+memfs_get_fallback(VALUE self) {
+  return get_memfs(self)->fallback;
+}
+
+/* MemDir#add_dir(path, stat = nil)
+ *
+ * Creates the directory path and its missing parents.
+ */
+static VALUE
+memfs_add_dir(int argc, VALUE *argv, VALUE self) {
+  struct rf_memfs *m = get_memfs(self);
+  struct rf_mnode *n;
+  VALUE path, stat;
+
+  const struct stat *st;
+
+  rb_scan_args(argc, argv, "11", &path, &stat);
+  path = norm_path(path);
+  st = stat_arg(stat);
+  pthread_rwlock_wrlock(&m->lock);
+  n = mkpath(m, RSTRING_PTR(path), RSTRING_LEN(path));
+  if (n)
+    apply_stat(n, st);
+  pthread_rwlock_unlock(&m->lock);
+  if (n == NULL)
+    rb_raise(rb_eArgError, "cannot create %s", StringValueCStr(path));
+  return self;
+}
+
+/* MemDir#add_file(path, data, stat = nil)
+ *
+ * Stores data as the contents of path, creating parent directories as
+ * needed. An existing file is replaced in place, so handles already open
+ * on it read the new contents.
+ */
+static VALUE
+memfs_add_file(int argc, VALUE *argv, VALUE self) {
+  struct rf_memfs *m = get_memfs(self);
+  struct rf_mnode *n, *parent;
+  VALUE path, data, stat;
+  const char *p;
+  long len, plen, dlen, i;
+  size_t nextents;
+  char **extents;
+  const struct stat *st;
+
+  rb_scan_args(argc, argv, "21", &path, &data, &stat);
+  path = norm_path(path);
+  StringValue(data);
+  st = stat_arg(stat);
+  p = RSTRING_PTR(path);
+  len = RSTRING_LEN(path);
+  if (len == 0)
+    rb_raise(rb_eArgError, "cannot replace the root directory");
+
+  /* Fill the extents before taking the lock. */
+  dlen = RSTRING_LEN(data);
+  nextents = (dlen + RF_MEMFS_EXTENT - 1) / RF_MEMFS_EXTENT;
+  extents = calloc(nextents ? nextents : 1, sizeof(*extents));
+  if (extents == NULL)
+    rb_memerror();
+  for (i = 0; i < (long)nextents; i++) {
+    long off = i * RF_MEMFS_EXTENT;
+    long l = dlen - off < RF_MEMFS_EXTENT ? dlen - off : RF_MEMFS_EXTENT;
+    extents[i] = malloc(RF_MEMFS_EXTENT);
+    if (extents[i] == NULL) {
+      while (i-- > 0) free(extents[i]);
+      free(extents);
+      rb_memerror();
+    }
+    memcpy(extents[i], RSTRING_PTR(data) + off, l);
+  }
+
+  pthread_rwlock_wrlock(&m->lock);
+  n = node_find(m, p, len);
+  if (n == NULL) {
+    for (plen = len; p[plen - 1] != '/'; plen--)
+      ;
+    parent = mkpath(m, p, plen - 1);
+    if (parent)
+      n = node_new(m, parent, p, len, S_IFREG | 0644);
+  } else if (S_ISDIR(n->st.st_mode)) {
+    n = NULL;
+  }
+  if (n) {
+    node_free_data(n);
+    n->extents = extents;
+    n->nextents = nextents;
+    n->st.st_size = dlen;
+    n->st.st_mtime = n->st.st_ctime = time(NULL);
+    apply_stat(n, st);
+  }
+  pthread_rwlock_unlock(&m->lock);
+
+  if (n == NULL) {
+    for (i = 0; i < (long)nextents; i++) free(extents[i]);
+    free(extents);
+    rb_raise(rb_eArgError, "cannot create %s", StringValueCStr(path));
+  }
+  return self;
+}
+
+/* MemDir#remove(path)
+ *
+ * Drops path and everything below it. With a fallback the directory it
+ * was in is listed by the fallback from then on.
+ */
+static VALUE
+memfs_remove(VALUE self, VALUE path) {
+  struct rf_memfs *m = get_memfs(self);
+  struct rf_mnode *n;
+
+  path = norm_path(path);
+  if (RSTRING_LEN(path) == 0)
+    rb_raise(rb_eArgError, "cannot remove the root directory");
+  pthread_rwlock_wrlock(&m->lock);
+  n = node_find(m, RSTRING_PTR(path), RSTRING_LEN(path));
+  if (n) {
+    if (!NIL_P(m->fallback))
+      n->parent->complete = 0;
+    node_detach(m, n);
+  }
+  pthread_rwlock_unlock(&m->lock);
+  return n ? Qtrue : Qfalse;
+}
+
+/* MemDir#passthrough(prefix)
+ *
+ * Requests for prefix and anything below it always go to the fallback.
+ */
+static VALUE
+memfs_passthrough(VALUE self, VALUE prefix) {
+  struct rf_memfs *m = get_memfs(self);
+  char **prefixes;
+  char *copy;
+
+  prefix = norm_path(prefix);
+  copy = strdup(RSTRING_LEN(prefix) ? StringValueCStr(prefix) : "/");
+  if (copy == NULL)
+    rb_memerror();
+  pthread_rwlock_wrlock(&m->lock);
+  prefixes = realloc(m->prefixes, (m->nprefixes + 1) * sizeof(*prefixes));
+  if (prefixes) {
+    prefixes[m->nprefixes++] = copy;
+    m->prefixes = prefixes;
+  }
+  pthread_rwlock_unlock(&m->lock);
+  if (prefixes == NULL) {
+    free(copy);
+    rb_memerror();
+  }
+  return self;
+}
+
+static VALUE
+memfs_include_p(VALUE self, VALUE path) {
+  struct rf_memfs *m = get_memfs(self);
+  struct rf_mnode *n;
+
+  path = norm_path(path);
+  if (RSTRING_LEN(path) == 0)
+    return Qtrue;
+  pthread_rwlock_rdlock(&m->lock);
+  n = node_find(m, RSTRING_PTR(path), RSTRING_LEN(path));
+  pthread_rwlock_unlock(&m->lock);
+  return n ? Qtrue : Qfalse;
+}
+
+/* MemDir#clear
+ *
+ * Empties the tree. The root directory counts as complete again.
+ */
+static VALUE
+memfs_clear(VALUE self) {
+  struct rf_memfs *m = get_memfs(self);
+
+  pthread_rwlock_wrlock(&m->lock);
+  while (m->root->child)
+    node_detach(m, m->root->child);
+  m->root->complete = 1;
+  pthread_rwlock_unlock(&m->lock);
+  return self;
+}
+
+static VALUE
+memfs_size(VALUE self) {
+  return SIZET2NUM(get_memfs(self)->count - 1);
+}
+
+void
+Init_rbfuse_memfs(VALUE mRbFuse) {
+  cMemDir = rb_define_class_under(mRbFuse, "MemDir", rb_cObject);
+  rb_define_alloc_func(cMemDir, memfs_alloc);
+  rb_define_method(cMemDir, "initialize",  memfs_initialize, -1);
+  rb_define_method(cMemDir, "fallback",    memfs_get_fallback, 0);
+  rb_define_method(cMemDir, "add_dir",     memfs_add_dir, -1);
+  rb_define_method(cMemDir, "add_file",    memfs_add_file, -1);
+  rb_define_method(cMemDir, "remove",      memfs_remove, 1);
+  rb_define_method(cMemDir, "passthrough", memfs_passthrough, 1);
+  rb_define_method(cMemDir, "include?",    memfs_include_p, 1);
+  rb_define_method(cMemDir, "clear",       memfs_clear, 0);
+  rb_define_method(cMemDir, "size",        memfs_size, 0);
+}
@@ -0,0 +1,38 @@
+/* rbfuse_memfs.h */
+
+/* RbFuse::MemDir, an in-memory tree served by the extension without
+ * calling into Ruby, optionally in front of a Ruby filesystem that gets
+ * everything the tree does not have. */
+
+#ifndef __RBFUSE_MEMFS_H_
+#define __RBFUSE_MEMFS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ruby.h>
+
+/* Returned instead of 0/-errno when the request must go to the fallback */
+#define RF_MEMFS_MISS 1
+
+/* Set in fuse_file_info.fh for files opened from the tree */
+#define RF_MEMFS_FH   (1ULL << 63)
+
+struct rf_memfs;
+struct fuse_file_info;
+
+void  Init_rbfuse_memfs(VALUE mRbFuse);
+struct rf_memfs *rf_memfs_get(VALUE obj);
+VALUE rf_memfs_fallback(struct rf_memfs *m);
+
+int  rf_memfs_getattr(struct rf_memfs *m, const char *path, struct stat *st);
+int  rf_memfs_readdir(struct rf_memfs *m, const char *path, void *buf,
+                      fuse_fill_dir_t filler);
+int  rf_memfs_open(struct rf_memfs *m, const char *path,
+                   struct fuse_file_info *fi);
+int  rf_memfs_read(struct rf_memfs *m, uint64_t fh, char *buf, size_t size,
+                   off_t offset);
+void rf_memfs_release(struct rf_memfs *m, uint64_t fh);
+int  rf_memfs_changed(struct rf_memfs *m, const char *path);
+
+#endif
@@ -0,0 +1,185 @@
+/* rbfuse_paths.c */
+
+/* Path intern table.
+ *
+ * A read of a file reaches Ruby as open, read x N and close, each passed
+ * the same path. Rather than a new String per call, the path is looked up
+ * here and the same frozen String is handed out again. The table is bounded
+ * and drops the least recently used path first; a dropped String lives on
+ * for as long as Ruby holds it. All calls are made with the GVL held. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ruby.h>
+
+#include "rbfuse_paths.h"
+
+#ifndef RUBY_TYPED_FREE_IMMEDIATELY
+#define RUBY_TYPED_FREE_IMMEDIATELY 0
+#endif
+
+#define RF_PATHS_DEFAULT_MAX 1024
+
+struct rf_path_entry {
+  struct rf_path_entry *hnext; /* hash chain */
+  struct rf_path_entry *prev;  /* LRU list */
+  struct rf_path_entry *next;
+  VALUE str;
+  uint32_t hash;
+  size_t len;
+  char path[1];
+};
+
+static struct {
+  struct rf_path_entry **buckets;
+  size_t nbuckets;
+  size_t count;
+  size_t max_entries;
+  struct rf_path_entry *lru_head; /* most recently used */
+  struct rf_path_entry *lru_tail;
+} paths;
+
+/* FNV-1a */
+static uint32_t
+path_hash(const char *path, size_t len) {
+  uint32_t h = 2166136261U;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)path[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static void
+lru_unlink(struct rf_path_entry *e) {
+  if (e->prev) e->prev->next = e->next;
+  else paths.lru_head = e->next;
+  if (e->next) e->next->prev = e->prev;
+  else paths.lru_tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void
+lru_push_front(struct rf_path_entry *e) {
+  e->prev = NULL;
+  e->next = paths.lru_head;
+  if (paths.lru_head) paths.lru_head->prev = e;
+  paths.lru_head = e;
+  if (paths.lru_tail == NULL) paths.lru_tail = e;
+}
+
+static struct rf_path_entry **
+find_slot(const char *path, size_t len, uint32_t h) {
+  struct rf_path_entry **slot = &paths.buckets[h & (paths.nbuckets - 1)];
+  while (*slot) {
+    struct rf_path_entry *e = *slot;
+    if (e->hash == h && e->len == len && memcmp(e->path, path, len) == 0)
+      return slot;
+    slot = &e->hnext;
+  }
+  return slot;
+}
+
+static void
+evict_lru() {
+  struct rf_path_entry *e = paths.lru_tail;
+  struct rf_path_entry **slot = find_slot(e->path, e->len, e->hash);
+  *slot = e->hnext;
+  lru_unlink(e);
+  paths.count--;
+  free(e);
+}
+
+static void
+paths_mark(void *ptr) {
+  struct rf_path_entry *e;
+  for (e = paths.lru_head; e; e = e->next)
+    rb_gc_mark(e->str);
+}
+
+static const rb_data_type_t paths_type = {
+  .wrap_struct_name = "RbFuse::PathTable",
+  .function = {
+    .dmark = paths_mark,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+/* rf_path_str
+ *
+ * The frozen String for path, shared with earlier calls for the same path
+ * while it is in the table.
+ */
+VALUE
+rf_path_str(const char *path) {
+  struct rf_path_entry **slot;
+  struct rf_path_entry *e;
+  size_t len = strlen(path);
+  uint32_t h;
+  VALUE str;
+
+  if (paths.max_entries == 0)
+    return rb_str_new(path, len);
+
+  h = path_hash(path, len);
+  slot = find_slot(path, len, h);
+  if (*slot) {
+    e = *slot;
+    lru_unlink(e);
+    lru_push_front(e);
+    return e->str;
+  }
+
+  str = rb_obj_freeze(rb_str_new(path, len));
+  if (paths.count >= paths.max_entries) {
+    evict_lru();
+    slot = find_slot(path, len, h);
+  }
+  e = malloc(sizeof(*e) + len);
+  if (e == NULL)
+    return str;
+  e->hash = h;
+  e->len = len;
+  e->str = str;
+  memcpy(e->path, path, len + 1);
+  e->hnext = NULL;
+  *slot = e;
+  lru_push_front(e);
+  paths.count++;
+  return str;
+}
+
+/* rf_paths_configure
+ *
+ * Sets how many paths are kept; 0 turns interning off. Existing entries
+ * are dropped.
+ */
+void
+rf_paths_configure(size_t max_entries) {
+  size_t nbuckets = 16;
+
+  while (paths.lru_head)
+    evict_lru();
+  free(paths.buckets);
+  paths.buckets = NULL;
+  paths.nbuckets = 0;
+  paths.max_entries = 0;
+  if (max_entries == 0)
+    return;
+
+  while (nbuckets < max_entries) nbuckets <<= 1;
+  paths.buckets = calloc(nbuckets, sizeof(*paths.buckets));
+  if (paths.buckets == NULL)
+    return;
+  paths.nbuckets = nbuckets;
+  paths.max_entries = max_entries;
+}
+
+void
+Init_rbfuse_paths(void) {
+  VALUE table = TypedData_Wrap_Struct(0, &paths_type, &paths);
+  rb_gc_register_mark_object(table);
+  rf_paths_configure(RF_PATHS_DEFAULT_MAX);
+}
@@ -0,0 +1,15 @@
+/* rbfuse_paths.h */
+
+/* Frozen path Strings, shared between the callbacks that are given the
+ * same path. */
+
+#ifndef __RBFUSE_PATHS_H_
+#define __RBFUSE_PATHS_H_
+
+#include <ruby.h>
+
+void  Init_rbfuse_paths(void);
+VALUE rf_path_str(const char *path);
+void  rf_paths_configure(size_t max_entries);
+
+#endif
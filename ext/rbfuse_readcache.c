@@ -0,0 +1,335 @@
+/* rbfuse_readcache.c */
+
+/* Block cache used in front of the Ruby read callback.
+ *
+ * The memory budget is divided into block_size slots, reused in CLOCK
+ * order: a block read since the hand last passed it gets another round,
+ * otherwise it is dropped to make room. Blocks are found through a hash on
+ * (file, block index); each file record, hashed by path, links the blocks
+ * cached for it, so a write or truncate drops them without a scan. A
+ * block shorter than block_size is the end of the file. */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rbfuse_readcache.h"
+
+struct rf_rfile {
+  struct rf_rfile *hnext;   /* hash chain */
+  struct rf_rblock *blocks; /* cached blocks of this file */
+  uint32_t hash;
+  size_t pathlen;
+  char path[1];
+};
+
+struct rf_rblock {
+  struct rf_rfile *file;    /* NULL while the slot is free */
+  struct rf_rblock *hnext;  /* hash chain */
+  struct rf_rblock *fprev;  /* blocks of the same file */
+  struct rf_rblock *fnext;
+  off_t idx;
+  size_t len;
+  int ref;                  /* read since the CLOCK hand passed */
+  char *data;               /* block_size bytes, kept when the slot is reused */
+};
+
+/* FNV-1a */
+static uint32_t
+path_hash(const char *path, size_t len) {
+  uint32_t h = 2166136261U;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)path[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static struct rf_rfile **
+find_file(struct rf_readcache *c, const char *path, size_t len, uint32_t h) {
+  struct rf_rfile **slot = &c->files[h & (c->nbuckets - 1)];
+  while (*slot) {
+    struct rf_rfile *f = *slot;
+    if (f->hash == h && f->pathlen == len && memcmp(f->path, path, len) == 0)
+      return slot;
+    slot = &f->hnext;
+  }
+  return slot;
+}
+
+static struct rf_rblock **
+find_block(struct rf_readcache *c, struct rf_rfile *f, off_t idx) {
+  size_t h = ((uintptr_t)f >> 4) ^ ((uint64_t)idx * 0x9e3779b97f4a7c15ULL);
+  struct rf_rblock **slot = &c->blocks[h & (c->nbuckets - 1)];
+  while (*slot) {
+    struct rf_rblock *b = *slot;
+    if (b->file == f && b->idx == idx)
+      return slot;
+    slot = &b->hnext;
+  }
+  return slot;
+}
+
+/* drop_block
+ *
+ * Frees the slot of b, and the record of its file with the file's last
+ * block.
+ */
+static void
+drop_block(struct rf_readcache *c, struct rf_rblock *b) {
+  struct rf_rfile *f = b->file;
+
+  *find_block(c, f, b->idx) = b->hnext;
+  if (b->fprev) b->fprev->fnext = b->fnext;
+  else f->blocks = b->fnext;
+  if (b->fnext) b->fnext->fprev = b->fprev;
+  b->file = NULL;
+  b->hnext = b->fprev = b->fnext = NULL;
+  c->used--;
+
+  if (f->blocks == NULL) {
+    *find_file(c, f->path, f->pathlen, f->hash) = f->hnext;
+    free(f);
+  }
+}
+
+static void
+drop_file(struct rf_readcache *c, struct rf_rfile *f) {
+  while (f->blocks->fnext)
+    drop_block(c, f->blocks->fnext);
+  drop_block(c, f->blocks); /* frees f */
+}
+
+/* clock_victim
+ *
+ * A free slot, evicting the first unreferenced block if there is none.
+ */
+static struct rf_rblock *
+clock_victim(struct rf_readcache *c) {
+  for (;;) {
+    struct rf_rblock *b = &c->slots[c->hand];
+    c->hand = (c->hand + 1) % c->nslots;
+    if (b->file == NULL)
+      return b;
+    if (b->ref) {
+      b->ref = 0;
+      continue;
+    }
+    drop_block(c, b);
+    c->evictions++;
+    return b;
+  }
+}
+
+void
+rf_readcache_init(struct rf_readcache *c) {
+  memset(c, 0, sizeof(*c));
+}
+
+void
+rf_readcache_clear(struct rf_readcache *c) {
+  size_t i;
+
+  c->gen++;
+  for (i = 0; i < c->nslots; i++) {
+    if (c->slots[i].file)
+      drop_block(c, &c->slots[i]);
+  }
+}
+
+/* rf_readcache_configure
+ *
+ * Sets the block size and the memory budget in bytes. Existing blocks are
+ * dropped. A block_size of 0, or a budget smaller than one block, turns
+ * the cache off.
+ */
+void
+rf_readcache_configure(struct rf_readcache *c, size_t block_size,
+                       size_t max_bytes) {
+  size_t nbuckets = 16;
+  size_t i;
+
+  rf_readcache_clear(c);
+  for (i = 0; i < c->nslots; i++)
+    free(c->slots[i].data);
+  free(c->slots);
+  free(c->blocks);
+  free(c->files);
+  c->slots = NULL;
+  c->blocks = NULL;
+  c->files = NULL;
+  c->block_size = 0;
+  c->nslots = 0;
+  c->nbuckets = 0;
+  c->hand = 0;
+
+  if (block_size == 0 || max_bytes < block_size)
+    return;
+
+  c->nslots = max_bytes / block_size;
+  while (nbuckets < c->nslots) nbuckets <<= 1;
+  c->slots = calloc(c->nslots, sizeof(*c->slots));
+  c->blocks = calloc(nbuckets, sizeof(*c->blocks));
+  c->files = calloc(nbuckets, sizeof(*c->files));
+  if (c->slots == NULL || c->blocks == NULL || c->files == NULL) {
+    free(c->slots);
+    free(c->blocks);
+    free(c->files);
+    c->slots = NULL;
+    c->blocks = NULL;
+    c->files = NULL;
+    c->nslots = 0;
+    return;
+  }
+  c->nbuckets = nbuckets;
+  c->block_size = block_size;
+}
+
+/* rf_readcache_read
+ *
+ * Copies size bytes of path at offset into buf and returns how many there
+ * were (fewer at the end of the file), or -1 unless every block needed is
+ * cached.
+ */
+int
+rf_readcache_read(struct rf_readcache *c, const char *path, char *buf,
+                  size_t size, off_t offset) {
+  struct rf_rfile *f;
+  size_t bs = c->block_size;
+  size_t copied = 0;
+  size_t len;
+
+  if (bs == 0) return -1;
+
+  len = strlen(path);
+  f = *find_file(c, path, len, path_hash(path, len));
+  if (f == NULL) {
+    c->misses++;
+    return -1;
+  }
+
+  while (copied < size) {
+    off_t pos = offset + copied;
+    struct rf_rblock *b = *find_block(c, f, pos / bs);
+    size_t boff = pos % bs;
+    size_t n;
+
+    if (b == NULL) {
+      c->misses++;
+      return -1;
+    }
+    b->ref = 1;
+    if (boff >= b->len)
+      break;
+    n = b->len - boff;
+    if (n > size - copied) n = size - copied;
+    memcpy(buf + copied, b->data + boff, n);
+    copied += n;
+    if (b->len < bs)
+      break;
+  }
+  c->hits++;
+  return (int)copied;
+}
+
+/* rf_readcache_store
+ *
+ * Caches len bytes read from path at offset, a block boundary, for a read
+ * of requested bytes; a short read marks the end of the file. Nothing is
+ * stored if the cache was invalidated since gen was taken, as the data
+ * may predate the change.
+ */
+void
+rf_readcache_store(struct rf_readcache *c, const char *path, off_t offset,
+                   const char *data, size_t len, size_t requested,
+                   unsigned long gen) {
+  size_t bs = c->block_size;
+  size_t pathlen;
+  uint32_t h;
+  size_t i;
+
+  if (bs == 0 || gen != c->gen) return;
+
+  pathlen = strlen(path);
+  h = path_hash(path, pathlen);
+  for (i = 0; i * bs < requested; i++) {
+    off_t idx = offset / bs + i;
+    size_t blen = i * bs < len ? len - i * bs : 0;
+    struct rf_rfile **fslot, *f;
+    struct rf_rblock *b;
+
+    if (blen > bs) blen = bs;
+
+    f = *find_file(c, path, pathlen, h);
+    b = f ? *find_block(c, f, idx) : NULL;
+    if (b == NULL) {
+      b = clock_victim(c);
+      if (b->data == NULL && (b->data = malloc(bs)) == NULL)
+        return;
+      fslot = find_file(c, path, pathlen, h); /* f may have been evicted */
+      if (*fslot == NULL) {
+        f = malloc(sizeof(*f) + pathlen);
+        if (f == NULL) return;
+        f->hnext = NULL;
+        f->blocks = NULL;
+        f->hash = h;
+        f->pathlen = pathlen;
+        memcpy(f->path, path, pathlen + 1);
+        *fslot = f;
+      }
+      f = *fslot;
+      b->file = f;
+      b->idx = idx;
+      b->fprev = NULL;
+      b->fnext = f->blocks;
+      if (f->blocks) f->blocks->fprev = b;
+      f->blocks = b;
+      b->hnext = NULL;
+      *find_block(c, f, idx) = b;
+      c->used++;
+    }
+    memcpy(b->data, data + i * bs, blen);
+    b->len = blen;
+    b->ref = 0;
+    if (blen < bs)
+      break;
+  }
+}
+
+void
+rf_readcache_invalidate(struct rf_readcache *c, const char *path) {
+  struct rf_rfile *f;
+  size_t len;
+
+  if (c->block_size == 0) return;
+  c->gen++;
+  len = strlen(path);
+  f = *find_file(c, path, len, path_hash(path, len));
+  if (f) drop_file(c, f);
+}
+
+/* rf_readcache_invalidate_tree
+ *
+ * Drops path and every file below it, for renames and removals of
+ * directories.
+ */
+void
+rf_readcache_invalidate_tree(struct rf_readcache *c, const char *path) {
+  size_t len, i;
+
+  if (c->block_size == 0) return;
+  c->gen++;
+  len = strlen(path);
+  for (i = 0; i < c->nbuckets; i++) {
+    struct rf_rfile *f = c->files[i];
+    while (f) {
+      struct rf_rfile *next = f->hnext;
+      if (f->pathlen >= len && memcmp(f->path, path, len) == 0 &&
+          (f->pathlen == len || f->path[len] == '/' || len == 1))
+        drop_file(c, f);
+      f = next;
+    }
+  }
+}
@@ -0,0 +1,44 @@
+/* rbfuse_readcache.h */
+
+/* A cache of file contents in fixed size blocks, keyed by path and block
+ * index, so that repeated reads of the same data do not have to call
+ * into Ruby every time. */
+
+#ifndef __RBFUSE_READCACHE_H_
+#define __RBFUSE_READCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct rf_rblock;
+struct rf_rfile;
+
+struct rf_readcache {
+  size_t block_size;        /* 0 disables the cache */
+  size_t nslots;            /* blocks that fit the memory budget */
+  size_t used;
+  size_t hand;              /* CLOCK hand */
+  size_t nbuckets;
+  struct rf_rblock *slots;
+  struct rf_rblock **blocks; /* hashed by file and index */
+  struct rf_rfile **files;   /* hashed by path */
+  unsigned long gen;        /* bumped by every invalidation */
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+};
+
+void rf_readcache_init(struct rf_readcache *c);
+void rf_readcache_configure(struct rf_readcache *c, size_t block_size,
+                            size_t max_bytes);
+int  rf_readcache_read(struct rf_readcache *c, const char *path, char *buf,
+                       size_t size, off_t offset);
+void rf_readcache_store(struct rf_readcache *c, const char *path,
+                        off_t offset, const char *data, size_t len,
+                        size_t requested, unsigned long gen);
+void rf_readcache_invalidate(struct rf_readcache *c, const char *path);
+void rf_readcache_invalidate_tree(struct rf_readcache *c, const char *path);
+void rf_readcache_clear(struct rf_readcache *c);
+
+#endif
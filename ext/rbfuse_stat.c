@@ -0,0 +1,413 @@
+/* rbfuse_stat.c
+ *
+ * RbFuse::Stat keeps its attributes in a struct stat, so that rf_getattr2
+ * can copy the whole thing at once instead of calling one Ruby method per
+ * field.
+ */
+
+#define FUSE_USE_VERSION 26
+#define _FILE_OFFSET_BITS 64
+
+#include <fuse.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <ruby.h>
+
+#include "rbfuse_fuse.h"
+#include "rbfuse_stat.h"
+
+#ifndef RUBY_TYPED_FREE_IMMEDIATELY
+#define RUBY_TYPED_FREE_IMMEDIATELY 0
+#endif
+
+static VALUE cStat = Qnil;
+static time_t stat_init_time;
+static VALUE stat_members_ary = Qnil;  /* frozen, in the order of the old Struct */
+
+static size_t
+stat_memsize(const void *ptr) {
+  return sizeof(struct stat);
+}
+
+static const rb_data_type_t stat_type = {
+  .wrap_struct_name = "RbFuse::Stat",
+  .function = {
+    .dfree = RUBY_TYPED_DEFAULT_FREE,
+    .dsize = stat_memsize,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static struct stat *
+get_st(VALUE self) {
+  struct stat *st;
+  TypedData_Get_Struct(self, struct stat, &stat_type, st);
+  return st;
+}
+
+static VALUE
+stat_alloc(VALUE klass) {
+  struct stat *st;
+  VALUE obj = TypedData_Make_Struct(klass, struct stat, &stat_type, st);
+  return obj;
+}
+
+/* rf_stat_ptr
+ *
+ * Returns the struct stat inside obj if it is a RbFuse::Stat, NULL for
+ * anything else (which the caller then reads through its accessors).
+ */
+const struct stat *
+rf_stat_ptr(VALUE obj) {
+  if (!rb_typeddata_is_kind_of(obj, &stat_type))
+    return NULL;
+  return (const struct stat *)RTYPEDDATA_DATA(obj);
+}
+
+VALUE
+rf_stat_new(const struct stat *st) {
+  VALUE obj = stat_alloc(cStat);
+  memcpy(get_st(obj), st, sizeof(struct stat));
+  return obj;
+}
+
+/* Stat#initialize
+ *
+ * Size 0, one link, owned by the user calling into the filesystem, and
+ * all times set to when RbFuse was loaded.
+ */
+static VALUE
+stat_initialize(VALUE self) {
+  struct stat *st = get_st(self);
+  int uid = fusefs_uid();
+  int gid = fusefs_gid();
+
+  memset(st, 0, sizeof(struct stat));
+  st->st_nlink = 1;
+  st->st_uid = uid < 0 ? getuid() : (uid_t)uid;
+  st->st_gid = gid < 0 ? getgid() : (gid_t)gid;
+  st->st_atime = stat_init_time;
+  st->st_mtime = stat_init_time;
+  st->st_ctime = stat_init_time;
+  return self;
+}
+
+static VALUE
+stat_init_copy(VALUE self, VALUE orig) {
+  if (self == orig) return self;
+  memcpy(get_st(self), get_st(orig), sizeof(struct stat));
+  return self;
+}
+
+static VALUE
+stat_s_file(VALUE klass) {
+  VALUE obj = rb_class_new_instance(0, NULL, klass);
+  get_st(obj)->st_mode = S_IFREG | 0666;
+  return obj;
+}
+
+static VALUE
+stat_s_dir(VALUE klass) {
+  VALUE obj = rb_class_new_instance(0, NULL, klass);
+  struct stat *st = get_st(obj);
+  st->st_mode = S_IFDIR | 0777;
+  st->st_size = 4096;
+  return obj;
+}
+
+static VALUE
+stat_s_init_time(VALUE klass) {
+  return rb_time_new(stat_init_time, 0);
+}
+
+static VALUE
+stat_perm(VALUE self) {
+  return INT2FIX(get_st(self)->st_mode & ~S_IFMT);
+}
+
+static VALUE
+stat_set_perm(VALUE self, VALUE v) {
+  struct stat *st = get_st(self);
+  st->st_mode = (st->st_mode & S_IFMT) | (NUM2INT(v) & ~S_IFMT);
+  return v;
+}
+
+static VALUE
+stat_filetype(VALUE self) {
+  return INT2FIX(get_st(self)->st_mode & S_IFMT);
+}
+
+static VALUE
+stat_set_filetype(VALUE self, VALUE v) {
+  struct stat *st = get_st(self);
+  st->st_mode = (st->st_mode & ~S_IFMT) | (NUM2INT(v) & S_IFMT);
+  return v;
+}
+
+static VALUE
+stat_size(VALUE self) {
+  return OFFT2NUM(get_st(self)->st_size);
+}
+
+static VALUE
+stat_set_size(VALUE self, VALUE v) {
+  get_st(self)->st_size = NUM2OFFT(v);
+  return v;
+}
+
+static VALUE
+stat_nlink(VALUE self) {
+  return ULONG2NUM(get_st(self)->st_nlink);
+}
+
+static VALUE
+stat_set_nlink(VALUE self, VALUE v) {
+  get_st(self)->st_nlink = NUM2ULONG(v);
+  return v;
+}
+
+static VALUE
+stat_uid(VALUE self) {
+  return UINT2NUM(get_st(self)->st_uid);
+}
+
+static VALUE
+stat_set_uid(VALUE self, VALUE v) {
+  get_st(self)->st_uid = NUM2UINT(v);
+  return v;
+}
+
+static VALUE
+stat_gid(VALUE self) {
+  return UINT2NUM(get_st(self)->st_gid);
+}
+
+static VALUE
+stat_set_gid(VALUE self, VALUE v) {
+  get_st(self)->st_gid = NUM2UINT(v);
+  return v;
+}
+
+/* Times are accepted as Time or as an Integer number of seconds. */
+static time_t
+to_time_t(VALUE v) {
+  return rb_time_timespec(v).tv_sec;
+}
+
+static VALUE
+stat_atime(VALUE self) {
+  return rb_time_new(get_st(self)->st_atime, 0);
+}
+
+static VALUE
+stat_set_atime(VALUE self, VALUE v) {
+  get_st(self)->st_atime = to_time_t(v);
+  return v;
+}
+
+static VALUE
+stat_mtime(VALUE self) {
+  return rb_time_new(get_st(self)->st_mtime, 0);
+}
+
+static VALUE
+stat_set_mtime(VALUE self, VALUE v) {
+  get_st(self)->st_mtime = to_time_t(v);
+  return v;
+}
+
+static VALUE
+stat_ctime(VALUE self) {
+  return rb_time_new(get_st(self)->st_ctime, 0);
+}
+
+static VALUE
+stat_set_ctime(VALUE self, VALUE v) {
+  get_st(self)->st_ctime = to_time_t(v);
+  return v;
+}
+
+static VALUE
+stat_inspect(VALUE self) {
+  struct stat *st = get_st(self);
+  return rb_sprintf("#<RbFuse::Stat perm=0%o filetype=0%o size=%lld nlink=%lu uid=%u gid=%u>",
+                    (unsigned)(st->st_mode & ~S_IFMT), (unsigned)(st->st_mode & S_IFMT),
+                    (long long)st->st_size, (unsigned long)st->st_nlink,
+                    (unsigned)st->st_uid, (unsigned)st->st_gid);
+}
+
+/* Struct compatibility
+ *
+ * Stat used to be a Struct of perm, filetype, size, nlink, uid, gid,
+ * mtime, atime and ctime; it keeps members, to_a, to_h, each, [], []=,
+ * == and hash with the same order and meaning.
+ */
+static VALUE
+stat_s_members(VALUE klass) {
+  return rb_ary_dup(stat_members_ary);
+}
+
+static VALUE
+stat_members(VALUE self) {
+  return rb_ary_dup(stat_members_ary);
+}
+
+static VALUE
+stat_to_a(VALUE self) {
+  VALUE ary = rb_ary_new2(9);
+  rb_ary_push(ary, stat_perm(self));
+  rb_ary_push(ary, stat_filetype(self));
+  rb_ary_push(ary, stat_size(self));
+  rb_ary_push(ary, stat_nlink(self));
+  rb_ary_push(ary, stat_uid(self));
+  rb_ary_push(ary, stat_gid(self));
+  rb_ary_push(ary, stat_mtime(self));
+  rb_ary_push(ary, stat_atime(self));
+  rb_ary_push(ary, stat_ctime(self));
+  return ary;
+}
+
+static VALUE
+stat_to_h(VALUE self) {
+  VALUE h = rb_hash_new();
+  VALUE vals = stat_to_a(self);
+  long i;
+  for (i = 0; i < RARRAY_LEN(stat_members_ary); i++)
+    rb_hash_aset(h, RARRAY_PTR(stat_members_ary)[i], RARRAY_PTR(vals)[i]);
+  return h;
+}
+
+static VALUE
+stat_each(VALUE self) {
+  VALUE vals;
+  long i;
+
+  RETURN_ENUMERATOR(self, 0, 0);
+  vals = stat_to_a(self);
+  for (i = 0; i < RARRAY_LEN(vals); i++)
+    rb_yield(RARRAY_PTR(vals)[i]);
+  return self;
+}
+
+/* stat_member
+ *
+ * The accessor named by key: a Symbol, a String or an index into
+ * members, as Struct#[] takes them.
+ */
+static ID
+stat_member(VALUE key) {
+  VALUE name;
+
+  if (FIXNUM_P(key)) {
+    long i = FIX2LONG(key);
+    long n = RARRAY_LEN(stat_members_ary);
+    if (i < 0)
+      i += n;
+    if (i < 0 || i >= n)
+      rb_raise(rb_eIndexError, "offset %ld too large for struct(size:%ld)",
+               FIX2LONG(key), n);
+    return SYM2ID(RARRAY_PTR(stat_members_ary)[i]);
+  }
+  name = SYMBOL_P(key) ? key : rb_str_intern(StringValue(key));
+  if (!RTEST(rb_ary_includes(stat_members_ary, name)))
+    rb_raise(rb_eNameError, "no member '%s' in struct",
+             rb_id2name(SYM2ID(name)));
+  return SYM2ID(name);
+}
+
+static VALUE
+stat_aref(VALUE self, VALUE key) {
+  return rb_funcall(self, stat_member(key), 0);
+}
+
+static VALUE
+stat_aset(VALUE self, VALUE key, VALUE val) {
+  VALUE setter = rb_str_cat2(rb_str_dup(rb_id2str(stat_member(key))), "=");
+  return rb_funcall(self, rb_intern_str(setter), 1, val);
+}
+
+static VALUE
+stat_equal(VALUE self, VALUE other) {
+  if (self == other)
+    return Qtrue;
+  if (!rb_typeddata_is_kind_of(other, &stat_type) ||
+      rb_obj_class(self) != rb_obj_class(other))
+    return Qfalse;
+  return rb_equal(stat_to_a(self), stat_to_a(other));
+}
+
+static VALUE
+stat_eql(VALUE self, VALUE other) {
+  if (self == other)
+    return Qtrue;
+  if (!rb_typeddata_is_kind_of(other, &stat_type) ||
+      rb_obj_class(self) != rb_obj_class(other))
+    return Qfalse;
+  return rb_eql(stat_to_a(self), stat_to_a(other)) ? Qtrue : Qfalse;
+}
+
+static VALUE
+stat_hash(VALUE self) {
+  return rb_funcall(stat_to_a(self), rb_intern("hash"), 0);
+}
+
+void
+Init_rbfuse_stat(VALUE mRbFuse, time_t init_time) {
+  static const char *const members[] = {
+    "perm", "filetype", "size", "nlink", "uid", "gid",
+    "mtime", "atime", "ctime",
+  };
+  size_t i;
+
+  stat_init_time = init_time;
+
+  cStat = rb_define_class_under(mRbFuse, "Stat", rb_cObject);
+  rb_define_alloc_func(cStat, stat_alloc);
+  rb_define_method(cStat, "initialize",      stat_initialize, 0);
+  rb_define_method(cStat, "initialize_copy", stat_init_copy, 1);
+  rb_define_singleton_method(cStat, "file",      stat_s_file, 0);
+  rb_define_singleton_method(cStat, "dir",       stat_s_dir, 0);
+  rb_define_singleton_method(cStat, "init_time", stat_s_init_time, 0);
+
+  rb_define_method(cStat, "perm",      stat_perm, 0);
+  rb_define_method(cStat, "perm=",     stat_set_perm, 1);
+  rb_define_method(cStat, "filetype",  stat_filetype, 0);
+  rb_define_method(cStat, "filetype=", stat_set_filetype, 1);
+  rb_define_method(cStat, "size",      stat_size, 0);
+  rb_define_method(cStat, "size=",     stat_set_size, 1);
+  rb_define_method(cStat, "nlink",     stat_nlink, 0);
+  rb_define_method(cStat, "nlink=",    stat_set_nlink, 1);
+  rb_define_method(cStat, "uid",       stat_uid, 0);
+  rb_define_method(cStat, "uid=",      stat_set_uid, 1);
+  rb_define_method(cStat, "gid",       stat_gid, 0);
+  rb_define_method(cStat, "gid=",      stat_set_gid, 1);
+  rb_define_method(cStat, "atime",     stat_atime, 0);
+  rb_define_method(cStat, "atime=",    stat_set_atime, 1);
+  rb_define_method(cStat, "mtime",     stat_mtime, 0);
+  rb_define_method(cStat, "mtime=",    stat_set_mtime, 1);
+  rb_define_method(cStat, "ctime",     stat_ctime, 0);
+  rb_define_method(cStat, "ctime=",    stat_set_ctime, 1);
+  rb_define_method(cStat, "inspect",   stat_inspect, 0);
+
+  stat_members_ary = rb_ary_new2(9);
+  for (i = 0; i < sizeof(members) / sizeof(members[0]); i++)
+    rb_ary_push(stat_members_ary, ID2SYM(rb_intern(members[i])));
+  rb_obj_freeze(stat_members_ary);
+  rb_gc_register_mark_object(stat_members_ary);
+
+  rb_include_module(cStat, rb_mEnumerable);
+  rb_define_singleton_method(cStat, "members", stat_s_members, 0);
+  rb_define_method(cStat, "members",   stat_members, 0);
+  rb_define_method(cStat, "to_a",      stat_to_a, 0);
+  rb_define_method(cStat, "values",    stat_to_a, 0);
+  rb_define_method(cStat, "deconstruct", stat_to_a, 0);
+  rb_define_method(cStat, "to_h",      stat_to_h, 0);
+  rb_define_method(cStat, "each",      stat_each, 0);
+  rb_define_method(cStat, "[]",        stat_aref, 1);
+  rb_define_method(cStat, "[]=",       stat_aset, 2);
+  rb_define_method(cStat, "==",        stat_equal, 1);
+  rb_define_method(cStat, "eql?",      stat_eql, 1);
+  rb_define_method(cStat, "hash",      stat_hash, 0);
+}
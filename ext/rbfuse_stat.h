@@ -0,0 +1,15 @@
+/* rbfuse_stat.h */
+
+/* RbFuse::Stat, a Ruby object wrapping a struct stat. */
+
+#ifndef __RBFUSE_STAT_H_
+#define __RBFUSE_STAT_H_
+
+#include <sys/stat.h>
+#include <ruby.h>
+
+void Init_rbfuse_stat(VALUE mRbFuse, time_t init_time);
+const struct stat *rf_stat_ptr(VALUE obj);
+VALUE rf_stat_new(const struct stat *st);
+
+#endif
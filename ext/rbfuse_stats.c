@@ -0,0 +1,181 @@
+/* rbfuse_stats.c */
+
+/* Request metrics.
+ *
+ * A request is timed from the moment its command has been read until
+ * libfuse has replied (rf_stats_request_begin/end, in rbfuse_fuse.c). An
+ * operation that reaches Ruby is timed again from its *_dispatch wrapper
+ * (rf_stats_call_begin), to when the GVL is held and the callback starts
+ * (rf_stats_op_begin), to when it returns (rf_stats_op_end). The
+ * callback's time goes to the "ruby" histogram of the operation and the
+ * rest of the request to its "fuse" histogram.
+ *
+ * The counters are updated from worker threads without the GVL, so they
+ * are bumped with relaxed atomics; a snapshot may be off by the requests
+ * in flight. Costs four clock_gettime(CLOCK_MONOTONIC) per request. */
+
+#include <string.h>
+#include <time.h>
+
+#include "rbfuse_stats.h"
+
+int rf_stats_enabled = 1;
+struct rf_opstat rf_opstats[RF_STATS_OPS];
+struct rf_hist rf_request_hist;
+unsigned long rf_errno_counts[RF_STATS_ERRNOS];
+
+#define ADD(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+
+/* Per thread: the request being processed */
+static __thread struct {
+  uint64_t start;    /* 0 when not timing */
+  uint64_t call;     /* entry to the dispatch wrapper */
+  uint64_t op_start;
+  uint64_t ruby_ns;
+  int op;            /* -1 until an operation reached Ruby */
+} cur;
+
+static uint64_t
+now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+bucket_of(uint64_t ns) {
+  int e, i;
+
+  if (ns < 1024)
+    return 0;
+  e = 63 - __builtin_clzll(ns);
+  i = (e - 10) * 4 + (int)((ns >> (e - 2)) & 3) + 1;
+  return i < RF_HIST_BUCKETS ? i : RF_HIST_BUCKETS - 1;
+}
+
+/* rf_hist_bucket_limit
+ *
+ * The largest value, in nanoseconds, counted in bucket i.
+ */
+uint64_t
+rf_hist_bucket_limit(int i) {
+  int e, sub;
+
+  if (i == 0)
+    return 1023;
+  if (i >= RF_HIST_BUCKETS - 1)
+    return UINT64_MAX;
+  e = (i - 1) / 4 + 10;
+  sub = (i - 1) % 4;
+  return ((uint64_t)(4 + sub + 1) << (e - 2)) - 1;
+}
+
+/* rf_hist_percentile
+ *
+ * The upper bound of the bucket holding the p-th (0..1) value, capped at
+ * the largest value seen.
+ */
+uint64_t
+rf_hist_percentile(const struct rf_hist *h, double p) {
+  unsigned long want, seen = 0;
+  int i;
+
+  if (h->count == 0)
+    return 0;
+  want = (unsigned long)(p * h->count);
+  if (want >= h->count) want = h->count - 1;
+  for (i = 0; i < RF_HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen > want)
+      break;
+  }
+  if (i == RF_HIST_BUCKETS || rf_hist_bucket_limit(i) > h->max_ns)
+    return h->max_ns;
+  return rf_hist_bucket_limit(i);
+}
+
+static void
+hist_add(struct rf_hist *h, uint64_t ns) {
+  uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+
+  ADD(h->count, 1);
+  ADD(h->sum_ns, ns);
+  ADD(h->buckets[bucket_of(ns)], 1);
+  while (ns > max &&
+         !__atomic_compare_exchange_n(&h->max_ns, &max, ns, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+void
+rf_stats_request_begin(void) {
+  cur.start = rf_stats_enabled ? now_ns() : 0;
+  cur.call = 0;
+  cur.ruby_ns = 0;
+  cur.op = -1;
+}
+
+void
+rf_stats_request_end(void) {
+  uint64_t total;
+
+  if (cur.start == 0)
+    return;
+  total = now_ns() - cur.start;
+  hist_add(&rf_request_hist, total);
+  if (cur.op >= 0)
+    hist_add(&rf_opstats[cur.op].fuse,
+             total > cur.ruby_ns ? total - cur.ruby_ns : 0);
+  cur.start = 0;
+}
+
+void
+rf_stats_call_begin(void) {
+  if (rf_stats_enabled)
+    cur.call = now_ns();
+}
+
+void
+rf_stats_op_begin(int op) {
+  if (!rf_stats_enabled)
+    return;
+  cur.op_start = now_ns();
+  if (cur.call) {
+    hist_add(&rf_opstats[op].wait, cur.op_start - cur.call);
+    cur.call = 0;
+  }
+}
+
+/* rf_stats_op_end
+ *
+ * ret is what the operation returned: -errno, or with counts_bytes the
+ * number of bytes read or written.
+ */
+void
+rf_stats_op_end(int op, int ret, int counts_bytes) {
+  struct rf_opstat *s = &rf_opstats[op];
+  uint64_t ns;
+
+  ADD(s->calls, 1);
+  if (ret < 0) {
+    ADD(s->errors, 1);
+    if (-ret < RF_STATS_ERRNOS)
+      ADD(rf_errno_counts[-ret], 1);
+  } else if (counts_bytes) {
+    ADD(s->bytes, (uint64_t)ret);
+  }
+  if (!rf_stats_enabled || cur.op_start == 0)
+    return;
+  ns = now_ns() - cur.op_start;
+  hist_add(&s->ruby, ns);
+  cur.op_start = 0;
+  cur.op = op;
+  cur.ruby_ns += ns;
+}
+
+void
+rf_stats_reset(void) {
+  memset(rf_opstats, 0, sizeof(rf_opstats));
+  memset(&rf_request_hist, 0, sizeof(rf_request_hist));
+  memset(rf_errno_counts, 0, sizeof(rf_errno_counts));
+}
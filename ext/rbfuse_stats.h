@@ -0,0 +1,49 @@
+/* rbfuse_stats.h */
+
+/* Request metrics for RbFuse.stats: per operation counters and latency
+ * histograms, split between the Ruby callback and everything around it
+ * (libfuse, waiting for the GVL, the reply). */
+
+#ifndef __RBFUSE_STATS_H_
+#define __RBFUSE_STATS_H_
+
+#include <stdint.h>
+
+#define RF_STATS_OPS     24  /* at least RF_OP_MAX */
+#define RF_STATS_ERRNOS  134 /* errno values counted one by one */
+#define RF_HIST_BUCKETS  108
+
+/* Log-linear latency histogram: four buckets per power of two from 1us,
+ * everything below in bucket 0, everything above ~68s in the last. */
+struct rf_hist {
+  unsigned long count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  unsigned long buckets[RF_HIST_BUCKETS];
+};
+
+struct rf_opstat {
+  unsigned long calls;
+  unsigned long errors;
+  uint64_t bytes;         /* read and write only */
+  struct rf_hist ruby;    /* in the callback */
+  struct rf_hist wait;    /* from entering the op until the GVL was held */
+  struct rf_hist fuse;    /* rest of the request, outside Ruby */
+};
+
+extern int rf_stats_enabled;
+extern struct rf_opstat rf_opstats[RF_STATS_OPS];
+extern struct rf_hist rf_request_hist;
+extern unsigned long rf_errno_counts[RF_STATS_ERRNOS];
+
+void rf_stats_request_begin(void);
+void rf_stats_request_end(void);
+void rf_stats_call_begin(void);
+void rf_stats_op_begin(int op);
+void rf_stats_op_end(int op, int ret, int counts_bytes);
+void rf_stats_reset(void);
+
+uint64_t rf_hist_bucket_limit(int i);
+uint64_t rf_hist_percentile(const struct rf_hist *h, double p);
+
+#endif
@@ -0,0 +1,199 @@
+/* rbfuse_trace.c */
+
+/* Request trace.
+ *
+ * While tracing, each request is described in a thread local record as it
+ * goes along - started in mount_process, given its operation and
+ * result by the dispatch layer and its path, offset and size by the
+ * operation itself - and copied into the ring when it is done. Writers
+ * claim a slot with one atomic increment and publish it by storing its
+ * sequence number last; a reader copies a slot and keeps it only if the
+ * sequence number was the expected one before and after. Nothing blocks,
+ * and a slot overwritten during a dump is just left out.
+ *
+ * Restarting with a different size replaces the ring. The old one is not
+ * freed, as a request already past the rf_trace_on check may still be
+ * writing to it. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rbfuse_trace.h"
+
+struct rf_trace_ring {
+  uint64_t head;  /* records ever claimed */
+  size_t mask;
+  struct rf_trace_rec recs[1];
+};
+
+int rf_trace_on = 0;
+static struct rf_trace_ring *ring = NULL;
+static uint16_t next_thread = 0;
+
+static __thread struct {
+  uint64_t start;  /* 0 when not tracing this request */
+  uint64_t path_hash;
+  uint64_t offset;
+  uint64_t size;
+  int op;
+  int pid;
+  int result;
+  uint16_t thread;
+} cur;
+
+static uint64_t
+now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* FNV-1a, 64 bit */
+static uint64_t
+path_hash(const char *path) {
+  uint64_t h = 14695981039346656037ULL;
+  while (*path) {
+    h ^= (unsigned char)*path++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/* rf_trace_start
+ *
+ * Starts tracing into a ring of at least records entries (rounded up to a
+ * power of two), dropping what was traced so far.
+ */
+int
+rf_trace_start(size_t records) {
+  struct rf_trace_ring *r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+  size_t n = 64;
+
+  while (n < records) n <<= 1;
+  if (r && r->mask + 1 == n) {
+    __atomic_store_n(&r->head, 0, __ATOMIC_RELEASE);
+  } else {
+    r = calloc(1, sizeof(*r) + (n - 1) * sizeof(struct rf_trace_rec));
+    if (r == NULL)
+      return -1;
+    r->mask = n - 1;
+    __atomic_store_n(&ring, r, __ATOMIC_RELEASE);
+  }
+  rf_trace_on = 1;
+  return 0;
+}
+
+void
+rf_trace_stop(void) {
+  rf_trace_on = 0;
+}
+
+size_t
+rf_trace_capacity(void) {
+  struct rf_trace_ring *r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+  return r ? r->mask + 1 : 0;
+}
+
+/* rf_trace_snapshot
+ *
+ * Copies up to max of the latest records into out, oldest first, and
+ * returns how many.
+ */
+size_t
+rf_trace_snapshot(struct rf_trace_rec *out, size_t max) {
+  struct rf_trace_ring *r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+  uint64_t head, i, n;
+  size_t count = 0;
+
+  if (r == NULL)
+    return 0;
+  head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  n = head < r->mask + 1 ? head : r->mask + 1;
+  if (n > max) n = max;
+  for (i = head - n; i < head; i++) {
+    struct rf_trace_rec *rec = &r->recs[i & r->mask];
+    uint64_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    if (seq != i + 1)
+      continue;
+    memcpy(&out[count], rec, sizeof(*rec));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq)
+      continue;
+    count++;
+  }
+  return count;
+}
+
+void
+rf_trace_request_begin(void) {
+  if (!rf_trace_on) {
+    cur.start = 0;
+    return;
+  }
+  cur.start = now_ns();
+  cur.path_hash = 0;
+  cur.offset = 0;
+  cur.size = 0;
+  cur.op = RF_TRACE_OTHER;
+  cur.pid = 0;
+  cur.result = 0;
+}
+
+void
+rf_trace_op(int op, int pid) {
+  if (cur.start == 0)
+    return;
+  cur.op = op;
+  cur.pid = pid > 0 ? pid : 0;
+}
+
+void
+rf_trace_args(const char *path, uint64_t offset, uint64_t size) {
+  if (cur.start == 0)
+    return;
+  cur.path_hash = path ? path_hash(path) : 0;
+  cur.offset = offset;
+  cur.size = size;
+}
+
+void
+rf_trace_result(int ret) {
+  if (cur.start == 0)
+    return;
+  cur.result = ret;
+}
+
+void
+rf_trace_request_end(void) {
+  struct rf_trace_ring *r;
+  struct rf_trace_rec *rec;
+  uint64_t idx, end;
+
+  if (cur.start == 0)
+    return;
+  end = now_ns();
+  r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+  if (r == NULL || !rf_trace_on) {
+    cur.start = 0;
+    return;
+  }
+  if (cur.thread == 0)
+    cur.thread = __atomic_add_fetch(&next_thread, 1, __ATOMIC_RELAXED);
+
+  idx = __atomic_fetch_add(&r->head, 1, __ATOMIC_RELAXED);
+  rec = &r->recs[idx & r->mask];
+  __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  rec->start_ns = cur.start;
+  rec->dur_ns = end - cur.start;
+  rec->path_hash = cur.path_hash;
+  rec->offset = cur.offset;
+  rec->size = (uint32_t)cur.size;
+  rec->pid = cur.pid;
+  rec->result = cur.result;
+  rec->op = (uint16_t)cur.op;
+  rec->thread = cur.thread;
+  __atomic_store_n(&rec->seq, idx + 1, __ATOMIC_RELEASE);
+  cur.start = 0;
+}
@@ -0,0 +1,42 @@
+/* rbfuse_trace.h */
+
+/* Request trace for RbFuse.trace: a fixed size ring of binary records,
+ * one per request, written without locks from every thread. */
+
+#ifndef __RBFUSE_TRACE_H_
+#define __RBFUSE_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RF_TRACE_OTHER 0xffff /* request that did not reach a callback */
+
+/* One request. Written to RbFuse.trace_dump files as is (host order). */
+struct rf_trace_rec {
+  uint64_t seq;       /* position in the trace + 1, 0 while being written */
+  uint64_t start_ns;  /* CLOCK_MONOTONIC */
+  uint64_t dur_ns;
+  uint64_t path_hash; /* FNV-1a of the path, 0 if none */
+  uint64_t offset;
+  uint32_t size;
+  int32_t pid;        /* of the process making the request, 0 if unknown */
+  int32_t result;     /* 0, -errno, or bytes for read and write */
+  uint16_t op;        /* enum rf_op, or RF_TRACE_OTHER */
+  uint16_t thread;    /* numbered in order of first request */
+  uint32_t reserved[2];
+};
+
+extern int rf_trace_on;
+
+int    rf_trace_start(size_t records);
+void   rf_trace_stop(void);
+size_t rf_trace_capacity(void);
+size_t rf_trace_snapshot(struct rf_trace_rec *out, size_t max);
+
+void rf_trace_request_begin(void);
+void rf_trace_request_end(void);
+void rf_trace_op(int op, int pid);
+void rf_trace_args(const char *path, uint64_t offset, uint64_t size);
+void rf_trace_result(int ret);
+
+#endif
@@ -5,53 +5,99 @@
 # This includes helper functions, common uses, etc.
 
 require 'rbfuse_lib'
+require 'tempfile'
 
 module RbFuse
   @running = true
-  def self.run
+
+  # Processes FUSE requests, for every mount of the process (mount_to and
+  # RbFuse::Mount.new), until RbFuse.exit is called.
+  #
+  # With :threads => n (n > 1), requests are handled by n threads running
+  # RbFuse.worker_loop, so a callback waiting on its backend does not stop
+  # the others. With :scheduler => s, by Fibers under the Fiber::Scheduler
+  # s (see run_scheduler). Otherwise everything runs on the calling thread,
+  # in RbFuse.main_loop where available.
+  def self.run(opts = {})
     @mounted_at=Time.now
-    fd = RbFuse.fuse_fd
-    io = IO.for_fd(fd)
-    while @running
-      IO.select([io])
+    if opts[:scheduler]
+      run_scheduler(opts[:scheduler])
+      return
+    end
+    threads = opts[:threads].to_i
+    if threads > 1
+      run_workers(threads)
+      return
+    end
+    if respond_to?(:main_loop)
+      main_loop
+      return
+    end
+    io = nil
+    while @running && (io = fuse_io(io))
+      # a signal caught by the extension is acted on in process, so the
+      # wait is bounded
+      IO.select([io], nil, nil, 1)
       self.process
     end
   end
+  # An IO for RbFuse.fuse_fd, reusing io while the descriptor is the same,
+  # or nil once nothing is mounted. fuse_fd raises if the mounts cannot be
+  # watched through one descriptor (several mounts without epoll).
+  def self.fuse_io(io)
+    fd = RbFuse.fuse_fd
+    return nil unless fd
+    return io if io && io.fileno == fd
+    # the descriptor belongs to the extension
+    IO.for_fd(fd, :autoclose => false)
+  end
+  private_class_method :fuse_io
+  def self.run_workers(count)
+    workers = Array.new(count) { Thread.new { RbFuse.worker_loop } }
+    workers.each { |t| t.join }
+  ensure
+    stop_workers
+    workers.each { |t| t.join rescue nil } if workers
+  end
+  # Reads requests in a non-blocking Fiber under scheduler. On a
+  # :lowlevel mount every read, write and getattr then runs in a Fiber of
+  # its own (RbFuse.fiber_call), so callbacks waiting on sockets overlap
+  # on one thread; other callbacks run in the reading Fiber.
+  def self.run_scheduler(scheduler)
+    require 'io/wait'
+    Fiber.set_scheduler(scheduler)
+    Fiber.schedule do
+      io = nil
+      while @running && (io = fuse_io(io))
+        io.wait_readable(1)
+        RbFuse.process
+      end
+    end
+  ensure
+    # runs the scheduler until every Fiber has finished
+    Fiber.set_scheduler(nil)
+  end
+  # Called by the extension for a deferred request: runs root.name(*args)
+  # in a new Fiber and replies with its result. A StandardError fails the
+  # request through RbFuse.reply_error, with the errno of a SystemCallError
+  # or EIO. Returns true once the Fiber is started; if it cannot be, the
+  # extension fails the request.
+  def self.fiber_call(token, root, name, args)
+    Fiber.schedule do
+      begin
+        RbFuse.reply(token, root.__send__(name, *args))
+      rescue StandardError => e
+        RbFuse.reply_error(token, e)
+      end
+    end
+    true
+  end
   def self.unmount
     system("fusermount -u #{@mountpoint}")
   end
   def self.exit
     @running = false
-  end
-  Stat=Struct.new(:perm,:filetype,:size,:nlink,:uid,:gid,:mtime,:atime,:ctime)
-
-  class Stat
-    def self.init_time
-      @@init_time||=Time.now
-      @@init_time
-    end
-    def initialize
-      self.size=0
-      self.nlink=1
-      self.uid=RbFuse.uid
-      self.gid=RbFuse.gid
-      self.atime=self.class.init_time
-      self.mtime=self.class.init_time
-      self.ctime=self.class.init_time
-    end
-    def self.file
-       result=self.new
-       result.perm=0666
-       result.filetype=RbFuse::S_IFREG
-       result
-    end
-    def self.dir
-      result=self.new
-      result.size=4096
-      result.perm=0777
-      result.filetype=RbFuse::S_IFDIR
-      result
-    end
+    stop_workers
   end
 
   class FuseDir
@@ -67,49 +113,99 @@ module RbFuse
       path.scan(/[^\/]+/)
     end
 
+    # Largest piece of a file held in memory while rename and truncate
+    # copy its contents.
+    COPY_CHUNK = 1024 * 1024
+
+    # Moves path to destpath by copying its contents, COPY_CHUNK bytes at
+    # a time, and unlinking it. A root with rename_native(path, destpath)
+    # has that called instead, by RbFuse and by this method.
     def rename(path,destpath)
-      
-      fhr=Object.new
-      stat=self.stat(path)
+      return rename_native(path,destpath) if respond_to?(:rename_native)
+      stat=getattr(path)
       return nil unless stat
-      self.open(path,"r",fhr)
-      file=self.read(path,0,stat.size,fhr)
-      self.close(path,fhr)
-
-      fh=Object.new
-      self.open(destpath,"w",fh)
-      self.write(destpath,0,file,fh)
-      self.close(destpath,fh)
-      self.delete(path)
+      fhr=Handle.new
+      return nil unless open(path,"r",fhr)
+      fhw=Handle.new
+      unless open(destpath,"w",fhw)
+        close(path,fhr)
+        return nil
+      end
+      copy_chunks(path,fhr,destpath,fhw,stat.size)
+      close(path,fhr)
+      close(destpath,fhw)
+      unlink(path)
       true
     end
 
-
+    # Cuts path down to len bytes by reading what is kept into a Tempfile
+    # and writing it back to the file reopened with "w", or extends it
+    # with zeros written in chunks. A root with truncate_native(path, len)
+    # has that called instead.
     def truncate(path,len)
-      fh=Object.new
-      open(path,"r",fh)
-      str=read(path,0,len,fh)
-      close(path,fh)
-      return nil unless str
-      if(str.bytesize<len)
-        str+="\0"*len-str.bytesize
-      else
-        str=str[0,len]
+      return truncate_native(path,len) if respond_to?(:truncate_native)
+      stat=getattr(path)
+      return nil unless stat
+      return true if len==stat.size
+      if len>stat.size
+        fh=Handle.new
+        return nil unless open(path,"wr",fh)
+        off=stat.size
+        while off<len
+          n=[COPY_CHUNK,len-off].min
+          write(path,off,"\0"*n,fh)
+          off+=n
+        end
+        close(path,fh)
+        return true
+      end
+      # what is kept is read out before the file is reopened with "w",
+      # which may empty it straight away
+      kept=Tempfile.new("rbfuse")
+      kept.binmode
+      begin
+        fhr=Handle.new
+        return nil unless open(path,"r",fhr)
+        off=0
+        while off<len
+          chunk=read(path,off,[COPY_CHUNK,len-off].min,fhr)
+          break if chunk.nil? || chunk.empty?
+          kept.write(chunk)
+          off+=chunk.bytesize
+        end
+        close(path,fhr)
+        fhw=Handle.new
+        return nil unless open(path,"w",fhw)
+        kept.rewind
+        off=0
+        while (chunk=kept.read(COPY_CHUNK))
+          write(path,off,chunk,fhw)
+          off+=chunk.bytesize
+        end
+        close(path,fhw)
+        true
+      ensure
+        kept.close!
       end
-      fh2=Object.new
-      open(path,"w",fh2)
-      write(path,0,str,fh2)
-      close(path,fh2) 
-      true
     end
 
-
     def create(path,mode)
-      handle=Object.new
+      handle=Handle.new
       self.open(path,"w",handle)
       self.write(path,0,"",handle)
       self.close(path,handle)
     end
 
+    private
+
+    def copy_chunks(src,fhr,dest,fhw,size)
+      off=0
+      while off<size
+        chunk=read(src,off,[COPY_CHUNK,size-off].min,fhr)
+        break if chunk.nil? || chunk.empty?
+        write(dest,off,chunk,fhw)
+        off+=chunk.bytesize
+      end
+    end
   end
 end
@@ -0,0 +1,74 @@
+require File.expand_path(File.dirname(__FILE__) + '/spec_helper')
+
+# A FuseDir kept in a Hash that writes straight through: opening a file
+# with "w" empties it at once.
+class HashDir < RbFuse::FuseDir
+  attr_reader :files
+
+  def initialize(files)
+    @files = files
+  end
+
+  def getattr(path)
+    return nil unless @files[path]
+    st = RbFuse::Stat.file
+    st.size = @files[path].bytesize
+    st
+  end
+
+  def open(path, mode, handle)
+    @files[path] = "" if mode.include?("w") && !mode.include?("r")
+    true
+  end
+
+  def read(path, off, size, handle)
+    @files[path].byteslice(off, size)
+  end
+
+  def write(path, off, str, handle)
+    @files[path][off, str.bytesize] = str
+    str.bytesize
+  end
+
+  def close(path, handle)
+    true
+  end
+
+  def unlink(path)
+    @files.delete(path)
+    true
+  end
+end
+
+describe "RbFuse::FuseDir" do
+  before do
+    @dir = HashDir.new("/f" => "0123456789")
+  end
+
+  it "keeps the first len bytes when truncating a file that is emptied on open" do
+    @dir.truncate("/f", 4).should == true
+    @dir.files["/f"].should == "0123"
+  end
+
+  it "empties the file when truncating to 0" do
+    @dir.truncate("/f", 0).should == true
+    @dir.files["/f"].should == ""
+  end
+
+  it "extends the file with zeros" do
+    @dir.truncate("/f", 12).should == true
+    @dir.files["/f"].should == "0123456789\0\0"
+  end
+
+  it "keeps files larger than one copy chunk" do
+    data = "ab" * RbFuse::FuseDir::COPY_CHUNK
+    @dir.files["/f"] = data.dup
+    @dir.truncate("/f", data.bytesize - 3).should == true
+    @dir.files["/f"].should == data[0, data.bytesize - 3]
+  end
+
+  it "renames by copying and unlinking" do
+    @dir.rename("/f", "/g").should == true
+    @dir.files.should == { "/g" => "0123456789" }
+  end
+end
@@ -0,0 +1,71 @@
+require File.expand_path(File.dirname(__FILE__) + '/spec_helper')
+
+describe "RbFuse::Stat" do
+  before do
+    @file = RbFuse::Stat.file
+    @dir = RbFuse::Stat.dir
+  end
+
+  it "describes an empty file owned by the caller for Stat.file" do
+    @file.filetype.should == RbFuse::S_IFREG
+    @file.perm.should == 0666
+    @file.size.should == 0
+    @file.nlink.should == 1
+    @file.uid.should == Process.uid
+    @file.gid.should == Process.gid
+    @file.mtime.should == RbFuse::Stat.init_time
+    @file.atime.should == RbFuse::Stat.init_time
+    @file.ctime.should == RbFuse::Stat.init_time
+  end
+
+  it "describes a directory for Stat.dir" do
+    @dir.filetype.should == RbFuse::S_IFDIR
+    @dir.perm.should == 0777
+    @dir.size.should == 4096
+    @dir.nlink.should == 1
+  end
+
+  it "keeps the member order of the Struct it replaces" do
+    members = [:perm, :filetype, :size, :nlink, :uid, :gid,
+               :mtime, :atime, :ctime]
+    RbFuse::Stat.members.should == members
+    @file.members.should == members
+    @file.to_a.should == members.map { |m| @file.__send__(m) }
+    @file.to_h.keys.should == members
+    @file.each.to_a.should == @file.to_a
+  end
+
+  it "reads and writes members by Symbol, String and index" do
+    @file[:size] = 10
+    @file["size"].should == 10
+    @file[2].should == 10
+    @file[-1].should == @file.ctime
+    @file["nlink"] = 3
+    @file.nlink.should == 3
+    lambda { @file[9] }.should raise_error(IndexError)
+    lambda { @file[-10] }.should raise_error(IndexError)
+    lambda { @file[:blocks] }.should raise_error(NameError)
+    lambda { @file["blocks"] = 1 }.should raise_error(NameError)
+  end
+
+  it "compares by value" do
+    other = RbFuse::Stat.file
+    (@file == other).should == true
+    @file.eql?(other).should == true
+    @file.hash.should == other.hash
+    (@file == @dir).should == false
+    other.size = 1
+    (@file == other).should == false
+    @file.eql?(other).should == false
+    (@file == @file.to_a).should == false
+  end
+
+  it "keeps the file type out of perm and the permissions out of filetype" do
+    @file.perm = RbFuse::S_IFDIR | 0644
+    @file.perm.should == 0644
+    @file.filetype.should == RbFuse::S_IFREG
+    @file.filetype = RbFuse::S_IFDIR | 0755
+    @file.filetype.should == RbFuse::S_IFDIR
+    @file.perm.should == 0644
+  end
+end